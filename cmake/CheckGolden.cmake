@@ -0,0 +1,12 @@
+# Compares a rendered image against its recorded SHA-256.
+# Usage: cmake -DIMAGE=<file> -DEXPECTED_SHA256=<hex> -P CheckGolden.cmake
+if(NOT EXISTS "${IMAGE}")
+  message(FATAL_ERROR "Golden image not rendered: ${IMAGE}")
+endif()
+file(SHA256 "${IMAGE}" actual)
+if(NOT actual STREQUAL EXPECTED_SHA256)
+  message(FATAL_ERROR
+    "Golden image mismatch for ${IMAGE}\n"
+    "  expected ${EXPECTED_SHA256}\n"
+    "  actual   ${actual}")
+endif()
@@ -1,10 +1,14 @@
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cctype>
+#include <csignal>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <optional>
@@ -16,14 +20,20 @@
 #include <random>
 #include <limits>
 #include <memory>
+#include <new>
 #include <map>
+#include <mutex>
 #include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
+#include <cstddef>
 #include <cstdlib>
 #include <chrono>
 #include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -39,10 +49,145 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define PYPP_X86_SIMD 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC/Clang need per-function ISA attributes for kernels picked at runtime;
+// MSVC accepts the intrinsics without them.
+#if defined(PYPP_X86_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#define PYPP_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PYPP_TARGET(isa)
+#endif
+
+#ifdef PYPP_COUNT_ALLOCATIONS
+// Only the pypp_bench target replaces the global allocator, so the shipping
+// interpreter does not pay for the counter. Every form is replaced, array,
+// nothrow and aligned ones included, so each delete frees memory the
+// matching new took from the same allocator.
+namespace pypp {
+// Heap allocations made through operator new, for `pypp bench alloc`.
+std::atomic<std::uint64_t> g_heap_allocations{0};
+
+void* CountedAlloc(std::size_t size, std::size_t align) noexcept {
+  g_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (size == 0) {
+    size = 1;
+  }
+  if (align <= alignof(std::max_align_t)) {
+    return std::malloc(size);
+  }
+#ifdef _WIN32
+  return _aligned_malloc(size, align);
+#else
+  // aligned_alloc wants a size that is a multiple of the alignment.
+  return std::aligned_alloc(align, (size + align - 1) / align * align);
+#endif
+}
+
+void CountedFree(void* p, std::size_t align) noexcept {
+#ifdef _WIN32
+  if (align > alignof(std::max_align_t)) {
+    _aligned_free(p);
+    return;
+  }
+#else
+  (void)align;
+#endif
+  std::free(p);
+}
+
+void* CountedNew(std::size_t size, std::size_t align) {
+  for (;;) {
+    if (void* p = CountedAlloc(size, align)) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void* CountedNewNothrow(std::size_t size, std::size_t align) noexcept {
+  try {
+    return CountedNew(size, align);
+  } catch (...) {
+    return nullptr;
+  }
+}
+}  // namespace pypp
+
+namespace {
+constexpr std::size_t kDefaultAlign = alignof(std::max_align_t);
+}  // namespace
+
+void* operator new(std::size_t size) { return pypp::CountedNew(size, kDefaultAlign); }
+void* operator new[](std::size_t size) { return pypp::CountedNew(size, kDefaultAlign); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return pypp::CountedNewNothrow(size, kDefaultAlign);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return pypp::CountedNewNothrow(size, kDefaultAlign);
+}
+void* operator new(std::size_t size, std::align_val_t align) {
+  return pypp::CountedNew(size, static_cast<std::size_t>(align));
+}
+void* operator new[](std::size_t size, std::align_val_t align) {
+  return pypp::CountedNew(size, static_cast<std::size_t>(align));
+}
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return pypp::CountedNewNothrow(size, static_cast<std::size_t>(align));
+}
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return pypp::CountedNewNothrow(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void* p) noexcept { pypp::CountedFree(p, kDefaultAlign); }
+void operator delete[](void* p) noexcept { pypp::CountedFree(p, kDefaultAlign); }
+void operator delete(void* p, std::size_t) noexcept { pypp::CountedFree(p, kDefaultAlign); }
+void operator delete[](void* p, std::size_t) noexcept { pypp::CountedFree(p, kDefaultAlign); }
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  pypp::CountedFree(p, kDefaultAlign);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  pypp::CountedFree(p, kDefaultAlign);
+}
+void operator delete(void* p, std::align_val_t align) noexcept {
+  pypp::CountedFree(p, static_cast<std::size_t>(align));
+}
+void operator delete[](void* p, std::align_val_t align) noexcept {
+  pypp::CountedFree(p, static_cast<std::size_t>(align));
+}
+void operator delete(void* p, std::size_t, std::align_val_t align) noexcept {
+  pypp::CountedFree(p, static_cast<std::size_t>(align));
+}
+void operator delete[](void* p, std::size_t, std::align_val_t align) noexcept {
+  pypp::CountedFree(p, static_cast<std::size_t>(align));
+}
+void operator delete(void* p, std::align_val_t align, const std::nothrow_t&) noexcept {
+  pypp::CountedFree(p, static_cast<std::size_t>(align));
+}
+void operator delete[](void* p, std::align_val_t align, const std::nothrow_t&) noexcept {
+  pypp::CountedFree(p, static_cast<std::size_t>(align));
+}
+#endif
+
 namespace pypp {
 
 enum class TokenKind {
@@ -316,6 +461,124 @@ struct Instruction {
   std::vector<std::string> args;
 };
 
+struct SourceLocation {
+  int line = 0;
+  int column = 0;
+};
+
+// Maps instruction indices to source positions. Entries are only written when
+// the position changes and are stored as varint deltas (ip, zigzag line,
+// column), so a table costs roughly two bytes per statement. It is decoded
+// only when an error or a profiler report needs a location.
+class LineTable {
+ public:
+  void SetFile(std::string file) { file_ = std::move(file); }
+  const std::string& File() const { return file_; }
+  bool Empty() const { return data_.empty(); }
+
+  void Append(std::size_t ip, int line, int column) {
+    if (!data_.empty() && line == last_line_ && column == last_column_) {
+      return;
+    }
+    WriteVarint(static_cast<std::uint64_t>(ip - last_ip_));
+    const std::int64_t dl = static_cast<std::int64_t>(line) - last_line_;
+    WriteVarint((static_cast<std::uint64_t>(dl) << 1) ^
+                static_cast<std::uint64_t>(dl >> 63));
+    WriteVarint(static_cast<std::uint64_t>(std::max(0, column)));
+    last_ip_ = ip;
+    last_line_ = line;
+    last_column_ = column;
+  }
+
+  std::optional<SourceLocation> Lookup(std::size_t ip) const {
+    std::optional<SourceLocation> found;
+    std::size_t pos = 0;
+    std::size_t cur_ip = 0;
+    std::int64_t cur_line = 0;
+    while (pos < data_.size()) {
+      cur_ip += static_cast<std::size_t>(ReadVarint(pos));
+      const std::uint64_t zz = ReadVarint(pos);
+      cur_line += static_cast<std::int64_t>(zz >> 1) ^ -static_cast<std::int64_t>(zz & 1);
+      const int column = static_cast<int>(ReadVarint(pos));
+      if (cur_ip > ip) {
+        break;
+      }
+      found = SourceLocation{static_cast<int>(cur_line), column};
+    }
+    return found;
+  }
+
+  std::string Describe(std::size_t ip) const {
+    auto loc = Lookup(ip);
+    std::string out = file_.empty() ? "<program>" : file_;
+    if (loc.has_value()) {
+      out += ":" + std::to_string(loc->line) + ":" + std::to_string(loc->column);
+    } else {
+      out += " ip " + std::to_string(ip);
+    }
+    return out;
+  }
+
+  std::string EncodeHex() const {
+    static const char* kDigits = "0123456789abcdef";
+    std::string out;
+    out.reserve(data_.size() * 2);
+    for (std::uint8_t byte : data_) {
+      out.push_back(kDigits[byte >> 4]);
+      out.push_back(kDigits[byte & 15]);
+    }
+    return out;
+  }
+
+  static LineTable DecodeHex(std::string file, const std::string& hex) {
+    if ((hex.size() & 1) != 0) {
+      throw std::runtime_error("Invalid line table in bytecode");
+    }
+    auto nibble = [](char c) -> int {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      throw std::runtime_error("Invalid line table in bytecode");
+    };
+    LineTable table;
+    table.file_ = std::move(file);
+    table.data_.reserve(hex.size() / 2);
+    for (std::size_t i = 0; i < hex.size(); i += 2) {
+      table.data_.push_back(
+          static_cast<std::uint8_t>((nibble(hex[i]) << 4) | nibble(hex[i + 1])));
+    }
+    return table;
+  }
+
+ private:
+  void WriteVarint(std::uint64_t v) {
+    while (v >= 0x80) {
+      data_.push_back(static_cast<std::uint8_t>(v | 0x80));
+      v >>= 7;
+    }
+    data_.push_back(static_cast<std::uint8_t>(v));
+  }
+
+  std::uint64_t ReadVarint(std::size_t& pos) const {
+    std::uint64_t v = 0;
+    int shift = 0;
+    while (pos < data_.size()) {
+      const std::uint8_t byte = data_[pos++];
+      v |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+      shift += 7;
+    }
+    return v;
+  }
+
+  std::string file_;
+  std::vector<std::uint8_t> data_;
+  std::size_t last_ip_ = 0;
+  int last_line_ = 0;
+  int last_column_ = 0;
+};
+
 class Parser {
  public:
   explicit Parser(std::vector<Token> tokens) : tokens_(std::move(tokens)) {}
@@ -327,10 +590,14 @@ class Parser {
       ParseStatement(out);
       SkipNewlines();
     }
-    out.push_back(Instruction{"HALT", {}});
+    Emit(out, Instruction{"HALT", {}});
     return out;
   }
 
+  // Source positions of the emitted instructions, for runtime error
+  // locations and the sampling profiler.
+  const LineTable& Lines() const { return lines_; }
+
  private:
   void ParseStatement(std::vector<Instruction>& out) {
     if (Match(TokenKind::Let)) {
@@ -350,14 +617,14 @@ class Parser {
       return;
     }
     ParseExpression(out);
-    out.push_back(Instruction{"POP", {}});
+    Emit(out, Instruction{"POP", {}});
   }
 
   void ParseLet(std::vector<Instruction>& out) {
     Token name = Consume(TokenKind::Identifier, "Expected variable name after let");
     Consume(TokenKind::Assign, "Expected '=' after variable name");
     ParseExpression(out);
-    out.push_back(Instruction{"STORE", {name.lexeme}});
+    Emit(out, Instruction{"STORE", {name.lexeme}});
   }
 
   void ParseImport(std::vector<Instruction>& out) {
@@ -369,7 +636,7 @@ class Parser {
     }
     Consume(TokenKind::As, "Expected 'as' in import statement");
     Token alias = Consume(TokenKind::Identifier, "Expected alias after 'as'");
-    out.push_back(Instruction{"IMPORT", {module, alias.lexeme}});
+    Emit(out, Instruction{"IMPORT", {module, alias.lexeme}});
   }
 
   void ParseIf(std::vector<Instruction>& out) {
@@ -377,7 +644,7 @@ class Parser {
     Consume(TokenKind::Colon, "Expected ':' after if condition");
     RequireStatementBreak("Expected newline after if header");
     int jump_if_false_index = static_cast<int>(out.size());
-    out.push_back(Instruction{"JZ", {"-1"}});
+    Emit(out, Instruction{"JZ", {"-1"}});
     ParseBlockUntilEnd(out);
     out[static_cast<std::size_t>(jump_if_false_index)].args[0] =
         std::to_string(static_cast<int>(out.size()));
@@ -389,9 +656,9 @@ class Parser {
     Consume(TokenKind::Colon, "Expected ':' after while condition");
     RequireStatementBreak("Expected newline after while header");
     int jump_if_false_index = static_cast<int>(out.size());
-    out.push_back(Instruction{"JZ", {"-1"}});
+    Emit(out, Instruction{"JZ", {"-1"}});
     ParseBlockUntilEnd(out);
-    out.push_back(Instruction{"JMP", {std::to_string(loop_start)}});
+    Emit(out, Instruction{"JMP", {std::to_string(loop_start)}});
     out[static_cast<std::size_t>(jump_if_false_index)].args[0] =
         std::to_string(static_cast<int>(out.size()));
   }
@@ -413,22 +680,22 @@ class Parser {
     while (true) {
       if (Match(TokenKind::Eq)) {
         ParseTerm(out);
-        out.push_back(Instruction{"CMP_EQ", {}});
+        Emit(out, Instruction{"CMP_EQ", {}});
       } else if (Match(TokenKind::Ne)) {
         ParseTerm(out);
-        out.push_back(Instruction{"CMP_NE", {}});
+        Emit(out, Instruction{"CMP_NE", {}});
       } else if (Match(TokenKind::Lt)) {
         ParseTerm(out);
-        out.push_back(Instruction{"CMP_LT", {}});
+        Emit(out, Instruction{"CMP_LT", {}});
       } else if (Match(TokenKind::Le)) {
         ParseTerm(out);
-        out.push_back(Instruction{"CMP_LE", {}});
+        Emit(out, Instruction{"CMP_LE", {}});
       } else if (Match(TokenKind::Gt)) {
         ParseTerm(out);
-        out.push_back(Instruction{"CMP_GT", {}});
+        Emit(out, Instruction{"CMP_GT", {}});
       } else if (Match(TokenKind::Ge)) {
         ParseTerm(out);
-        out.push_back(Instruction{"CMP_GE", {}});
+        Emit(out, Instruction{"CMP_GE", {}});
       } else {
         break;
       }
@@ -440,10 +707,10 @@ class Parser {
     while (true) {
       if (Match(TokenKind::Plus)) {
         ParseFactor(out);
-        out.push_back(Instruction{"ADD", {}});
+        Emit(out, Instruction{"ADD", {}});
       } else if (Match(TokenKind::Minus)) {
         ParseFactor(out);
-        out.push_back(Instruction{"SUB", {}});
+        Emit(out, Instruction{"SUB", {}});
       } else {
         break;
       }
@@ -455,10 +722,10 @@ class Parser {
     while (true) {
       if (Match(TokenKind::Star)) {
         ParseUnary(out);
-        out.push_back(Instruction{"MUL", {}});
+        Emit(out, Instruction{"MUL", {}});
       } else if (Match(TokenKind::Slash)) {
         ParseUnary(out);
-        out.push_back(Instruction{"DIV", {}});
+        Emit(out, Instruction{"DIV", {}});
       } else {
         break;
       }
@@ -468,7 +735,7 @@ class Parser {
   void ParseUnary(std::vector<Instruction>& out) {
     if (Match(TokenKind::Minus)) {
       ParseUnary(out);
-      out.push_back(Instruction{"NEG", {}});
+      Emit(out, Instruction{"NEG", {}});
       return;
     }
     ParsePrimary(out);
@@ -476,15 +743,16 @@ class Parser {
 
   void ParsePrimary(std::vector<Instruction>& out) {
     if (Match(TokenKind::Number)) {
-      out.push_back(Instruction{"PUSH_INT", {Previous().lexeme}});
+      Emit(out, Instruction{"PUSH_INT", {Previous().lexeme}});
       return;
     }
     if (Match(TokenKind::String)) {
-      out.push_back(Instruction{"PUSH_STR", {Previous().lexeme}});
+      Emit(out, Instruction{"PUSH_STR", {Previous().lexeme}});
       return;
     }
     if (Match(TokenKind::Identifier)) {
-      std::string base = Previous().lexeme;
+      const Token base_tok = Previous();
+      std::string base = base_tok.lexeme;
       std::vector<std::string> parts;
       while (Match(TokenKind::Dot)) {
         Token part = Consume(TokenKind::Identifier, "Expected identifier after '.'");
@@ -507,17 +775,17 @@ class Parser {
           }
         }
         Consume(TokenKind::RParen, "Expected ')' after call arguments");
-        out.push_back(Instruction{"CALL", {path, std::to_string(argc)}});
+        Emit(out, Instruction{"CALL", {path, std::to_string(argc)}}, base_tok);
       } else {
-        out.push_back(Instruction{"LOAD", {base}});
+        Emit(out, Instruction{"LOAD", {base}}, base_tok);
         for (const std::string& p : parts) {
-          out.push_back(Instruction{"GET_FIELD", {p}});
+          Emit(out, Instruction{"GET_FIELD", {p}});
         }
       }
       return;
     }
     if (Match(TokenKind::LBrace)) {
-      out.push_back(Instruction{"NEW_OBJ", {}});
+      Emit(out, Instruction{"NEW_OBJ", {}});
       SkipNewlines();
       if (!Check(TokenKind::RBrace)) {
         while (true) {
@@ -529,7 +797,7 @@ class Parser {
           }
           Consume(TokenKind::Colon, "Expected ':' after object key");
           ParseExpression(out);
-          out.push_back(Instruction{"SET_FIELD", {key}});
+          Emit(out, Instruction{"SET_FIELD", {key}});
           SkipNewlines();
           if (!Match(TokenKind::Comma)) {
             break;
@@ -548,6 +816,15 @@ class Parser {
     throw std::runtime_error("Unexpected token at " + CurrentPos());
   }
 
+  void Emit(std::vector<Instruction>& out, Instruction ins) {
+    Emit(out, std::move(ins), index_ > 0 ? Previous() : Peek());
+  }
+
+  void Emit(std::vector<Instruction>& out, Instruction ins, const Token& at) {
+    lines_.Append(out.size(), at.line, at.column);
+    out.push_back(std::move(ins));
+  }
+
   void SkipNewlines() {
     while (Match(TokenKind::Newline)) {
     }
@@ -590,6 +867,7 @@ class Parser {
 
   std::vector<Token> tokens_;
   std::size_t index_ = 0;
+  LineTable lines_;
 };
 
 struct Object;
@@ -665,40 +943,1289 @@ struct Vec3 {
   double z = 0.0;
 };
 
+// Affine 4x4 transform, row-major, applied to column vectors with w = 1.
+struct Mat4 {
+  double m[4][4] = {{1.0, 0.0, 0.0, 0.0},
+                    {0.0, 1.0, 0.0, 0.0},
+                    {0.0, 0.0, 1.0, 0.0},
+                    {0.0, 0.0, 0.0, 1.0}};
+
+  static Mat4 Translation(const Vec3& t) {
+    Mat4 out;
+    out.m[0][3] = t.x;
+    out.m[1][3] = t.y;
+    out.m[2][3] = t.z;
+    return out;
+  }
+
+  static Mat4 Scaling(const Vec3& s) {
+    Mat4 out;
+    out.m[0][0] = s.x;
+    out.m[1][1] = s.y;
+    out.m[2][2] = s.z;
+    return out;
+  }
+
+  // Rotation about X, then Y, then Z, in degrees.
+  static Mat4 RotationXyz(const Vec3& deg) {
+    const double k = 3.14159265358979323846 / 180.0;
+    const double cx = std::cos(deg.x * k);
+    const double sx = std::sin(deg.x * k);
+    const double cy = std::cos(deg.y * k);
+    const double sy = std::sin(deg.y * k);
+    const double cz = std::cos(deg.z * k);
+    const double sz = std::sin(deg.z * k);
+    Mat4 rx;
+    rx.m[1][1] = cx;
+    rx.m[1][2] = -sx;
+    rx.m[2][1] = sx;
+    rx.m[2][2] = cx;
+    Mat4 ry;
+    ry.m[0][0] = cy;
+    ry.m[0][2] = sy;
+    ry.m[2][0] = -sy;
+    ry.m[2][2] = cy;
+    Mat4 rz;
+    rz.m[0][0] = cz;
+    rz.m[0][1] = -sz;
+    rz.m[1][0] = sz;
+    rz.m[1][1] = cz;
+    return rz * ry * rx;
+  }
+
+  Mat4 operator*(const Mat4& o) const {
+    Mat4 out;
+    for (int r = 0; r < 4; ++r) {
+      for (int c = 0; c < 4; ++c) {
+        out.m[r][c] = m[r][0] * o.m[0][c] + m[r][1] * o.m[1][c] +
+                      m[r][2] * o.m[2][c] + m[r][3] * o.m[3][c];
+      }
+    }
+    return out;
+  }
+
+  Vec3 TransformPoint(const Vec3& v) const {
+    return Vec3{m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z + m[0][3],
+                m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z + m[1][3],
+                m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z + m[2][3]};
+  }
+};
+
+// Framebuffer pixels are packed 8-bit channels with red in the low byte, so
+// in memory they read R, G, B, A like sprite texels, and the same words can
+// go straight to a 32-bit DIB or a raw RGBA stream. Alpha is always 255.
+constexpr std::uint32_t kPixelAlpha = 0xFF000000u;
+
+inline std::uint32_t PackPixel(int r, int g, int b) {
+  return kPixelAlpha | (static_cast<std::uint32_t>(b) << 16) |
+         (static_cast<std::uint32_t>(g) << 8) | static_cast<std::uint32_t>(r);
+}
+
+inline Pixel UnpackPixel(std::uint32_t v) {
+  return Pixel{static_cast<int>(v & 0xFFu), static_cast<int>((v >> 8) & 0xFFu),
+               static_cast<int>((v >> 16) & 0xFFu)};
+}
+
+// Span kernels behind the 2D primitives. Each kernel writes one horizontal
+// run of pixels; callers clip first. The scalar versions define the results
+// and the SIMD versions reproduce them bit for bit: tint is (t * tint) / 255
+// and blending is (s * a + d * (255 - a)) / 255, which already leaves the
+// destination untouched for a == 0 and copies the source for a == 255.
+// Source texels are tightly packed RGBA8.
+struct SpanKernels {
+  const char* name;
+  void (*fill)(std::uint32_t* dst, int n, std::uint32_t color);
+  void (*blend)(std::uint32_t* dst, const std::uint8_t* rgba, int n,
+                int tint_r, int tint_g, int tint_b);
+};
+
+void FillSpanScalar(std::uint32_t* dst, int n, std::uint32_t color) {
+  std::fill(dst, dst + n, color);
+}
+
+void BlendSpanScalar(std::uint32_t* dst, const std::uint8_t* rgba, int n,
+                     int tint_r, int tint_g, int tint_b) {
+  for (int i = 0; i < n; ++i, rgba += 4) {
+    const int a = rgba[3];
+    if (a == 0) {
+      continue;
+    }
+    const int rr = (static_cast<int>(rgba[0]) * tint_r) / 255;
+    const int gg = (static_cast<int>(rgba[1]) * tint_g) / 255;
+    const int bb = (static_cast<int>(rgba[2]) * tint_b) / 255;
+    if (a == 255) {
+      dst[i] = PackPixel(rr, gg, bb);
+      continue;
+    }
+    const Pixel out = UnpackPixel(dst[i]);
+    dst[i] = PackPixel((rr * a + out.r * (255 - a)) / 255,
+                       (gg * a + out.g * (255 - a)) / 255,
+                       (bb * a + out.b * (255 - a)) / 255);
+  }
+}
+
+#ifdef PYPP_X86_SIMD
+// Channels are widened to 16-bit lanes, two pixels per 128-bit half. Every
+// product stays below 255 * 255 + 255, so 16 bits are enough and v / 255 is
+// exact as (v + 1 + (v >> 8)) >> 8.
+
+PYPP_TARGET("sse2")
+inline __m128i Div255Sse2(__m128i v) {
+  const __m128i one = _mm_set1_epi16(1);
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(v, one), _mm_srli_epi16(v, 8)),
+                        8);
+}
+
+PYPP_TARGET("sse2")
+inline __m128i BlendPairSse2(__m128i src, __m128i dst, __m128i tint) {
+  const __m128i c255 = _mm_set1_epi16(255);
+  __m128i alpha = _mm_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3));
+  alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+  const __m128i s = Div255Sse2(_mm_mullo_epi16(src, tint));
+  return Div255Sse2(_mm_add_epi16(_mm_mullo_epi16(s, alpha),
+                                  _mm_mullo_epi16(dst, _mm_sub_epi16(c255, alpha))));
+}
+
+PYPP_TARGET("sse2")
+void FillSpanSse2(std::uint32_t* dst, int n, std::uint32_t color) {
+  const __m128i v = _mm_set1_epi32(static_cast<int>(color));
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+  }
+  FillSpanScalar(dst + i, n - i, color);
+}
+
+PYPP_TARGET("sse2")
+void BlendSpanSse2(std::uint32_t* dst, const std::uint8_t* rgba, int n,
+                   int tint_r, int tint_g, int tint_b) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i tint = _mm_setr_epi16(
+      static_cast<short>(tint_r), static_cast<short>(tint_g),
+      static_cast<short>(tint_b), 255, static_cast<short>(tint_r),
+      static_cast<short>(tint_g), static_cast<short>(tint_b), 255);
+  const __m128i alpha_mask = _mm_set1_epi32(static_cast<int>(kPixelAlpha));
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m128i px =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + 4 * i));
+    const __m128i transparent =
+        _mm_cmpeq_epi32(_mm_and_si128(px, alpha_mask), zero);
+    if (_mm_movemask_epi8(transparent) == 0xFFFF) {
+      continue;
+    }
+    __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+    const __m128i d = _mm_loadu_si128(out);
+    const __m128i lo = BlendPairSse2(_mm_unpacklo_epi8(px, zero),
+                                     _mm_unpacklo_epi8(d, zero), tint);
+    const __m128i hi = BlendPairSse2(_mm_unpackhi_epi8(px, zero),
+                                     _mm_unpackhi_epi8(d, zero), tint);
+    _mm_storeu_si128(out, _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_mask));
+  }
+  BlendSpanScalar(dst + i, rgba + 4 * i, n - i, tint_r, tint_g, tint_b);
+}
+
+PYPP_TARGET("avx2")
+inline __m256i Div255Avx2(__m256i v) {
+  const __m256i one = _mm256_set1_epi16(1);
+  return _mm256_srli_epi16(
+      _mm256_add_epi16(_mm256_add_epi16(v, one), _mm256_srli_epi16(v, 8)), 8);
+}
+
+PYPP_TARGET("avx2")
+inline __m256i BlendPairAvx2(__m256i src, __m256i dst, __m256i tint) {
+  const __m256i c255 = _mm256_set1_epi16(255);
+  __m256i alpha = _mm256_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3));
+  alpha = _mm256_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+  const __m256i s = Div255Avx2(_mm256_mullo_epi16(src, tint));
+  return Div255Avx2(
+      _mm256_add_epi16(_mm256_mullo_epi16(s, alpha),
+                       _mm256_mullo_epi16(dst, _mm256_sub_epi16(c255, alpha))));
+}
+
+PYPP_TARGET("avx2")
+void FillSpanAvx2(std::uint32_t* dst, int n, std::uint32_t color) {
+  const __m256i v = _mm256_set1_epi32(static_cast<int>(color));
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+  }
+  FillSpanSse2(dst + i, n - i, color);
+}
+
+// Unpacking works within 128-bit lanes and packus undoes it in the same
+// lanes, so pixel order survives without cross-lane shuffles.
+PYPP_TARGET("avx2")
+void BlendSpanAvx2(std::uint32_t* dst, const std::uint8_t* rgba, int n,
+                   int tint_r, int tint_g, int tint_b) {
+  const __m256i zero = _mm256_setzero_si256();
+  const short tr = static_cast<short>(tint_r);
+  const short tg = static_cast<short>(tint_g);
+  const short tb = static_cast<short>(tint_b);
+  const __m256i tint = _mm256_setr_epi16(tr, tg, tb, 255, tr, tg, tb, 255, tr,
+                                         tg, tb, 255, tr, tg, tb, 255);
+  const __m256i alpha_mask = _mm256_set1_epi32(static_cast<int>(kPixelAlpha));
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i px =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rgba + 4 * i));
+    if (_mm256_testz_si256(px, alpha_mask)) {
+      continue;
+    }
+    __m256i* out = reinterpret_cast<__m256i*>(dst + i);
+    const __m256i d = _mm256_loadu_si256(out);
+    const __m256i lo = BlendPairAvx2(_mm256_unpacklo_epi8(px, zero),
+                                     _mm256_unpacklo_epi8(d, zero), tint);
+    const __m256i hi = BlendPairAvx2(_mm256_unpackhi_epi8(px, zero),
+                                     _mm256_unpackhi_epi8(d, zero), tint);
+    _mm256_storeu_si256(out,
+                        _mm256_or_si256(_mm256_packus_epi16(lo, hi), alpha_mask));
+  }
+  BlendSpanSse2(dst + i, rgba + 4 * i, n - i, tint_r, tint_g, tint_b);
+}
+
+bool CpuSupports(const char* isa) {
+#if defined(_MSC_VER)
+  int regs[4] = {0, 0, 0, 0};
+  __cpuid(regs, 1);
+  const bool sse2 = (regs[3] & (1 << 26)) != 0;
+  const bool os_avx = (regs[2] & (1 << 27)) != 0 && (regs[2] & (1 << 28)) != 0 &&
+                      (_xgetbv(0) & 6) == 6;
+  if (std::string_view(isa) == "sse2") {
+    return sse2;
+  }
+  if (std::string_view(isa) == "avx2") {
+    __cpuidex(regs, 7, 0);
+    return sse2 && os_avx && (regs[1] & (1 << 5)) != 0;
+  }
+  return false;
+#elif defined(__GNUC__) || defined(__clang__)
+  __builtin_cpu_init();
+  if (std::string_view(isa) == "sse2") {
+    return __builtin_cpu_supports("sse2");
+  }
+  if (std::string_view(isa) == "avx2") {
+    return __builtin_cpu_supports("avx2");
+  }
+  return false;
+#else
+  (void)isa;
+  return false;
+#endif
+}
+#endif
+
+// Every kernel set usable on this CPU, best last. Index 0 is the reference.
+const std::vector<SpanKernels>& AvailableSpanKernels() {
+  static const std::vector<SpanKernels> sets = []() {
+    std::vector<SpanKernels> out;
+    out.push_back(SpanKernels{"scalar", FillSpanScalar, BlendSpanScalar});
+#ifdef PYPP_X86_SIMD
+    if (CpuSupports("sse2")) {
+      out.push_back(SpanKernels{"sse2", FillSpanSse2, BlendSpanSse2});
+    }
+    if (CpuSupports("avx2")) {
+      out.push_back(SpanKernels{"avx2", FillSpanAvx2, BlendSpanAvx2});
+    }
+#endif
+    return out;
+  }();
+  return sets;
+}
+
+const SpanKernels& ActiveSpanKernels() {
+  static const SpanKernels& active = AvailableSpanKernels().back();
+  return active;
+}
+
+// Transforms n points in place by an affine matrix and then adds `offset`.
+// The SSE2 path computes x and y in one register with the same operation
+// order as Mat4::TransformPoint, so both paths give identical results.
+void TransformPointsScalar(const Mat4& t, Vec3* pts, std::size_t n,
+                           const Vec3& offset) {
+  for (std::size_t i = 0; i < n; ++i) {
+    const Vec3 v = t.TransformPoint(pts[i]);
+    pts[i] = Vec3{v.x + offset.x, v.y + offset.y, v.z + offset.z};
+  }
+}
+
+#ifdef PYPP_X86_SIMD
+PYPP_TARGET("sse2")
+void TransformPointsSse2(const Mat4& t, Vec3* pts, std::size_t n,
+                         const Vec3& offset) {
+  const __m128d c0 = _mm_set_pd(t.m[1][0], t.m[0][0]);
+  const __m128d c1 = _mm_set_pd(t.m[1][1], t.m[0][1]);
+  const __m128d c2 = _mm_set_pd(t.m[1][2], t.m[0][2]);
+  const __m128d c3 = _mm_set_pd(t.m[1][3], t.m[0][3]);
+  const __m128d off = _mm_set_pd(offset.y, offset.x);
+  for (std::size_t i = 0; i < n; ++i) {
+    const Vec3 v = pts[i];
+    __m128d xy = _mm_add_pd(_mm_mul_pd(c0, _mm_set1_pd(v.x)),
+                            _mm_mul_pd(c1, _mm_set1_pd(v.y)));
+    xy = _mm_add_pd(xy, _mm_mul_pd(c2, _mm_set1_pd(v.z)));
+    xy = _mm_add_pd(_mm_add_pd(xy, c3), off);
+    const double z = t.m[2][0] * v.x + t.m[2][1] * v.y + t.m[2][2] * v.z +
+                     t.m[2][3] + offset.z;
+    _mm_storeu_pd(&pts[i].x, xy);
+    pts[i].z = z;
+  }
+}
+#endif
+
+void TransformPoints(const Mat4& t, Vec3* pts, std::size_t n,
+                     const Vec3& offset) {
+#ifdef PYPP_X86_SIMD
+  static const bool sse2 = CpuSupports("sse2");
+  if (sse2) {
+    TransformPointsSse2(t, pts, n, offset);
+    return;
+  }
+#endif
+  TransformPointsScalar(t, pts, n, offset);
+}
+
+// Called first on every helper thread. The sampling profiler's SIGPROF
+// handler samples the VM thread and pushes into a single-producer ring, so
+// no other thread may run it.
+void BlockProfilerSignal() {
+#ifndef _WIN32
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+#endif
+}
+
+// Persistent worker threads for data-parallel frame passes. Run() hands out
+// task indices until every task is done and only then returns. The calling
+// thread takes tasks as well, so a pool of size 1 starts no threads at all.
+class WorkerPool {
+ public:
+  explicit WorkerPool(int threads) {
+    for (int i = 1; i < threads; ++i) {
+      workers_.emplace_back([this]() { Loop(); });
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& t : workers_) {
+      t.join();
+    }
+  }
+
+  int Size() const { return static_cast<int>(workers_.size()) + 1; }
+
+  void Run(int tasks, const std::function<void(int)>& fn) {
+    if (tasks <= 0) {
+      return;
+    }
+    if (workers_.empty() || tasks == 1) {
+      for (int i = 0; i < tasks; ++i) {
+        fn(i);
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      job_ = &fn;
+      job_tasks_ = tasks;
+      next_task_.store(0, std::memory_order_relaxed);
+      busy_workers_ = static_cast<int>(workers_.size());
+      ++generation_;
+    }
+    wake_.notify_all();
+    Work(fn, tasks);
+    std::unique_lock<std::mutex> lock(mu_);
+    done_.wait(lock, [this]() { return busy_workers_ == 0; });
+    job_ = nullptr;
+  }
+
+  static int HardwareThreads() {
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+
+ private:
+  void Work(const std::function<void(int)>& fn, int tasks) {
+    for (int i = next_task_.fetch_add(1, std::memory_order_relaxed); i < tasks;
+         i = next_task_.fetch_add(1, std::memory_order_relaxed)) {
+      fn(i);
+    }
+  }
+
+  void Loop() {
+    BlockProfilerSignal();
+    std::uint64_t seen = 0;
+    while (true) {
+      const std::function<void(int)>* job = nullptr;
+      int tasks = 0;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        wake_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+        if (stop_) {
+          return;
+        }
+        seen = generation_;
+        job = job_;
+        tasks = job_tasks_;
+      }
+      Work(*job, tasks);
+      std::lock_guard<std::mutex> lock(mu_);
+      if (--busy_workers_ == 0) {
+        done_.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::mutex mu_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void(int)>* job_ = nullptr;
+  int job_tasks_ = 0;
+  std::atomic<int> next_task_{0};
+  int busy_workers_ = 0;
+  std::uint64_t generation_ = 0;
+  bool stop_ = false;
+};
+
+// Integer edge-function rasterizer shared by gfx.triangle and the gx3d fills.
+// Pixels are sampled at their centres and a pixel on an edge shared by two
+// triangles belongs to exactly one of them (top-left rule). The bounding box
+// is walked in 8x8 tiles: tiles outside an edge are skipped, tiles inside all
+// three edges need no per-pixel test, and the rest step the edge values
+// incrementally. Each covered row is reported as one span, since a triangle
+// covers a contiguous run of every row.
+class EdgeRasterizer {
+ public:
+  static constexpr int kTile = 8;
+  // Keeps the 64-bit edge products exact; larger triangles are dropped.
+  static constexpr int kMaxCoord = 1 << 28;
+
+  // Returns false if the triangle is degenerate or misses the clip rect.
+  bool Setup(int x0, int y0, int x1, int y1, int x2, int y2, int clip_w,
+             int clip_h) {
+    return Setup(x0, y0, x1, y1, x2, y2, 0, 0, clip_w, clip_h);
+  }
+
+  // Same, clipped to [clip_x0, clip_x1) x [clip_y0, clip_y1). Coverage of a
+  // pixel does not depend on the rect, so triangles split across tiles
+  // rasterize exactly as a whole.
+  bool Setup(int x0, int y0, int x1, int y1, int x2, int y2, int clip_x0,
+             int clip_y0, int clip_x1, int clip_y1) {
+    const int xs[3] = {x0, x1, x2};
+    const int ys[3] = {y0, y1, y2};
+    for (int i = 0; i < 3; ++i) {
+      if (std::abs(xs[i]) > kMaxCoord || std::abs(ys[i]) > kMaxCoord) {
+        return false;
+      }
+    }
+    // A pixel is covered if its centre lies inside, so the last candidate
+    // column/row is one before the largest vertex coordinate.
+    min_x_ = std::max(clip_x0, std::min(x0, std::min(x1, x2)));
+    min_y_ = std::max(clip_y0, std::min(y0, std::min(y1, y2)));
+    max_x_ = std::min(clip_x1 - 1, std::max(x0, std::max(x1, x2)) - 1);
+    max_y_ = std::min(clip_y1 - 1, std::max(y0, std::max(y1, y2)) - 1);
+    if (min_x_ > max_x_ || min_y_ > max_y_) {
+      return false;
+    }
+
+    // Edge i is opposite vertex i, so its value is the (unnormalized) weight
+    // of that vertex. Values are kept in half-pixel units so pixel centres
+    // stay integral: E(x, y) = base + step_x * x + step_y * y.
+    std::int64_t area = 0;
+    for (int i = 0; i < 3; ++i) {
+      const int a = (i + 1) % 3;
+      const int b = (i + 2) % 3;
+      const std::int64_t dx = static_cast<std::int64_t>(xs[b]) - xs[a];
+      const std::int64_t dy = static_cast<std::int64_t>(ys[b]) - ys[a];
+      step_x_[i] = -2 * dy;
+      step_y_[i] = 2 * dx;
+      base_[i] = dx * (1 - 2 * static_cast<std::int64_t>(ys[a])) -
+                 dy * (1 - 2 * static_cast<std::int64_t>(xs[a]));
+      area += base_[i] + step_x_[i] * min_x_ + step_y_[i] * min_y_;
+    }
+    if (area == 0) {
+      return false;
+    }
+    if (area < 0) {
+      area = -area;
+      for (int i = 0; i < 3; ++i) {
+        base_[i] = -base_[i];
+        step_x_[i] = -step_x_[i];
+        step_y_[i] = -step_y_[i];
+      }
+    }
+    area_ = area;
+    for (int i = 0; i < 3; ++i) {
+      const bool top_left =
+          step_x_[i] > 0 || (step_x_[i] == 0 && step_y_[i] > 0);
+      bias_[i] = top_left ? 0 : -1;
+    }
+    return true;
+  }
+
+  std::int64_t Area() const { return area_; }
+  std::int64_t StepX(int i) const { return step_x_[i]; }
+
+  // Calls fn(y, x_begin, x_end, w) for each covered row, where [x_begin,
+  // x_end) is the covered run and w[3] are the vertex weights at x_begin.
+  // Weights sum to Area() and change by StepX(i) per pixel.
+  template <typename SpanFn>
+  void Run(SpanFn&& fn) {
+    const int tile_x0 = min_x_ - (min_x_ % kTile);
+    const int tile_count = (max_x_ - tile_x0) / kTile + 1;
+    if (tile_state_.size() < static_cast<std::size_t>(tile_count)) {
+      tile_state_.resize(static_cast<std::size_t>(tile_count));
+    }
+    for (int ty = min_y_ - (min_y_ % kTile); ty <= max_y_; ty += kTile) {
+      const int y_lo = std::max(ty, min_y_);
+      const int y_hi = std::min(ty + kTile - 1, max_y_);
+      int first = -1;
+      int last = -1;
+      for (int t = 0; t < tile_count; ++t) {
+        const int x_lo = std::max(tile_x0 + t * kTile, min_x_);
+        const int x_hi = std::min(tile_x0 + t * kTile + kTile - 1, max_x_);
+        TileState state = kTileFull;
+        for (int i = 0; i < 3 && state != kTileEmpty; ++i) {
+          const std::int64_t e = Eval(i, x_lo, y_lo) + bias_[i];
+          const std::int64_t ex = step_x_[i] * (x_hi - x_lo);
+          const std::int64_t ey = step_y_[i] * (y_hi - y_lo);
+          const std::int64_t hi = e + std::max<std::int64_t>(0, ex) +
+                                  std::max<std::int64_t>(0, ey);
+          const std::int64_t lo = e + std::min<std::int64_t>(0, ex) +
+                                  std::min<std::int64_t>(0, ey);
+          if (hi < 0) {
+            state = kTileEmpty;
+          } else if (lo < 0) {
+            state = kTilePartial;
+          }
+        }
+        tile_state_[static_cast<std::size_t>(t)] = state;
+        if (state != kTileEmpty) {
+          first = first < 0 ? t : first;
+          last = t;
+        }
+      }
+      if (first < 0) {
+        continue;
+      }
+      for (int y = y_lo; y <= y_hi; ++y) {
+        int x_begin = -1;
+        int x_end = -1;
+        for (int t = first; t <= last && x_end < 0; ++t) {
+          const int x_lo = std::max(tile_x0 + t * kTile, min_x_);
+          const int x_hi = std::min(tile_x0 + t * kTile + kTile - 1, max_x_);
+          const TileState state = tile_state_[static_cast<std::size_t>(t)];
+          if (state == kTileEmpty) {
+            if (x_begin >= 0) {
+              x_end = x_lo;
+            }
+            continue;
+          }
+          if (state == kTileFull) {
+            x_begin = x_begin < 0 ? x_lo : x_begin;
+            continue;
+          }
+          std::int64_t e0 = Eval(0, x_lo, y) + bias_[0];
+          std::int64_t e1 = Eval(1, x_lo, y) + bias_[1];
+          std::int64_t e2 = Eval(2, x_lo, y) + bias_[2];
+          for (int x = x_lo; x <= x_hi; ++x) {
+            const bool inside = (e0 | e1 | e2) >= 0;
+            if (x_begin < 0 && inside) {
+              x_begin = x;
+            } else if (x_begin >= 0 && !inside) {
+              x_end = x;
+              break;
+            }
+            e0 += step_x_[0];
+            e1 += step_x_[1];
+            e2 += step_x_[2];
+          }
+        }
+        if (x_begin < 0) {
+          continue;
+        }
+        if (x_end < 0) {
+          x_end = std::min(tile_x0 + last * kTile + kTile - 1, max_x_) + 1;
+        }
+        const std::int64_t w[3] = {Eval(0, x_begin, y), Eval(1, x_begin, y),
+                                   Eval(2, x_begin, y)};
+        fn(y, x_begin, x_end, w);
+      }
+    }
+  }
+
+ private:
+  enum TileState : std::uint8_t { kTileEmpty, kTilePartial, kTileFull };
+
+  std::int64_t Eval(int i, int x, int y) const {
+    return base_[i] + step_x_[i] * x + step_y_[i] * y;
+  }
+
+  std::int64_t base_[3] = {0, 0, 0};
+  std::int64_t step_x_[3] = {0, 0, 0};
+  std::int64_t step_y_[3] = {0, 0, 0};
+  std::int64_t bias_[3] = {0, 0, 0};
+  std::int64_t area_ = 0;
+  int min_x_ = 0;
+  int min_y_ = 0;
+  int max_x_ = -1;
+  int max_y_ = -1;
+  std::vector<TileState> tile_state_;
+};
+
+// Writes packed framebuffer pixels as rgb24 rows: the layout of binary PPM
+// bodies and of ffmpeg's `-f rawvideo -pix_fmt rgb24` input.
+inline void PackedToRgb24(const std::uint32_t* src, std::size_t count,
+                          std::uint8_t* dst) {
+  for (std::size_t i = 0; i < count; ++i) {
+    const std::uint32_t v = src[i];
+    dst[i * 3] = static_cast<std::uint8_t>(v);
+    dst[i * 3 + 1] = static_cast<std::uint8_t>(v >> 8);
+    dst[i * 3 + 2] = static_cast<std::uint8_t>(v >> 16);
+  }
+}
+
+// Image encoders for gfx.save, gfx.save_frame and headless dir: output.
+// They take packed framebuffer pixels and build the whole file in `out`.
+inline void EncodePpm(const std::uint32_t* pixels, int width, int height,
+                      std::vector<std::uint8_t>& out) {
+  const std::string header = "P6\n" + std::to_string(width) + " " +
+                             std::to_string(height) + "\n255\n";
+  const std::size_t count = static_cast<std::size_t>(width) * height;
+  out.resize(header.size() + count * 3);
+  std::memcpy(out.data(), header.data(), header.size());
+  PackedToRgb24(pixels, count, out.data() + header.size());
+}
+
+inline std::uint32_t Crc32(const std::uint8_t* data, std::size_t size,
+                           std::uint32_t crc = 0) {
+  static const std::array<std::uint32_t, 256> table = []() {
+    std::array<std::uint32_t, 256> t{};
+    for (std::uint32_t n = 0; n < 256; ++n) {
+      std::uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1u) != 0 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      t[n] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (std::size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ data[i]) & 0xFFu] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// zlib stream for PNG IDAT data: one fixed-Huffman deflate block with
+// greedy LZ77 over the 32 KiB window, which shrinks flat UI and Sub-filtered
+// gradients a lot at little cost. Input that does not compress (noise) is
+// emitted as stored blocks instead.
+inline void ZlibCompress(const std::uint8_t* data, std::size_t size,
+                         std::vector<std::uint8_t>& out) {
+  static const int kLenBase[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                   15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                   67, 83, 99, 115, 131, 163, 195, 227, 258};
+  static const int kLenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const int kDistBase[30] = {
+      1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+      193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+  static const int kDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                     6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+  constexpr std::size_t kWindow = 32768;
+  constexpr int kHashBits = 15;
+
+  const std::size_t start = out.size();
+  out.push_back(0x78);
+  out.push_back(0x01);
+  std::uint64_t bit_buf = 0;
+  int bit_count = 0;
+  auto put_bits = [&](std::uint32_t bits, int n) {
+    bit_buf |= static_cast<std::uint64_t>(bits) << bit_count;
+    bit_count += n;
+    while (bit_count >= 8) {
+      out.push_back(static_cast<std::uint8_t>(bit_buf));
+      bit_buf >>= 8;
+      bit_count -= 8;
+    }
+  };
+  // Huffman codes go out most significant bit first.
+  auto put_code = [&](std::uint32_t code, int n) {
+    std::uint32_t reversed = 0;
+    for (int i = 0; i < n; ++i) {
+      reversed = (reversed << 1) | ((code >> i) & 1u);
+    }
+    put_bits(reversed, n);
+  };
+  auto put_symbol = [&](int sym) {
+    if (sym < 144) {
+      put_code(static_cast<std::uint32_t>(0x30 + sym), 8);
+    } else if (sym < 256) {
+      put_code(static_cast<std::uint32_t>(0x190 + sym - 144), 9);
+    } else if (sym < 280) {
+      put_code(static_cast<std::uint32_t>(sym - 256), 7);
+    } else {
+      put_code(static_cast<std::uint32_t>(0xC0 + sym - 280), 8);
+    }
+  };
+
+  put_bits(1, 1);  // BFINAL
+  put_bits(1, 2);  // fixed Huffman
+  std::vector<std::int32_t> head(static_cast<std::size_t>(1) << kHashBits, -1);
+  auto hash_at = [&](std::size_t i) {
+    const std::uint32_t v = static_cast<std::uint32_t>(data[i]) |
+                            (static_cast<std::uint32_t>(data[i + 1]) << 8) |
+                            (static_cast<std::uint32_t>(data[i + 2]) << 16);
+    return (v * 2654435761u) >> (32 - kHashBits);
+  };
+  std::size_t i = 0;
+  while (i < size) {
+    std::size_t best_len = 0;
+    std::size_t best_dist = 0;
+    if (i + 2 < size) {
+      const std::uint32_t h = hash_at(i);
+      const std::int32_t cand = head[h];
+      head[h] = static_cast<std::int32_t>(i);
+      if (cand >= 0 && i - static_cast<std::size_t>(cand) <= kWindow) {
+        const std::size_t max_len = std::min<std::size_t>(258, size - i);
+        const std::uint8_t* a = data + cand;
+        const std::uint8_t* b = data + i;
+        std::size_t len = 0;
+        while (len < max_len && a[len] == b[len]) {
+          ++len;
+        }
+        if (len >= 3) {
+          best_len = len;
+          best_dist = i - static_cast<std::size_t>(cand);
+        }
+      }
+    }
+    if (best_len == 0) {
+      put_symbol(data[i]);
+      ++i;
+      continue;
+    }
+    int lc = 28;
+    while (kLenBase[lc] > static_cast<int>(best_len)) {
+      --lc;
+    }
+    put_symbol(257 + lc);
+    put_bits(static_cast<std::uint32_t>(best_len - kLenBase[lc]), kLenExtra[lc]);
+    int dc = 29;
+    while (kDistBase[dc] > static_cast<int>(best_dist)) {
+      --dc;
+    }
+    put_code(static_cast<std::uint32_t>(dc), 5);
+    put_bits(static_cast<std::uint32_t>(best_dist - kDistBase[dc]), kDistExtra[dc]);
+    const std::size_t end = i + best_len;
+    for (++i; i < end; ++i) {
+      if (i + 2 < size) {
+        head[hash_at(i)] = static_cast<std::int32_t>(i);
+      }
+    }
+  }
+  put_symbol(256);
+  if (bit_count > 0) {
+    put_bits(0, 8 - bit_count);
+  }
+
+  const std::size_t stored_size = size + (size / 65535 + 1) * 5;
+  if (out.size() - start - 2 > stored_size) {
+    out.resize(start + 2);
+    std::size_t pos = 0;
+    do {
+      const std::size_t n = std::min<std::size_t>(65535, size - pos);
+      out.push_back(pos + n == size ? 1 : 0);
+      out.push_back(static_cast<std::uint8_t>(n));
+      out.push_back(static_cast<std::uint8_t>(n >> 8));
+      out.push_back(static_cast<std::uint8_t>(~n));
+      out.push_back(static_cast<std::uint8_t>(~n >> 8));
+      out.insert(out.end(), data + pos, data + pos + n);
+      pos += n;
+    } while (pos < size);
+  }
+
+  std::uint32_t a = 1;
+  std::uint32_t b = 0;
+  for (std::size_t k = 0; k < size; ++k) {
+    a = (a + data[k]) % 65521u;
+    b = (b + a) % 65521u;
+  }
+  const std::uint32_t adler = (b << 16) | a;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(static_cast<std::uint8_t>(adler >> shift));
+  }
+}
+
+// 8-bit RGB PNG. Every row uses the Sub filter, which turns flat areas and
+// horizontal gradients into runs that the deflate pass folds away.
+inline void EncodePng(const std::uint32_t* pixels, int width, int height,
+                      std::vector<std::uint8_t>& out) {
+  const std::size_t stride = static_cast<std::size_t>(width) * 3 + 1;
+  std::vector<std::uint8_t> filtered(stride * static_cast<std::size_t>(height));
+  for (int y = 0; y < height; ++y) {
+    std::uint8_t* row = filtered.data() + stride * static_cast<std::size_t>(y);
+    row[0] = 1;
+    PackedToRgb24(pixels + static_cast<std::size_t>(y) * width,
+                  static_cast<std::size_t>(width), row + 1);
+    for (std::size_t x = stride - 1; x > 3; --x) {
+      row[x] = static_cast<std::uint8_t>(row[x] - row[x - 3]);
+    }
+  }
+
+  out.clear();
+  static const std::uint8_t kSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  out.insert(out.end(), kSignature, kSignature + 8);
+  auto put_u32 = [&out](std::uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out.push_back(static_cast<std::uint8_t>(v >> shift));
+    }
+  };
+  auto begin_chunk = [&](const char* type) {
+    put_u32(0);  // length, patched by end_chunk
+    out.insert(out.end(), type, type + 4);
+    return out.size() - 4;
+  };
+  auto end_chunk = [&](std::size_t type_pos) {
+    const std::size_t length = out.size() - type_pos - 4;
+    for (int k = 0; k < 4; ++k) {
+      out[type_pos - 4 + k] = static_cast<std::uint8_t>(length >> (24 - 8 * k));
+    }
+    put_u32(Crc32(out.data() + type_pos, out.size() - type_pos));
+  };
+
+  std::size_t chunk = begin_chunk("IHDR");
+  put_u32(static_cast<std::uint32_t>(width));
+  put_u32(static_cast<std::uint32_t>(height));
+  out.push_back(8);  // bit depth
+  out.push_back(2);  // truecolor
+  out.push_back(0);  // deflate
+  out.push_back(0);  // adaptive filtering
+  out.push_back(0);  // no interlace
+  end_chunk(chunk);
+  chunk = begin_chunk("IDAT");
+  ZlibCompress(filtered.data(), filtered.size(), out);
+  end_chunk(chunk);
+  chunk = begin_chunk("IEND");
+  end_chunk(chunk);
+}
+
+// Picks the encoder from the extension: .png, otherwise binary PPM.
+inline void WriteImageFile(const std::string& path, const std::uint32_t* pixels,
+                           int width, int height, std::vector<std::uint8_t>& scratch) {
+  std::filesystem::path out(path);
+  std::string ext = out.extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+                 [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  if (ext == ".png") {
+    EncodePng(pixels, width, height, scratch);
+  } else {
+    EncodePpm(pixels, width, height, scratch);
+  }
+  if (out.has_parent_path()) {
+    std::filesystem::create_directories(out.parent_path());
+  }
+  std::ofstream stream(path, std::ios::binary);
+  stream.write(reinterpret_cast<const char*>(scratch.data()),
+               static_cast<std::streamsize>(scratch.size()));
+  if (!stream) {
+    throw std::runtime_error("Failed to write image: " + path);
+  }
+}
+
+// Background encoder for gfx.save_frame. Frames are copied into a bounded
+// queue and written on one thread, so the caller only waits when the writer
+// is kMaxQueued frames behind. A failed write is reported by the next Push
+// or Flush; frames still queued at destruction are written first.
+class FrameWriter {
+ public:
+  static constexpr std::size_t kMaxQueued = 8;
+
+  FrameWriter() : thread_([this]() { Loop(); }) {}
+
+  FrameWriter(const FrameWriter&) = delete;
+  FrameWriter& operator=(const FrameWriter&) = delete;
+
+  ~FrameWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+    if (!error_.empty()) {
+      std::cerr << error_ << "\n";
+    }
+  }
+
+  void Push(const std::string& path, const std::uint32_t* pixels, int width,
+            int height) {
+    std::unique_lock<std::mutex> lock(mu_);
+    space_.wait(lock, [this]() { return queue_.size() < kMaxQueued; });
+    ThrowPendingError();
+    Job job;
+    if (!free_buffers_.empty()) {
+      job.pixels = std::move(free_buffers_.back());
+      free_buffers_.pop_back();
+    }
+    lock.unlock();
+    job.path = path;
+    job.width = width;
+    job.height = height;
+    job.pixels.assign(pixels, pixels + static_cast<std::size_t>(width) * height);
+    lock.lock();
+    queue_.push_back(std::move(job));
+    wake_.notify_one();
+  }
+
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mu_);
+    space_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+    ThrowPendingError();
+  }
+
+ private:
+  struct Job {
+    std::string path;
+    int width = 0;
+    int height = 0;
+    std::vector<std::uint32_t> pixels;
+  };
+
+  void ThrowPendingError() {
+    if (!error_.empty()) {
+      const std::string message = error_;
+      error_.clear();
+      throw std::runtime_error(message);
+    }
+  }
+
+  void Loop() {
+    BlockProfilerSignal();
+    std::vector<std::uint8_t> encoded;
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+      wake_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      Job job = std::move(queue_.front());
+      queue_.pop_front();
+      busy_ = true;
+      lock.unlock();
+      std::string failure;
+      try {
+        WriteImageFile(job.path, job.pixels.data(), job.width, job.height, encoded);
+      } catch (const std::exception& ex) {
+        failure = std::string("gfx.save_frame: ") + ex.what();
+      }
+      lock.lock();
+      busy_ = false;
+      if (!failure.empty() && error_.empty()) {
+        error_ = failure;
+      }
+      free_buffers_.push_back(std::move(job.pixels));
+      space_.notify_all();
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable wake_;
+  std::condition_variable space_;
+  std::deque<Job> queue_;
+  std::vector<std::vector<std::uint32_t>> free_buffers_;
+  std::string error_;
+  bool busy_ = false;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+#ifndef _WIN32
+// Frame output for gfx.window without a display. The target is a spec:
+//   pipe:<command>  raw rgb24 frames on the command's stdin, e.g.
+//                   pipe:ffmpeg -f rawvideo -pix_fmt rgb24 -s 640x360 -i - out.mp4
+//   shm:<name>[:<slots>]  POSIX shared-memory ring of packed frames
+//   dir:<path>      one binary PPM per frame, frame_000000.ppm onwards
+//   null            frames are shaded and paced but not written
+class HeadlessSink {
+ public:
+  // Layout at the start of the shm:<name> object. Frame n lives in slot
+  // n % slots, `frame_bytes` after the 64-byte header per slot, as packed
+  // pixels (bytes r, g, b, 255). The writer never waits: it fills the slot
+  // and then publishes it by storing n + 1 into frames_written, so a reader
+  // copies slot (frames_written - 1) % slots and re-checks frames_written
+  // to detect that the writer lapped it.
+  struct ShmHeader {
+    char magic[8];  // "PYPPFRM1"
+    std::uint32_t width;
+    std::uint32_t height;
+    std::uint32_t slots;
+    std::uint32_t frame_bytes;
+    std::atomic<std::uint64_t> frames_written;
+  };
+  static constexpr std::size_t kShmHeaderBytes = 64;
+
+  HeadlessSink(const std::string& spec, int width, int height)
+      : width_(width), height_(height) {
+    const std::size_t colon = spec.find(':');
+    const std::string kind = spec.substr(0, colon);
+    const std::string arg = colon == std::string::npos ? "" : spec.substr(colon + 1);
+    if (kind == "null") {
+      kind_ = Kind::kNull;
+    } else if (kind == "pipe" && !arg.empty()) {
+      kind_ = Kind::kPipe;
+      // A reader that exits early must surface as an error, not SIGPIPE.
+      std::signal(SIGPIPE, SIG_IGN);
+      pipe_ = popen(arg.c_str(), "w");
+      if (pipe_ == nullptr) {
+        throw std::runtime_error("gfx headless: cannot start pipe command: " + arg);
+      }
+    } else if (kind == "shm" && !arg.empty()) {
+      kind_ = Kind::kShm;
+      OpenShm(arg);
+    } else if (kind == "dir" && !arg.empty()) {
+      kind_ = Kind::kDir;
+      dir_ = arg;
+      std::filesystem::create_directories(dir_);
+    } else {
+      throw std::runtime_error(
+          "gfx headless target must be pipe:<command>, shm:<name>[:<slots>], "
+          "dir:<path> or null, got: " + spec);
+    }
+  }
+
+  HeadlessSink(const HeadlessSink&) = delete;
+  HeadlessSink& operator=(const HeadlessSink&) = delete;
+
+  ~HeadlessSink() {
+    if (pipe_ != nullptr) {
+      pclose(pipe_);
+    }
+    if (shm_ != nullptr) {
+      munmap(shm_, shm_bytes_);
+    }
+  }
+
+  void Write(const std::uint32_t* frame) {
+    const std::size_t count = static_cast<std::size_t>(width_) * height_;
+    if (kind_ == Kind::kPipe) {
+      rgb_.resize(count * 3);
+      PackedToRgb24(frame, count, rgb_.data());
+      if (std::fwrite(rgb_.data(), 1, rgb_.size(), pipe_) != rgb_.size()) {
+        throw std::runtime_error("gfx.present: headless pipe closed");
+      }
+    } else if (kind_ == Kind::kShm) {
+      auto* header = reinterpret_cast<ShmHeader*>(shm_);
+      const std::uint64_t n = header->frames_written.load(std::memory_order_relaxed);
+      std::uint8_t* slot = static_cast<std::uint8_t*>(shm_) + kShmHeaderBytes +
+                           static_cast<std::size_t>(n % header->slots) *
+                               header->frame_bytes;
+      std::memcpy(slot, frame, header->frame_bytes);
+      header->frames_written.store(n + 1, std::memory_order_release);
+    } else if (kind_ == Kind::kDir) {
+      std::ostringstream name;
+      name << "frame_" << std::setw(6) << std::setfill('0') << frames_ << ".ppm";
+      WriteImageFile((dir_ / name.str()).string(), frame, width_, height_, rgb_);
+    }
+    frames_ += 1;
+  }
+
+ private:
+  enum class Kind { kNull, kPipe, kShm, kDir };
+
+  void OpenShm(const std::string& arg) {
+    std::string name = arg;
+    int slots = 3;
+    const std::size_t colon = arg.rfind(':');
+    if (colon != std::string::npos) {
+      name = arg.substr(0, colon);
+      slots = std::atoi(arg.c_str() + colon + 1);
+      if (slots < 1 || slots > 64) {
+        throw std::runtime_error("gfx headless: shm slots must be 1..64");
+      }
+    }
+    if (name.empty() || name[0] != '/') {
+      name = "/" + name;
+    }
+    const std::size_t frame_bytes =
+        static_cast<std::size_t>(width_) * height_ * sizeof(std::uint32_t);
+    shm_bytes_ = kShmHeaderBytes + frame_bytes * static_cast<std::size_t>(slots);
+    const int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("gfx headless: shm_open failed for " + name);
+    }
+    if (ftruncate(fd, static_cast<off_t>(shm_bytes_)) != 0) {
+      close(fd);
+      throw std::runtime_error("gfx headless: cannot size shm " + name);
+    }
+    void* mem = mmap(nullptr, shm_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+      throw std::runtime_error("gfx headless: mmap failed for " + name);
+    }
+    shm_ = mem;
+    auto* header = new (shm_) ShmHeader();
+    std::memcpy(header->magic, "PYPPFRM1", 8);
+    header->width = static_cast<std::uint32_t>(width_);
+    header->height = static_cast<std::uint32_t>(height_);
+    header->slots = static_cast<std::uint32_t>(slots);
+    header->frame_bytes = static_cast<std::uint32_t>(frame_bytes);
+    header->frames_written.store(0, std::memory_order_release);
+  }
+
+  Kind kind_ = Kind::kNull;
+  int width_ = 0;
+  int height_ = 0;
+  std::uint64_t frames_ = 0;
+  std::FILE* pipe_ = nullptr;
+  void* shm_ = nullptr;
+  std::size_t shm_bytes_ = 0;
+  std::filesystem::path dir_;
+  std::vector<std::uint8_t> rgb_;
+};
+#endif
+
 struct GraphicsState {
   int width = 0;
   int height = 0;
-  std::vector<Pixel> pixels;
+  std::vector<std::uint32_t> pixels;
   struct SpriteTexel {
     std::uint8_t r = 0;
     std::uint8_t g = 0;
     std::uint8_t b = 0;
     std::uint8_t a = 255;
   };
+  // One sampled image of a sprite: level 0 is the sprite itself, each mip
+  // level halves both axes (rounding up) down to 1x1.
+  struct SpriteLevel {
+    int width = 0;
+    int height = 0;
+    const SpriteTexel* texels = nullptr;
+  };
+  struct MipLevel {
+    int width = 0;
+    int height = 0;
+    std::vector<SpriteTexel> texels;
+  };
   struct SpriteAsset {
     int width = 0;
     int height = 0;
     std::vector<SpriteTexel> texels;
+    // Levels 1.. of the mip chain, built by AddSprite (about a third of the
+    // level 0 size in total).
+    std::vector<MipLevel> mips;
+    // Set by AddSprite when some texel is neither fully opaque nor fully
+    // transparent, i.e. drawing it blends.
+    bool translucent = false;
+
+    int LevelCount() const { return 1 + static_cast<int>(mips.size()); }
+    SpriteLevel Level(int level) const {
+      if (level <= 0) {
+        return SpriteLevel{width, height, texels.data()};
+      }
+      const MipLevel& m = mips[static_cast<std::size_t>(level - 1)];
+      return SpriteLevel{m.width, m.height, m.texels.data()};
+    }
   };
+  static_assert(sizeof(SpriteTexel) == 4, "blend kernels read texels as RGBA8");
   std::vector<SpriteAsset> sprites;
+  // Sprites packed into one texture by gfx.atlas_build. `rects` is indexed
+  // by the source sprite id; sprites not in the atlas have w == 0.
+  struct AtlasRect {
+    int x = 0;
+    int y = 0;
+    int w = 0;
+    int h = 0;
+  };
+  struct SpriteAtlas {
+    int sprite_id = -1;
+    std::vector<AtlasRect> rects;
+  };
+  std::vector<SpriteAtlas> atlases;
+  // A block of kTileChunkSize x kTileChunkSize cells pre-rendered by
+  // TilemapDraw. Cells without a tile stay transparent.
+  static constexpr int kTileChunkSize = 16;
+  struct TileChunk {
+    SpriteAsset image;
+    bool dirty = true;
+    bool empty = true;
+    bool opaque = false;
+    std::uint64_t last_used = 0;
+  };
+  // The chunks of one map rendered with one tileset layout
+  // (sprite, tiles_per_row, src_w, src_h).
+  struct TileLayout {
+    int sprite = -1;
+    int tiles_per_row = 0;
+    int src_w = 0;
+    int src_h = 0;
+    std::vector<TileChunk> chunks;
+    int resident_chunks = 0;
+    std::uint64_t last_used = 0;
+  };
   struct Tilemap2D {
     int cols = 0;
     int rows = 0;
     int tile_w = 0;
     int tile_h = 0;
     std::vector<int> tiles;
+    // One chunk cache per recently drawn layout, so a base layer and an
+    // overlay drawn from the same map both stay cached. TilemapSet and
+    // TilemapFill mark the affected chunks dirty in every layout.
+    int chunk_cols = 0;
+    int chunk_rows = 0;
+    std::vector<TileLayout> layouts;
+    std::uint64_t draw_clock = 0;
   };
   std::vector<Tilemap2D> tilemaps;
-  struct Particle {
-    double x = 0.0;
-    double y = 0.0;
-    double vx = 0.0;
-    double vy = 0.0;
-    int life = 0;
-    int max_life = 1;
-    Pixel color{};
+  // Particles as structure-of-arrays: ParticlesUpdate streams over plain
+  // float/int columns so the integration loop vectorizes. `color` holds the
+  // packed spawn color.
+  struct ParticleStore {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> vx;
+    std::vector<float> vy;
+    std::vector<std::int32_t> life;
+    std::vector<std::int32_t> max_life;
+    std::vector<std::uint32_t> color;
+
+    std::size_t size() const { return x.size(); }
+    void clear() { resize(0); }
+    void resize(std::size_t n) {
+      x.resize(n);
+      y.resize(n);
+      vx.resize(n);
+      vy.resize(n);
+      life.resize(n);
+      max_life.resize(n);
+      color.resize(n);
+    }
+  };
+  static constexpr std::size_t kMaxParticles = std::size_t{4} << 20;
+  ParticleStore particles;
+  std::vector<std::size_t> particle_block_kept;
+  // One row span [x0, x1) per dy of the splat for the current draw size.
+  struct SplatRow {
+    int dy;
+    int x0;
+    int x1;
   };
-  std::vector<Particle> particles;
+  std::vector<SplatRow> particle_stamp;
+  // ParticlesDraw's bins: particle indices per (block, band), and the band
+  // of every framebuffer row.
+  std::vector<std::vector<std::uint32_t>> particle_bins;
+  std::vector<int> particle_row_band;
   struct AnimClip {
     int first_sprite = 0;
     int frame_count = 0;
@@ -712,36 +2239,80 @@ struct GraphicsState {
     int p2 = 0;
     int p3 = 0;
   };
+  // One step of a compiled op list. Runs of per-channel ops (scanline,
+  // invert, posterize, dither) fold into a single 256-entry table, with one
+  // table per (frame parity, y, x) variant the fused ops can tell apart;
+  // the three channels share it since every such op treats them alike.
+  // Grayscale and threshold become table lookups on luminance. Ops that
+  // sample neighbours or depend on position run through ApplyShaderOp.
+  struct ShaderStage {
+    enum class Kind { kChannelLut, kGrayMix, kThreshold, kOp };
+    Kind kind = Kind::kOp;
+    std::size_t op_index = 0;
+    int x_mask = 0;
+    int y_mask = 0;
+    int frame_mask = 0;
+    std::vector<std::array<std::uint8_t, 256>> luts;
+    // kGrayMix: channel = (keep[channel] + gray[luminance]) / 1000.
+    std::array<int, 256> keep{};
+    std::array<int, 256> gray{};
+  };
   struct ShaderProgram {
     std::vector<ShaderOp> ops;
+    std::vector<ShaderStage> stages;
+    bool compiled = false;
   };
   std::vector<ShaderProgram> shader_programs;
+  // Half-resolution blur of the unshaded frame, rebuilt before the shading
+  // sweep for every bloom (14) and blur (15) op. Per pixel it holds r, g, b
+  // and the weight of pixels that passed the threshold, all box-filtered,
+  // so r / weight is the average color of the bright neighborhood.
+  struct BlurPass {
+    int width = 0;
+    int height = 0;
+    std::vector<float> rgbw;
+  };
+  std::vector<BlurPass> shader_blur_passes;
+  std::vector<float> blur_scratch;
+  ShaderProgram single_shader;
+  std::vector<std::uint32_t> rgba_buffer;
+  EdgeRasterizer triangle_raster;
+  std::vector<SpriteTexel> span_scratch;
+  std::vector<std::uint8_t> save_scratch;
+  std::unique_ptr<FrameWriter> frame_writer;
+  int mouse_client_x = -1;
+  int mouse_client_y = -1;
+  bool mouse_left_down = false;
+  bool mouse_left_prev = false;
 #ifdef _WIN32
   HWND hwnd = nullptr;
   bool window_open = false;
   std::array<bool, 256> key_state{};
-  std::vector<std::uint32_t> rgba_buffer;
   bool keep_aspect = false;
   int aspect_w = 0;
   int aspect_h = 0;
   RECT viewport_rect{0, 0, 0, 0};
-  int mouse_client_x = -1;
-  int mouse_client_y = -1;
-  bool mouse_left_down = false;
   bool mouse_right_down = false;
   bool mouse_middle_down = false;
-  bool mouse_left_prev = false;
   bool mouse_lock = false;
   bool mouse_hidden = false;
   int mouse_dx_acc = 0;
   int mouse_dy_acc = 0;
   bool suppress_mouse_delta = false;
+#else
+  // Headless present target (see HeadlessSink); gfx.headless() sets it and
+  // PYPP_HEADLESS / PYPP_HEADLESS_FRAMES supply defaults for gfx.window.
+  std::string headless_spec;
+  int headless_frame_limit = 0;
+  std::unique_ptr<HeadlessSink> headless;
 #endif
   int shader_mode = 0;
   int shader_p1 = 0;
   int shader_p2 = 0;
   int shader_p3 = 0;
   int shader_program_active = -1;
+  int shader_threads = 0;  // 0 = one per hardware thread
+  std::unique_ptr<WorkerPool> workers;
   int present_frame = 0;
   int shake_intensity = 0;
   int shake_frames = 0;
@@ -760,7 +2331,7 @@ struct GraphicsState {
     }
     width = w;
     height = h;
-    pixels.assign(static_cast<std::size_t>(w * h), Pixel{0, 0, 0});
+    pixels.assign(static_cast<std::size_t>(w * h), PackPixel(0, 0, 0));
     present_frame = 0;
     shader_mode = 0;
     shader_p1 = 0;
@@ -777,8 +2348,8 @@ struct GraphicsState {
 
   void Clear(int r, int g, int b) {
     EnsureOpen("gfx.clear");
-    Pixel p{ClampColor(r), ClampColor(g), ClampColor(b)};
-    std::fill(pixels.begin(), pixels.end(), p);
+    ActiveSpanKernels().fill(pixels.data(), static_cast<int>(pixels.size()),
+                             PackColor(r, g, b));
   }
 
   void PixelAt(int x, int y, int r, int g, int b) {
@@ -786,21 +2357,19 @@ struct GraphicsState {
     if (x < 0 || y < 0 || x >= width || y >= height) {
       return;
     }
-    pixels[static_cast<std::size_t>(y * width + x)] =
-        Pixel{ClampColor(r), ClampColor(g), ClampColor(b)};
+    pixels[static_cast<std::size_t>(y * width + x)] = PackColor(r, g, b);
   }
 
   void PixelAtFast(int x, int y, int r, int g, int b) {
     if (x < 0 || y < 0 || x >= width || y >= height) {
       return;
     }
-    pixels[static_cast<std::size_t>(y * width + x)] =
-        Pixel{ClampColor(r), ClampColor(g), ClampColor(b)};
+    pixels[static_cast<std::size_t>(y * width + x)] = PackColor(r, g, b);
   }
 
   void Line(int x1, int y1, int x2, int y2, int r, int g, int b) {
     EnsureOpen("gfx.line");
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
+    const std::uint32_t color = PackColor(r, g, b);
 
     int dx = std::abs(x2 - x1);
     int dy = -std::abs(y2 - y1);
@@ -830,11 +2399,10 @@ struct GraphicsState {
     if (w <= 0 || h <= 0) {
       return;
     }
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
-    for (int yy = 0; yy < h; ++yy) {
-      for (int xx = 0; xx < w; ++xx) {
-        SetPixelRaw(x + xx, y + yy, color);
-      }
+    const std::uint32_t color = PackColor(r, g, b);
+    const int y_end = std::min(height, y + h);
+    for (int yy = std::max(0, y); yy < y_end; ++yy) {
+      FillRowClipped(yy, x, x + w, color);
     }
   }
 
@@ -848,36 +2416,28 @@ struct GraphicsState {
       return;
     }
     radius = std::min(radius, std::min(w / 2, h / 2));
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
+    const std::uint32_t color = PackColor(r, g, b);
 
     for (int yy = y + radius; yy < y + h - radius; ++yy) {
-      for (int xx = x; xx < x + w; ++xx) {
-        SetPixelRaw(xx, yy, color);
-      }
+      FillRowClipped(yy, x, x + w, color);
     }
     for (int yy = y; yy < y + radius; ++yy) {
-      for (int xx = x + radius; xx < x + w - radius; ++xx) {
-        SetPixelRaw(xx, yy, color);
-      }
+      FillRowClipped(yy, x + radius, x + w - radius, color);
     }
     for (int yy = y + h - radius; yy < y + h; ++yy) {
-      for (int xx = x + radius; xx < x + w - radius; ++xx) {
-        SetPixelRaw(xx, yy, color);
-      }
+      FillRowClipped(yy, x + radius, x + w - radius, color);
     }
 
+    // Corner quadrants: row oy covers every ox whose distance
+    // dx = radius - 1 - ox satisfies dx^2 + dy^2 <= radius^2.
     const int rr = radius * radius;
     for (int oy = 0; oy < radius; ++oy) {
-      for (int ox = 0; ox < radius; ++ox) {
-        const int dx = radius - 1 - ox;
-        const int dy = radius - 1 - oy;
-        if ((dx * dx + dy * dy) <= rr) {
-          SetPixelRaw(x + ox, y + oy, color);
-          SetPixelRaw(x + w - radius + ox, y + oy, color);
-          SetPixelRaw(x + ox, y + h - radius + oy, color);
-          SetPixelRaw(x + w - radius + ox, y + h - radius + oy, color);
-        }
-      }
+      const int dy = radius - 1 - oy;
+      const int ox0 = std::max(0, radius - 1 - ISqrt(rr - dy * dy));
+      FillRowClipped(y + oy, x + ox0, x + radius, color);
+      FillRowClipped(y + oy, x + w - radius + ox0, x + w, color);
+      FillRowClipped(y + h - radius + oy, x + ox0, x + radius, color);
+      FillRowClipped(y + h - radius + oy, x + w - radius + ox0, x + w, color);
     }
   }
 
@@ -886,7 +2446,7 @@ struct GraphicsState {
     if (w <= 0 || h <= 0) {
       return;
     }
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
+    const std::uint32_t color = PackColor(r, g, b);
     for (int xx = 0; xx < w; ++xx) {
       SetPixelRaw(x + xx, y, color);
       SetPixelRaw(x + xx, y + h - 1, color);
@@ -902,15 +2462,11 @@ struct GraphicsState {
     if (radius <= 0) {
       return;
     }
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
+    const std::uint32_t color = PackColor(r, g, b);
     int rr = radius * radius;
     for (int y = -radius; y <= radius; ++y) {
-      for (int x = -radius; x <= radius; ++x) {
-        int d = x * x + y * y;
-        if (d <= rr) {
-          SetPixelRaw(cx + x, cy + y, color);
-        }
-      }
+      const int m = ISqrt(rr - y * y);
+      FillRowClipped(cy + y, cx - m, cx + m + 1, color);
     }
   }
 
@@ -924,55 +2480,34 @@ struct GraphicsState {
     const int inner = std::max(0, radius - thickness);
     const int outer2 = outer * outer;
     const int inner2 = inner * inner;
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
+    const std::uint32_t color = PackColor(r, g, b);
     for (int y = -outer; y <= outer; ++y) {
-      for (int x = -outer; x <= outer; ++x) {
-        const int d = x * x + y * y;
-        if (d <= outer2 && d >= inner2) {
-          SetPixelRaw(cx + x, cy + y, color);
-        }
+      const int mo = ISqrt(outer2 - y * y);
+      // Pixels with x^2 + y^2 < inner^2 form the hole [-mi, mi].
+      const int hole = inner2 - y * y - 1;
+      if (hole < 0) {
+        FillRowClipped(cy + y, cx - mo, cx + mo + 1, color);
+        continue;
       }
+      const int mi = ISqrt(hole);
+      FillRowClipped(cy + y, cx - mo, cx - mi, color);
+      FillRowClipped(cy + y, cx + mi + 1, cx + mo + 1, color);
     }
   }
 
   void Triangle2D(int x1, int y1, int x2, int y2, int x3, int y3, int r, int g,
                   int b) {
     EnsureOpen("gfx.triangle");
-    int min_x = std::min(x1, std::min(x2, x3));
-    int max_x = std::max(x1, std::max(x2, x3));
-    int min_y = std::min(y1, std::min(y2, y3));
-    int max_y = std::max(y1, std::max(y2, y3));
-
-    min_x = std::max(0, min_x);
-    min_y = std::max(0, min_y);
-    max_x = std::min(width - 1, max_x);
-    max_y = std::min(height - 1, max_y);
-    if (min_x > max_x || min_y > max_y) {
-      return;
-    }
-
-    const double denom =
-        static_cast<double>((y2 - y3) * (x1 - x3) + (x3 - x2) * (y1 - y3));
-    if (std::abs(denom) < 1e-9) {
+    if (!triangle_raster.Setup(x1, y1, x2, y2, x3, y3, width, height)) {
       return;
     }
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
-    for (int y = min_y; y <= max_y; ++y) {
-      for (int x = min_x; x <= max_x; ++x) {
-        const double px = static_cast<double>(x) + 0.5;
-        const double py = static_cast<double>(y) + 0.5;
-        const double w1 =
-            ((y2 - y3) * (px - x3) + (x3 - x2) * (py - y3)) / denom;
-        const double w2 =
-            ((y3 - y1) * (px - x3) + (x1 - x3) * (py - y3)) / denom;
-        const double w3 = 1.0 - w1 - w2;
-        const bool inside_ccw = (w1 >= 0.0 && w2 >= 0.0 && w3 >= 0.0);
-        const bool inside_cw = (w1 <= 0.0 && w2 <= 0.0 && w3 <= 0.0);
-        if (inside_ccw || inside_cw) {
-          SetPixelRaw(x, y, color);
-        }
-      }
-    }
+    const std::uint32_t color = PackColor(r, g, b);
+    triangle_raster.Run(
+        [this, &color](int y, int x_begin, int x_end, const std::int64_t*) {
+          ActiveSpanKernels().fill(
+              pixels.data() + static_cast<std::size_t>(y) * width + x_begin,
+              x_end - x_begin, color);
+        });
   }
 
   void LineThick(int x1, int y1, int x2, int y2, int thickness, int r, int g,
@@ -1006,44 +2541,58 @@ struct GraphicsState {
     }
     const bool v = (vertical != 0);
     const int span = std::max(1, v ? (h - 1) : (w - 1));
-    for (int yy = 0; yy < h; ++yy) {
-      for (int xx = 0; xx < w; ++xx) {
-        const int pos = v ? yy : xx;
-        const int rr = r1 + ((r2 - r1) * pos) / span;
-        const int gg = g1 + ((g2 - g1) * pos) / span;
-        const int bb = b1 + ((b2 - b1) * pos) / span;
-        SetPixelRaw(x + xx, y + yy,
-                    Pixel{ClampColor(rr), ClampColor(gg), ClampColor(bb)});
+    auto color_at = [&](int pos) {
+      const int rr = r1 + ((r2 - r1) * pos) / span;
+      const int gg = g1 + ((g2 - g1) * pos) / span;
+      const int bb = b1 + ((b2 - b1) * pos) / span;
+      return PackColor(rr, gg, bb);
+    };
+    const int x0 = std::max(0, x);
+    const int x1 = std::min(width, x + w);
+    const int y0 = std::max(0, y);
+    const int y1 = std::min(height, y + h);
+    if (x0 >= x1 || y0 >= y1) {
+      return;
+    }
+    if (v) {
+      for (int yy = y0; yy < y1; ++yy) {
+        FillRowClipped(yy, x0, x1, color_at(yy - y));
       }
+      return;
+    }
+    // Horizontal gradients repeat the same row: build it once, copy it down.
+    std::uint32_t* first =
+        pixels.data() + static_cast<std::size_t>(y0) * width + x0;
+    for (int xx = x0; xx < x1; ++xx) {
+      first[xx - x0] = color_at(xx - x);
+    }
+    for (int yy = y0 + 1; yy < y1; ++yy) {
+      std::copy(first, first + (x1 - x0),
+                pixels.data() + static_cast<std::size_t>(yy) * width + x0);
     }
   }
 
-  void Save(const std::string& path) const {
+  void Save(const std::string& path) {
     EnsureOpen("gfx.save");
-    std::filesystem::path out(path);
-    if (out.has_parent_path()) {
-      std::filesystem::create_directories(out.parent_path());
-    }
-
-    std::ofstream stream(path, std::ios::binary);
-    if (!stream) {
-      throw std::runtime_error("Failed to write image: " + path);
-    }
-    stream << "P3\n" << width << " " << height << "\n255\n";
-    for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-        const Pixel& p = pixels[static_cast<std::size_t>(y * width + x)];
-        stream << p.r << " " << p.g << " " << p.b << "\n";
-      }
-    }
+    WriteImageFile(path, pixels.data(), width, height, save_scratch);
   }
 
-  void SaveFrame(const std::string& prefix, int frame_index) const {
+  void SaveFrame(const std::string& prefix, int frame_index) {
     EnsureOpen("gfx.save_frame");
     std::ostringstream name;
     name << prefix << "_" << std::setw(4) << std::setfill('0')
          << std::max(0, frame_index) << ".ppm";
-    Save(name.str());
+    if (!frame_writer) {
+      frame_writer = std::make_unique<FrameWriter>();
+    }
+    frame_writer->Push(name.str(), pixels.data(), width, height);
+  }
+
+  // Waits until every gfx.save_frame image is on disk.
+  void SaveFlush() {
+    if (frame_writer) {
+      frame_writer->Flush();
+    }
   }
 
   int Width() const {
@@ -1091,6 +2640,8 @@ struct GraphicsState {
     map.tile_w = tile_w;
     map.tile_h = tile_h;
     map.tiles.assign(static_cast<std::size_t>(cols * rows), -1);
+    map.chunk_cols = (cols + kTileChunkSize - 1) / kTileChunkSize;
+    map.chunk_rows = (rows + kTileChunkSize - 1) / kTileChunkSize;
     tilemaps.push_back(std::move(map));
     return static_cast<int>(tilemaps.size() - 1);
   }
@@ -1101,7 +2652,15 @@ struct GraphicsState {
     if (x < 0 || y < 0 || x >= map.cols || y >= map.rows) {
       return;
     }
-    map.tiles[static_cast<std::size_t>(y * map.cols + x)] = tile_id;
+    int& cell = map.tiles[static_cast<std::size_t>(y * map.cols + x)];
+    if (cell != tile_id) {
+      cell = tile_id;
+      const std::size_t chunk = static_cast<std::size_t>(
+          (y / kTileChunkSize) * map.chunk_cols + x / kTileChunkSize);
+      for (TileLayout& layout : map.layouts) {
+        layout.chunks[chunk].dirty = true;
+      }
+    }
   }
 
   int TilemapGet(int map_id, int x, int y) const {
@@ -1115,6 +2674,11 @@ struct GraphicsState {
   void TilemapFill(int map_id, int tile_id) {
     Tilemap2D& map = GetTilemap(map_id, "gfx.tilemap_fill");
     std::fill(map.tiles.begin(), map.tiles.end(), tile_id);
+    for (TileLayout& layout : map.layouts) {
+      for (TileChunk& chunk : layout.chunks) {
+        chunk.dirty = true;
+      }
+    }
   }
 
   int TilemapWidth(int map_id) const {
@@ -1127,6 +2691,9 @@ struct GraphicsState {
     return map.rows;
   }
 
+  // Draws only the chunks that overlap the framebuffer after camera2d.
+  // Each chunk is rendered once into a cached block and then blitted (or
+  // copied row by row when fully opaque) until its tiles change.
   void TilemapDraw(int map_id, int sprite_id, int tiles_per_row, int src_w,
                    int src_h, int dst_x, int dst_y) {
     EnsureOpen("gfx.tilemap_draw");
@@ -1135,25 +2702,73 @@ struct GraphicsState {
           "gfx.tilemap_draw expects tiles_per_row/src_w/src_h > 0");
     }
     Tilemap2D& map = GetTilemap(map_id, "gfx.tilemap_draw");
-    (void)GetSprite(sprite_id, "gfx.tilemap_draw");
+    const SpriteAsset& s = GetSprite(sprite_id, "gfx.tilemap_draw");
+
+    const int ox = CameraX(dst_x);
+    const int oy = CameraY(dst_y);
+    const int col0 = std::max(0, FloorDiv(-ox, map.tile_w));
+    const int col1 = std::min(map.cols, FloorDiv(width - ox - 1, map.tile_w) + 1);
+    const int row0 = std::max(0, FloorDiv(-oy, map.tile_h));
+    const int row1 = std::min(map.rows, FloorDiv(height - oy - 1, map.tile_h) + 1);
+    if (col0 >= col1 || row0 >= row1) {
+      return;
+    }
+
+    // Huge tiles would make huge blocks; draw those visible cells directly.
+    constexpr long long kMaxChunkPixels = 1 << 20;
+    if (static_cast<long long>(map.tile_w) * map.tile_h * kTileChunkSize *
+            kTileChunkSize > kMaxChunkPixels) {
+      for (int y = row0; y < row1; ++y) {
+        for (int x = col0; x < col1; ++x) {
+          const int tile_id = map.tiles[static_cast<std::size_t>(y * map.cols + x)];
+          if (tile_id < 0) {
+            continue;
+          }
+          BlitRegion(s, (tile_id % tiles_per_row) * src_w,
+                     (tile_id / tiles_per_row) * src_h, src_w, src_h,
+                     ox + x * map.tile_w, oy + y * map.tile_h, map.tile_w,
+                     map.tile_h, 255, 255, 255);
+        }
+      }
+      return;
+    }
 
-    for (int y = 0; y < map.rows; ++y) {
-      for (int x = 0; x < map.cols; ++x) {
-        const int tile_id =
-            map.tiles[static_cast<std::size_t>(y * map.cols + x)];
-        if (tile_id < 0) {
+    ++map.draw_clock;
+    TileLayout& layout = GetTileLayout(map, sprite_id, tiles_per_row, src_w, src_h);
+    layout.last_used = map.draw_clock;
+    const int chunk_px_w = kTileChunkSize * map.tile_w;
+    const int chunk_px_h = kTileChunkSize * map.tile_h;
+    for (int cy = row0 / kTileChunkSize; cy <= (row1 - 1) / kTileChunkSize; ++cy) {
+      for (int cx = col0 / kTileChunkSize; cx <= (col1 - 1) / kTileChunkSize;
+           ++cx) {
+        TileChunk& chunk =
+            layout.chunks[static_cast<std::size_t>(cy * map.chunk_cols + cx)];
+        if (chunk.dirty) {
+          RenderTileChunk(map, layout, s, cx, cy, chunk);
+        }
+        chunk.last_used = map.draw_clock;
+        if (chunk.empty) {
+          continue;
+        }
+        const int px = ox + cx * chunk_px_w;
+        const int py = oy + cy * chunk_px_h;
+        const SpriteAsset& img = chunk.image;
+        if (!chunk.opaque) {
+          BlitRegion(img, 0, 0, img.width, img.height, px, py, img.width,
+                     img.height, 255, 255, 255);
           continue;
         }
-        const int tx = tile_id % tiles_per_row;
-        const int ty = tile_id / tiles_per_row;
-        const int sx = tx * src_w;
-        const int sy = ty * src_h;
-        const int px = dst_x + x * map.tile_w;
-        const int py = dst_y + y * map.tile_h;
-        DrawSpriteRegionScaled(sprite_id, sx, sy, src_w, src_h, px, py,
-                               map.tile_w, map.tile_h);
+        const int x0 = std::max(0, px);
+        const int x1 = std::min(width, px + img.width);
+        for (int y = std::max(0, py); y < std::min(height, py + img.height); ++y) {
+          std::memcpy(pixels.data() + static_cast<std::size_t>(y) * width + x0,
+                      img.texels.data() +
+                          static_cast<std::size_t>(y - py) * img.width + (x0 - px),
+                      static_cast<std::size_t>(x1 - x0) * sizeof(std::uint32_t));
+        }
       }
     }
+    EvictTileChunks(layout, map.draw_clock);
   }
 
   int AudioPlayWav(const std::string& path, int loop_flag) {
@@ -1211,7 +2826,36 @@ struct GraphicsState {
     UpdateViewportRect();
 #else
     (void)title;
-    throw std::runtime_error("Live windowing currently supported on Windows only");
+    std::string spec = headless_spec;
+    int frame_limit = headless_frame_limit;
+    if (spec.empty()) {
+      if (const char* env = std::getenv("PYPP_HEADLESS")) {
+        spec = env;
+      }
+      if (const char* env = std::getenv("PYPP_HEADLESS_FRAMES")) {
+        frame_limit = std::max(0, std::atoi(env));
+      }
+    }
+    if (spec.empty()) {
+      throw std::runtime_error(
+          "Live windowing currently supported on Windows only; use "
+          "gfx.headless(target, frames) or PYPP_HEADLESS for headless output");
+    }
+    headless.reset();
+    headless = std::make_unique<HeadlessSink>(spec, w, h);
+    headless_frame_limit = frame_limit;
+    rgba_buffer.assign(static_cast<std::size_t>(width * height), 0);
+#endif
+  }
+
+  void SetHeadless(const std::string& spec, int frame_limit) {
+#ifdef _WIN32
+    (void)spec;
+    (void)frame_limit;
+    throw std::runtime_error("gfx.headless is not available on Windows");
+#else
+    headless_spec = spec;
+    headless_frame_limit = std::max(0, frame_limit);
 #endif
   }
 
@@ -1294,7 +2938,8 @@ struct GraphicsState {
     }
     return window_open ? 1 : 0;
 #else
-    return 0;
+    mouse_left_prev = mouse_left_down;
+    return headless ? 1 : 0;
 #endif
   }
 
@@ -1318,7 +2963,24 @@ struct GraphicsState {
     SyncFrame();
     return 1;
 #else
-    return 0;
+    if (!headless) {
+      return 0;
+    }
+    if (rgba_buffer.size() != static_cast<std::size_t>(width * height)) {
+      rgba_buffer.assign(static_cast<std::size_t>(width * height), 0);
+    }
+    BuildPresentBuffer();
+    headless->Write(rgba_buffer.data());
+    present_frame += 1;
+    if (shake_frames > 0) {
+      shake_frames -= 1;
+    }
+    // The frame limit plays the part of the user closing the window.
+    if (headless_frame_limit > 0 && present_frame >= headless_frame_limit) {
+      headless.reset();
+    }
+    SyncFrame();
+    return 1;
 #endif
   }
 
@@ -1360,7 +3022,7 @@ struct GraphicsState {
 #ifdef _WIN32
     return window_open ? 0 : 1;
 #else
-    return 1;
+    return headless ? 0 : 1;
 #endif
   }
 
@@ -1372,17 +3034,32 @@ struct GraphicsState {
       hwnd = nullptr;
     }
     window_open = false;
+#else
+    headless.reset();
 #endif
   }
 
+  // Registers a decoded sprite: builds its mip chain and flags it
+  // translucent when any texel blends.
+  int AddSprite(SpriteAsset&& sprite) {
+    BuildMips(sprite);
+    sprite.translucent = std::any_of(
+        sprite.texels.begin(), sprite.texels.end(),
+        [](const SpriteTexel& t) { return t.a != 0 && t.a != 255; });
+    sprites.push_back(std::move(sprite));
+    return static_cast<int>(sprites.size() - 1);
+  }
+
   int LoadSprite(const std::string& path) {
-#ifdef _WIN32
     SpriteAsset sprite;
-    if (TryLoadP3Ppm(path, sprite)) {
-      sprites.push_back(std::move(sprite));
-      return static_cast<int>(sprites.size() - 1);
+    std::vector<std::uint8_t> data;
+    if (!ReadFileBytes(path, data)) {
+      throw std::runtime_error("gfx.load_sprite failed for: " + path);
     }
-
+    if (DecodeSprite(data, path, sprite)) {
+      return AddSprite(std::move(sprite));
+    }
+#ifdef _WIN32
     (void)GetGdiPlusRuntime();
     std::filesystem::path p(path);
     std::wstring wp = p.wstring();
@@ -1401,28 +3078,26 @@ struct GraphicsState {
     sprite.height = h;
     sprite.texels.resize(static_cast<std::size_t>(w * h));
 
+    Gdiplus::Rect rect(0, 0, w, h);
+    Gdiplus::BitmapData locked{};
+    if (bmp->LockBits(&rect, Gdiplus::ImageLockModeRead, PixelFormat32bppARGB,
+                      &locked) != Gdiplus::Ok) {
+      throw std::runtime_error("gfx.load_sprite pixel read failed: " + path);
+    }
     for (int y = 0; y < h; ++y) {
-      for (int x = 0; x < w; ++x) {
-        Gdiplus::Color c;
-        if (bmp->GetPixel(static_cast<INT>(x), static_cast<INT>(y), &c) !=
-            Gdiplus::Ok) {
-          throw std::runtime_error("gfx.load_sprite pixel read failed: " + path);
-        }
-        SpriteTexel t;
-        t.r = c.GetR();
-        t.g = c.GetG();
-        t.b = c.GetB();
-        t.a = c.GetA();
-        sprite.texels[static_cast<std::size_t>(y * w + x)] = t;
+      const std::uint8_t* row = static_cast<const std::uint8_t*>(locked.Scan0) +
+                                static_cast<std::ptrdiff_t>(y) * locked.Stride;
+      SpriteTexel* dst = sprite.texels.data() + static_cast<std::size_t>(y * w);
+      for (int x = 0; x < w; ++x, row += 4) {
+        dst[x] = SpriteTexel{row[2], row[1], row[0], row[3]};
       }
     }
-
-    sprites.push_back(std::move(sprite));
-    return static_cast<int>(sprites.size() - 1);
+    bmp->UnlockBits(&locked);
+    return AddSprite(std::move(sprite));
 #else
-    (void)path;
     throw std::runtime_error(
-        "gfx.load_sprite is currently implemented for Windows builds only");
+        "gfx.load_sprite supports .ppm/.pam, .tga, .bmp and .qoi files on this "
+        "platform: " + path);
 #endif
   }
 
@@ -1466,38 +3141,157 @@ struct GraphicsState {
     if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0) {
       return;
     }
-    const int draw_x = CameraX(dst_x);
-    const int draw_y = CameraY(dst_y);
     const SpriteAsset& s = GetSprite(sprite_id, "gfx.draw_sprite_region");
-    for (int yy = 0; yy < dst_h; ++yy) {
-      const int sy = src_y + ((yy * src_h) / dst_h);
-      for (int xx = 0; xx < dst_w; ++xx) {
-        const int sx = src_x + ((xx * src_w) / dst_w);
-        if (sx < 0 || sy < 0 || sx >= s.width || sy >= s.height) {
-          continue;
+    BlitRegion(s, src_x, src_y, src_w, src_h, CameraX(dst_x), CameraY(dst_y),
+               dst_w, dst_h, 255, 255, 255);
+  }
+
+  // Packs the given sprites into one texture with a skyline bottom-left
+  // packer (tallest first, 1px transparent gutter) and returns the atlas id.
+  // The texture is itself a sprite, see AtlasSprite.
+  int AtlasBuild(const std::vector<int>& sprite_ids) {
+    if (sprite_ids.empty()) {
+      throw std::runtime_error("gfx.atlas_build expects a non-empty sprite list");
+    }
+    constexpr int kGutter = 1;
+    std::vector<int> order;
+    long long area = 0;
+    int widest = 0;
+    for (int id : sprite_ids) {
+      const SpriteAsset& s = GetSprite(id, "gfx.atlas_build");
+      if (std::find(order.begin(), order.end(), id) != order.end()) {
+        continue;
+      }
+      order.push_back(id);
+      area += static_cast<long long>(s.width + kGutter) * (s.height + kGutter);
+      widest = std::max(widest, s.width + kGutter);
+    }
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+      return sprites[static_cast<std::size_t>(a)].height >
+             sprites[static_cast<std::size_t>(b)].height;
+    });
+    int atlas_w = 64;
+    while (atlas_w < widest ||
+           static_cast<long long>(atlas_w) * atlas_w < area) {
+      atlas_w *= 2;
+    }
+
+    SpriteAtlas atlas;
+    atlas.rects.assign(sprites.size() + 1, AtlasRect{});
+    struct SkylineNode {
+      int x;
+      int y;
+      int w;
+    };
+    std::vector<SkylineNode> skyline = {{0, 0, atlas_w}};
+    int atlas_h = 0;
+    for (int id : order) {
+      const SpriteAsset& s = sprites[static_cast<std::size_t>(id)];
+      const int w = s.width + kGutter;
+      const int h = s.height + kGutter;
+      std::size_t best = skyline.size();
+      int best_y = 0;
+      for (std::size_t i = 0; i < skyline.size(); ++i) {
+        if (skyline[i].x + w > atlas_w) {
+          break;
         }
-        const SpriteTexel& t =
-            s.texels[static_cast<std::size_t>(sy * s.width + sx)];
-        if (t.a == 0) {
-          continue;
+        int y = 0;
+        int covered = 0;
+        for (std::size_t j = i; covered < w; ++j) {
+          y = std::max(y, skyline[j].y);
+          covered += skyline[j].w;
         }
-        const int tx = draw_x + xx;
-        const int ty = draw_y + yy;
-        if (tx < 0 || ty < 0 || tx >= width || ty >= height) {
-          continue;
+        if (best == skyline.size() || y < best_y) {
+          best = i;
+          best_y = y;
         }
-        Pixel& out = pixels[static_cast<std::size_t>(ty * width + tx)];
-        if (t.a == 255) {
-          out = Pixel{static_cast<int>(t.r), static_cast<int>(t.g),
-                      static_cast<int>(t.b)};
+      }
+      const int x = skyline[best].x;
+      atlas.rects[static_cast<std::size_t>(id)] = AtlasRect{x, best_y, s.width, s.height};
+      atlas_h = std::max(atlas_h, best_y + h);
+      // Raise the skyline under the new rect, trimming the nodes it covers.
+      SkylineNode raised{x, best_y + h, w};
+      std::size_t end = best;
+      while (end < skyline.size() && skyline[end].x + skyline[end].w <= x + w) {
+        ++end;
+      }
+      if (end < skyline.size() && skyline[end].x < x + w) {
+        const int cut = x + w - skyline[end].x;
+        skyline[end].x += cut;
+        skyline[end].w -= cut;
+      }
+      skyline.erase(skyline.begin() + static_cast<std::ptrdiff_t>(best),
+                    skyline.begin() + static_cast<std::ptrdiff_t>(end));
+      skyline.insert(skyline.begin() + static_cast<std::ptrdiff_t>(best), raised);
+      for (std::size_t i = 0; i + 1 < skyline.size();) {
+        if (skyline[i].y == skyline[i + 1].y) {
+          skyline[i].w += skyline[i + 1].w;
+          skyline.erase(skyline.begin() + static_cast<std::ptrdiff_t>(i) + 1);
         } else {
-          const int a = static_cast<int>(t.a);
-          out.r = (static_cast<int>(t.r) * a + out.r * (255 - a)) / 255;
-          out.g = (static_cast<int>(t.g) * a + out.g * (255 - a)) / 255;
-          out.b = (static_cast<int>(t.b) * a + out.b * (255 - a)) / 255;
+          ++i;
         }
       }
     }
+
+    SpriteAsset texture;
+    texture.width = atlas_w;
+    texture.height = std::max(1, atlas_h);
+    texture.texels.assign(static_cast<std::size_t>(texture.width) * texture.height,
+                          SpriteTexel{0, 0, 0, 0});
+    for (int id : order) {
+      const SpriteAsset& s = sprites[static_cast<std::size_t>(id)];
+      const AtlasRect& r = atlas.rects[static_cast<std::size_t>(id)];
+      for (int y = 0; y < s.height; ++y) {
+        std::copy(s.texels.begin() + static_cast<std::ptrdiff_t>(y) * s.width,
+                  s.texels.begin() + static_cast<std::ptrdiff_t>(y + 1) * s.width,
+                  texture.texels.begin() +
+                      static_cast<std::ptrdiff_t>(r.y + y) * texture.width + r.x);
+      }
+    }
+    atlas.sprite_id = AddSprite(std::move(texture));
+    atlases.push_back(std::move(atlas));
+    return static_cast<int>(atlases.size() - 1);
+  }
+
+  int AtlasSprite(int atlas_id) const {
+    return GetAtlas(atlas_id, "gfx.atlas_sprite").sprite_id;
+  }
+
+  // Draws many atlas sprites from one flat list. Each entry is `stride`
+  // ints: 3 = sprite, x, y; 5 adds w, h (<= 0 keeps the sprite size);
+  // 8 adds a tint r, g, b.
+  void DrawBatch(int atlas_id, const int* items, std::size_t count, int stride) {
+    EnsureOpen("gfx.draw_batch");
+    if (stride != 3 && stride != 5 && stride != 8) {
+      throw std::runtime_error("gfx.draw_batch expects stride 3, 5 or 8");
+    }
+    if (count % static_cast<std::size_t>(stride) != 0) {
+      throw std::runtime_error(
+          "gfx.draw_batch list length must be a multiple of the stride");
+    }
+    const SpriteAtlas& atlas = GetAtlas(atlas_id, "gfx.draw_batch");
+    const SpriteAsset& texture = sprites[static_cast<std::size_t>(atlas.sprite_id)];
+    for (std::size_t i = 0; i < count; i += static_cast<std::size_t>(stride)) {
+      const int* item = items + i;
+      const int id = item[0];
+      if (id < 0 || static_cast<std::size_t>(id) >= atlas.rects.size() ||
+          atlas.rects[static_cast<std::size_t>(id)].w == 0) {
+        throw std::runtime_error("gfx.draw_batch sprite " + std::to_string(id) +
+                                 " is not in atlas " + std::to_string(atlas_id));
+      }
+      const AtlasRect& r = atlas.rects[static_cast<std::size_t>(id)];
+      int w = r.w;
+      int h = r.h;
+      if (stride >= 5 && item[3] > 0 && item[4] > 0) {
+        w = item[3];
+        h = item[4];
+      }
+      const int tr = stride == 8 ? ClampColor(item[5]) : 255;
+      const int tg = stride == 8 ? ClampColor(item[6]) : 255;
+      const int tb = stride == 8 ? ClampColor(item[7]) : 255;
+      BlitRegion(texture, r.x, r.y, r.w, r.h, CameraX(item[1]), CameraY(item[2]),
+                 w, h, tr, tg, tb);
+    }
   }
 
   void ParticlesSpawn(int x, int y, int count, int speed, int life, int r, int g,
@@ -1506,9 +3300,9 @@ struct GraphicsState {
     if (count <= 0 || life <= 0) {
       return;
     }
-    if (count > 4000) {
-      count = 4000;
-    }
+    const std::size_t first = particles.size();
+    count = static_cast<int>(
+        std::min(static_cast<std::size_t>(count), kMaxParticles - first));
     if (speed < 1) {
       speed = 1;
     }
@@ -1518,45 +3312,100 @@ struct GraphicsState {
     std::uniform_real_distribution<double> angle_dist(
         0.0, 2.0 * 3.14159265358979323846);
     std::uniform_real_distribution<double> speed_scale(0.35, 1.0);
-    Pixel col{ClampColor(r), ClampColor(g), ClampColor(b)};
-    particles.reserve(particles.size() + static_cast<std::size_t>(count));
-    for (int i = 0; i < count; ++i) {
+    const std::uint32_t col = PackColor(r, g, b);
+    particles.resize(first + static_cast<std::size_t>(count));
+    for (std::size_t i = first; i < particles.size(); ++i) {
       const double a = angle_dist(gfx_rng);
       const double sp = static_cast<double>(speed) * speed_scale(gfx_rng) / 16.0;
-      Particle p;
-      p.x = static_cast<double>(x);
-      p.y = static_cast<double>(y);
-      p.vx = std::cos(a) * sp;
-      p.vy = std::sin(a) * sp - 0.7;
-      p.life = life;
-      p.max_life = life;
-      p.color = col;
-      particles.push_back(p);
+      particles.x[i] = static_cast<float>(x);
+      particles.y[i] = static_cast<float>(y);
+      particles.vx[i] = static_cast<float>(std::cos(a) * sp);
+      particles.vy[i] = static_cast<float>(std::sin(a) * sp - 0.7);
+      particles.life[i] = life;
+      particles.max_life[i] = life;
+      particles.color[i] = col;
     }
   }
 
+  // Integrates and compacts blocks of particles independently (in parallel
+  // on the worker pool for large counts), then closes the gaps between
+  // blocks so the store stays dense and in spawn order.
   void ParticlesUpdate() {
     EnsureOpen("gfx.particles_update");
-    constexpr double gravity = 0.09;
-    std::size_t w = 0;
-    for (std::size_t i = 0; i < particles.size(); ++i) {
-      Particle p = particles[i];
-      p.x += p.vx;
-      p.y += p.vy;
-      p.vy += gravity;
-      p.life -= 1;
-      if (p.life <= 0) {
-        continue;
-      }
-      if (p.x < -16.0 || p.y < -16.0 || p.x >= static_cast<double>(width + 16) ||
-          p.y >= static_cast<double>(height + 16)) {
-        continue;
-      }
-      particles[w++] = p;
-    }
-    particles.resize(w);
-  }
-
+    const std::size_t n = particles.size();
+    if (n == 0) {
+      return;
+    }
+    constexpr std::size_t kBlock = std::size_t{1} << 16;
+    const std::size_t blocks = (n + kBlock - 1) / kBlock;
+    particle_block_kept.assign(blocks, 0);
+    const float min_x = -16.0f;
+    const float min_y = -16.0f;
+    const float max_x = static_cast<float>(width + 16);
+    const float max_y = static_cast<float>(height + 16);
+    ParticleStore& ps = particles;
+    auto update_block = [&](int block) {
+      const std::size_t begin = static_cast<std::size_t>(block) * kBlock;
+      const std::size_t end = std::min(n, begin + kBlock);
+      float* px = ps.x.data();
+      float* py = ps.y.data();
+      float* pvx = ps.vx.data();
+      float* pvy = ps.vy.data();
+      std::int32_t* plife = ps.life.data();
+      for (std::size_t i = begin; i < end; ++i) {
+        px[i] += pvx[i];
+        py[i] += pvy[i];
+        pvy[i] += 0.09f;
+        plife[i] -= 1;
+      }
+      std::size_t w = begin;
+      for (std::size_t i = begin; i < end; ++i) {
+        const bool keep = plife[i] > 0 && px[i] >= min_x && py[i] >= min_y &&
+                          px[i] < max_x && py[i] < max_y;
+        px[w] = px[i];
+        py[w] = py[i];
+        pvx[w] = pvx[i];
+        pvy[w] = pvy[i];
+        plife[w] = plife[i];
+        ps.max_life[w] = ps.max_life[i];
+        ps.color[w] = ps.color[i];
+        w += keep ? 1 : 0;
+      }
+      particle_block_kept[static_cast<std::size_t>(block)] = w - begin;
+    };
+    if (blocks > 1) {
+      Workers().Run(static_cast<int>(blocks), update_block);
+    } else {
+      update_block(0);
+    }
+    std::size_t kept = particle_block_kept[0];
+    for (std::size_t block = 1; block < blocks; ++block) {
+      const std::size_t from = block * kBlock;
+      const std::size_t count = particle_block_kept[block];
+      if (from != kept) {
+        auto move = [&](auto& column) {
+          std::copy(column.begin() + static_cast<std::ptrdiff_t>(from),
+                    column.begin() + static_cast<std::ptrdiff_t>(from + count),
+                    column.begin() + static_cast<std::ptrdiff_t>(kept));
+        };
+        move(ps.x);
+        move(ps.y);
+        move(ps.vx);
+        move(ps.vy);
+        move(ps.life);
+        move(ps.max_life);
+        move(ps.color);
+      }
+      kept += count;
+    }
+    particles.resize(kept);
+  }
+
+  // Splats every particle with a precomputed disc stamp (the Circle shape),
+  // faded by remaining life. Large counts draw horizontal bands in
+  // parallel. One pass over the store bins particle indices by the bands
+  // they touch, in spawn order, so each band walks only its own particles
+  // and overlaps resolve exactly as in a serial draw.
   void ParticlesDraw(int size) {
     EnsureOpen("gfx.particles_draw");
     if (size < 1) {
@@ -1566,21 +3415,111 @@ struct GraphicsState {
       size = 12;
     }
     const int half = size / 2;
-    for (const Particle& p : particles) {
-      const int alpha =
-          std::max(0, std::min(255, (255 * p.life) / std::max(1, p.max_life)));
-      const int rr = (p.color.r * alpha) / 255;
-      const int gg = (p.color.g * alpha) / 255;
-      const int bb = (p.color.b * alpha) / 255;
-      if (size == 1) {
-        SetPixelRaw(static_cast<int>(std::round(p.x)),
-                    static_cast<int>(std::round(p.y)),
-                    Pixel{ClampColor(rr), ClampColor(gg), ClampColor(bb)});
-      } else {
-        Circle(static_cast<int>(std::round(p.x)),
-               static_cast<int>(std::round(p.y)), half, rr, gg, bb);
+    particle_stamp.clear();
+    if (size == 1) {
+      particle_stamp.push_back(SplatRow{0, 0, 1});
+    } else {
+      for (int dy = -half; dy <= half; ++dy) {
+        const int m = ISqrt(half * half - dy * dy);
+        particle_stamp.push_back(SplatRow{dy, -m, m + 1});
       }
     }
+    const std::size_t n = particles.size();
+    const ParticleStore& ps = particles;
+    auto round_px = [](float f) {
+      return static_cast<int>(f + (f < 0.0f ? -0.5f : 0.5f));
+    };
+    // Screen position of particle i, or false when its splat is off screen.
+    auto place = [&](std::size_t i, int& px, int& py) {
+      py = round_px(ps.y[i]);
+      px = round_px(ps.x[i]);
+      return py + half >= 0 && py - half < height && px + half >= 0 &&
+             px - half < width;
+    };
+    auto splat = [&](std::size_t i, int px, int py, int band_y0, int band_y1) {
+      const int alpha = std::max(
+          0, std::min(255, (255 * ps.life[i]) / std::max(1, ps.max_life[i])));
+      const Pixel c = UnpackPixel(ps.color[i]);
+      const std::uint32_t color = PackPixel(
+          (c.r * alpha) / 255, (c.g * alpha) / 255, (c.b * alpha) / 255);
+      for (const SplatRow& row : particle_stamp) {
+        const int y = py + row.dy;
+        if (y < band_y0 || y >= band_y1) {
+          continue;
+        }
+        const int x0 = std::max(0, px + row.x0);
+        const int x1 = std::min(width, px + row.x1);
+        if (x0 >= x1) {
+          continue;
+        }
+        std::uint32_t* out = pixels.data() + static_cast<std::size_t>(y) * width;
+        std::fill(out + x0, out + x1, color);
+      }
+    };
+    WorkerPool& pool = Workers();
+    if (n < 65536 || pool.Size() == 1) {
+      for (std::size_t i = 0; i < n; ++i) {
+        int px = 0;
+        int py = 0;
+        if (place(i, px, py)) {
+          splat(i, px, py, 0, height);
+        }
+      }
+      return;
+    }
+    // Bands at least one splat tall, so a particle lands in at most two.
+    const int bands = std::max(1, std::min(pool.Size() * 4, height / size));
+    particle_row_band.resize(static_cast<std::size_t>(height));
+    for (int band = 0; band < bands; ++band) {
+      std::fill(particle_row_band.begin() + (height * band) / bands,
+                particle_row_band.begin() + (height * (band + 1)) / bands, band);
+    }
+    // Each block of the store appends its on-screen particles to its own
+    // list per band, so a band reads its lists block by block in spawn
+    // order. The lists keep their capacity between draws.
+    constexpr std::size_t kBlock = std::size_t{1} << 16;
+    const std::size_t blocks = (n + kBlock - 1) / kBlock;
+    const std::size_t nb = static_cast<std::size_t>(bands);
+    if (particle_bins.size() < blocks * nb) {
+      particle_bins.resize(blocks * nb);
+    }
+    pool.Run(static_cast<int>(blocks), [&](int block) {
+      const std::size_t begin = static_cast<std::size_t>(block) * kBlock;
+      const std::size_t end = std::min(n, begin + kBlock);
+      std::vector<std::uint32_t>* bins =
+          particle_bins.data() + static_cast<std::size_t>(block) * nb;
+      for (std::size_t b = 0; b < nb; ++b) {
+        bins[b].clear();
+      }
+      for (std::size_t i = begin; i < end; ++i) {
+        int px = 0;
+        int py = 0;
+        if (!place(i, px, py)) {
+          continue;
+        }
+        const int b0 = particle_row_band[static_cast<std::size_t>(
+            std::max(0, py - half))];
+        const int b1 = particle_row_band[static_cast<std::size_t>(
+            std::min(height - 1, py + half))];
+        bins[b0].push_back(static_cast<std::uint32_t>(i));
+        if (b1 != b0) {
+          bins[b1].push_back(static_cast<std::uint32_t>(i));
+        }
+      }
+    });
+    pool.Run(bands, [&](int band) {
+      const int band_y0 = (height * band) / bands;
+      const int band_y1 = (height * (band + 1)) / bands;
+      for (std::size_t block = 0; block < blocks; ++block) {
+        const std::size_t bin = block * nb + static_cast<std::size_t>(band);
+        for (std::uint32_t i : particle_bins[bin]) {
+          int px = 0;
+          int py = 0;
+          place(i, px, py);
+          splat(i, px, py, band_y0, band_y1);
+        }
+      }
+    });
   }
 
   void ParticlesClear() { particles.clear(); }
@@ -1626,9 +3565,23 @@ struct GraphicsState {
     const int tb = ClampColor(tint_b);
     const int draw_x = CameraX(x);
     const int draw_y = CameraY(y);
+    const int xx0 = std::max(0, -draw_x);
+    const int xx1 = std::min(tw, width - draw_x);
+    if (xx0 >= xx1) {
+      return;
+    }
 
-    for (int yy = 0; yy < th; ++yy) {
-      for (int xx = 0; xx < tw; ++xx) {
+    // Each destination row samples the sprite along a rotated line; texels
+    // outside the sprite become transparent so the blend leaves them alone.
+    // Shrunk sprites sample the matching mip level.
+    int level = 0;
+    while (level + 1 < s.LevelCount() && (scale << (level + 1)) <= 1000) {
+      ++level;
+    }
+    const SpriteLevel tex = s.Level(level);
+    span_scratch.resize(static_cast<std::size_t>(xx1 - xx0));
+    for (int yy = std::max(0, -draw_y); yy < th && draw_y + yy < height; ++yy) {
+      for (int xx = xx0; xx < xx1; ++xx) {
         const double dx = static_cast<double>(xx) - hw;
         const double dy = static_cast<double>(yy) - hh;
         const double src_dx = (dx * c + dy * si) * (1000.0 / scale);
@@ -1637,32 +3590,14 @@ struct GraphicsState {
         const double src_yf = sy_half + src_dy;
         const int sx = static_cast<int>(std::floor(src_xf));
         const int sy = static_cast<int>(std::floor(src_yf));
-        if (sx < 0 || sy < 0 || sx >= s.width || sy >= s.height) {
-          continue;
-        }
-        const SpriteTexel& t =
-            s.texels[static_cast<std::size_t>(sy * s.width + sx)];
-        if (t.a == 0) {
-          continue;
-        }
-        const int tx = draw_x + xx;
-        const int ty = draw_y + yy;
-        if (tx < 0 || ty < 0 || tx >= width || ty >= height) {
-          continue;
-        }
-        const int rr = (static_cast<int>(t.r) * tr) / 255;
-        const int gg = (static_cast<int>(t.g) * tg) / 255;
-        const int bb = (static_cast<int>(t.b) * tb) / 255;
-        Pixel& out = pixels[static_cast<std::size_t>(ty * width + tx)];
-        if (t.a == 255) {
-          out = Pixel{rr, gg, bb};
-        } else {
-          const int a = static_cast<int>(t.a);
-          out.r = (rr * a + out.r * (255 - a)) / 255;
-          out.g = (gg * a + out.g * (255 - a)) / 255;
-          out.b = (bb * a + out.b * (255 - a)) / 255;
-        }
+        span_scratch[static_cast<std::size_t>(xx - xx0)] =
+            (sx < 0 || sy < 0 || sx >= s.width || sy >= s.height)
+                ? SpriteTexel{0, 0, 0, 0}
+                : tex.texels[static_cast<std::size_t>((sy >> level) * tex.width +
+                                                      (sx >> level))];
       }
+      BlendRow(draw_x + xx0, draw_y + yy, span_scratch.data(), xx1 - xx0, tr,
+               tg, tb);
     }
   }
 
@@ -1722,6 +3657,8 @@ struct GraphicsState {
     shader_p2 = p2;
     shader_p3 = p3;
     shader_program_active = -1;
+    single_shader.ops.assign(1, ShaderOp{mode, p1, p2, p3});
+    CompileShader(single_shader);
   }
 
   void ShaderClear() {
@@ -1744,31 +3681,378 @@ struct GraphicsState {
       throw std::runtime_error("gfx.shader_program_clear invalid program id");
     }
     shader_programs[static_cast<std::size_t>(program_id)].ops.clear();
+    shader_programs[static_cast<std::size_t>(program_id)].compiled = false;
+  }
+
+  void ShaderAdd(int program_id, int mode, int p1, int p2, int p3) {
+    if (program_id < 0 ||
+        static_cast<std::size_t>(program_id) >= shader_programs.size()) {
+      throw std::runtime_error("gfx.shader_add invalid program id");
+    }
+    if (mode <= 0) {
+      throw std::runtime_error("gfx.shader_add expects mode > 0");
+    }
+    ShaderOp op;
+    op.mode = mode;
+    op.p1 = p1;
+    op.p2 = p2;
+    op.p3 = p3;
+    shader_programs[static_cast<std::size_t>(program_id)].ops.push_back(op);
+    shader_programs[static_cast<std::size_t>(program_id)].compiled = false;
+  }
+
+  int ShaderProgramLen(int program_id) const {
+    if (program_id < 0 ||
+        static_cast<std::size_t>(program_id) >= shader_programs.size()) {
+      throw std::runtime_error("gfx.shader_program_len invalid program id");
+    }
+    return static_cast<int>(
+        shader_programs[static_cast<std::size_t>(program_id)].ops.size());
+  }
+
+  // Fills rgba_buffer with the frame to show. Without a shader this is one
+  // copy, since the framebuffer is already in the packed present layout.
+  // Shaders read only the framebuffer and write only rgba_buffer, so row
+  // bands can be shaded in parallel, neighborhood modes included.
+  void BuildPresentBuffer() {
+    const ShaderProgram* shader = ActiveShader();
+    if (shader == nullptr) {
+      std::copy(pixels.begin(), pixels.end(), rgba_buffer.begin());
+      return;
+    }
+    PrepareBlurPasses(shader->ops);
+
+    constexpr int kBandRows = 16;
+    const int bands = (height + kBandRows - 1) / kBandRows;
+    Workers().Run(bands, [&](int band) {
+      const int y_end = std::min(height, (band + 1) * kBandRows);
+      for (int y = band * kBandRows; y < y_end; ++y) {
+        ShadeRow(y, *shader);
+      }
+    });
+  }
+
+  const ShaderProgram* ActiveShader() {
+    if (shader_program_active >= 0 &&
+        static_cast<std::size_t>(shader_program_active) < shader_programs.size()) {
+      ShaderProgram& program =
+          shader_programs[static_cast<std::size_t>(shader_program_active)];
+      if (program.ops.empty()) {
+        return nullptr;
+      }
+      // Ops added after gfx.shader_use_program are picked up here.
+      if (!program.compiled) {
+        CompileShader(program);
+      }
+      return &program;
+    }
+    if (shader_mode == 0) {
+      return nullptr;
+    }
+    return &single_shader;
+  }
+
+  // Shades one row in place in rgba_buffer, one stage at a time across the
+  // whole row so each stage runs as its own tight loop.
+  void ShadeRow(int y, const ShaderProgram& shader) {
+    std::uint32_t* out = rgba_buffer.data() + static_cast<std::size_t>(y) * width;
+    const std::uint32_t* src = pixels.data() + static_cast<std::size_t>(y) * width;
+    std::copy(src, src + width, out);
+    for (const ShaderStage& stage : shader.stages) {
+      if (stage.kind == ShaderStage::Kind::kChannelLut) {
+        const std::size_t row_variant = static_cast<std::size_t>(
+            ((present_frame & stage.frame_mask) * (stage.y_mask + 1) +
+             (y & stage.y_mask)) *
+            (stage.x_mask + 1));
+        const std::array<std::uint8_t, 256>* luts = stage.luts.data() + row_variant;
+        for (int x = 0; x < width; ++x) {
+          const std::uint8_t* lut = luts[x & stage.x_mask].data();
+          const std::uint32_t v = out[x];
+          out[x] = kPixelAlpha |
+                   (static_cast<std::uint32_t>(lut[(v >> 16) & 0xFFu]) << 16) |
+                   (static_cast<std::uint32_t>(lut[(v >> 8) & 0xFFu]) << 8) |
+                   static_cast<std::uint32_t>(lut[v & 0xFFu]);
+        }
+      } else if (stage.kind == ShaderStage::Kind::kGrayMix) {
+        for (int x = 0; x < width; ++x) {
+          const Pixel p = UnpackPixel(out[x]);
+          const int gray = stage.gray[static_cast<std::size_t>(ShaderLuma(p))];
+          out[x] = PackPixel((stage.keep[static_cast<std::size_t>(p.r)] + gray) / 1000,
+                             (stage.keep[static_cast<std::size_t>(p.g)] + gray) / 1000,
+                             (stage.keep[static_cast<std::size_t>(p.b)] + gray) / 1000);
+        }
+      } else if (stage.kind == ShaderStage::Kind::kThreshold) {
+        const std::uint8_t* lut = stage.luts[0].data();
+        for (int x = 0; x < width; ++x) {
+          const int level = lut[ShaderLuma(UnpackPixel(out[x]))];
+          out[x] = PackPixel(level, level, level);
+        }
+      } else {
+        const ShaderOp& op = shader.ops[stage.op_index];
+        const BlurPass* blur = &shader_blur_passes[stage.op_index];
+        for (int x = 0; x < width; ++x) {
+          const Pixel p = ApplyShaderOp(op.mode, op.p1, op.p2, op.p3, x, y,
+                                        UnpackPixel(out[x]), blur);
+          out[x] = PackPixel(p.r, p.g, p.b);
+        }
+      }
+    }
+  }
+
+  static int ShaderLuma(const Pixel& p) {
+    return (p.r * 30 + p.g * 59 + p.b * 11) / 100;
+  }
+
+  static bool IsChannelShaderMode(int mode) {
+    return mode == 2 || mode == 4 || mode == 5 || mode == 12;
+  }
+
+  // Curve of a per-channel op for one channel value. Only the parity of
+  // y + frame (scanline) and x & 3, y & 3 (dither) affect the result.
+  static int ShadeChannel(const ShaderOp& op, int c, int x, int y, int frame) {
+    if (op.mode == 2) {
+      // Scanline: p1 darken 0..255 on every other row.
+      const int dark = std::max(0, std::min(255, op.p1));
+      if (((y + frame) & 1) != 0) {
+        c = (c * (255 - dark)) / 255;
+      }
+    } else if (op.mode == 4) {
+      // Invert: p1 mix 0..1000.
+      const int mix = std::max(0, std::min(1000, op.p1));
+      c = (c * (1000 - mix) + (255 - c) * mix) / 1000;
+    } else if (op.mode == 5) {
+      // Posterize: p1 levels 2..64.
+      const int levels = std::max(2, std::min(64, op.p1));
+      const int step = std::max(1, 255 / (levels - 1));
+      c = ((c + step / 2) / step) * step;
+    } else if (op.mode == 12) {
+      // Bayer-style dither quantization: p1 strength 0..255, p2 levels 2..32.
+      const int strength = std::max(0, std::min(255, op.p1));
+      const int levels = std::max(2, std::min(32, op.p2));
+      static const int bayer4[4][4] = {
+          {0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+      const int bias = ((bayer4[y & 3][x & 3] - 7) * strength) / 16;
+      const int v = ClampColor(c + bias);
+      const int step = std::max(1, 255 / (levels - 1));
+      c = ((v + step / 2) / step) * step;
+    }
+    return ClampColor(c);
+  }
+
+  // Bakes a program's op list into stages; params are clamped here once.
+  static void CompileShader(ShaderProgram& program) {
+    program.stages.clear();
+    const std::vector<ShaderOp>& ops = program.ops;
+    std::size_t i = 0;
+    while (i < ops.size()) {
+      const ShaderOp& op = ops[i];
+      ShaderStage stage;
+      stage.op_index = i;
+      if (IsChannelShaderMode(op.mode)) {
+        std::size_t end = i;
+        while (end < ops.size() && IsChannelShaderMode(ops[end].mode)) {
+          if (ops[end].mode == 2) {
+            stage.y_mask |= 1;
+            stage.frame_mask = 1;
+          } else if (ops[end].mode == 12) {
+            stage.x_mask = 3;
+            stage.y_mask = 3;
+          }
+          ++end;
+        }
+        stage.kind = ShaderStage::Kind::kChannelLut;
+        stage.luts.resize(static_cast<std::size_t>(
+            (stage.frame_mask + 1) * (stage.y_mask + 1) * (stage.x_mask + 1)));
+        std::size_t variant = 0;
+        for (int frame = 0; frame <= stage.frame_mask; ++frame) {
+          for (int y = 0; y <= stage.y_mask; ++y) {
+            for (int x = 0; x <= stage.x_mask; ++x) {
+              std::array<std::uint8_t, 256>& lut = stage.luts[variant++];
+              for (int c = 0; c < 256; ++c) {
+                int v = c;
+                for (std::size_t k = i; k < end; ++k) {
+                  v = ShadeChannel(ops[k], v, x, y, frame);
+                }
+                lut[static_cast<std::size_t>(c)] = static_cast<std::uint8_t>(v);
+              }
+            }
+          }
+        }
+        i = end;
+      } else if (op.mode == 1) {
+        // Grayscale: p1 mix 0..1000.
+        const int mix = std::max(0, std::min(1000, op.p1));
+        stage.kind = ShaderStage::Kind::kGrayMix;
+        for (int v = 0; v < 256; ++v) {
+          stage.keep[static_cast<std::size_t>(v)] = v * (1000 - mix);
+          stage.gray[static_cast<std::size_t>(v)] = v * mix;
+        }
+        ++i;
+      } else if (op.mode == 10) {
+        // Threshold/duotone: p1 threshold 0..255, p2 high level, p3 low level.
+        const int threshold = std::max(0, std::min(255, op.p1));
+        const int hi = std::max(0, std::min(255, op.p2));
+        const int lo = std::max(0, std::min(255, op.p3));
+        stage.kind = ShaderStage::Kind::kThreshold;
+        stage.luts.resize(1);
+        for (int lum = 0; lum < 256; ++lum) {
+          stage.luts[0][static_cast<std::size_t>(lum)] =
+              static_cast<std::uint8_t>(lum >= threshold ? hi : lo);
+        }
+        ++i;
+      } else {
+        stage.kind = ShaderStage::Kind::kOp;
+        ++i;
+      }
+      program.stages.push_back(std::move(stage));
+    }
+    program.compiled = true;
+  }
+
+  void PrepareBlurPasses(const std::vector<ShaderOp>& ops) {
+    shader_blur_passes.resize(ops.size());
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+      const ShaderOp& op = ops[i];
+      if (op.mode == 14) {
+        BuildBlurPass(shader_blur_passes[i], std::max(0, std::min(255, op.p1)),
+                      std::max(1, std::min(64, op.p2)));
+      } else if (op.mode == 15) {
+        BuildBlurPass(shader_blur_passes[i], 0, std::max(1, std::min(64, op.p1)));
+      }
+    }
+  }
+
+  // Threshold + 2x2 downsample, then two box passes per axis (a tent
+  // filter) at half resolution: O(1) per pixel and pass for any radius.
+  void BuildBlurPass(BlurPass& pass, int threshold, int radius) {
+    const int hw = (width + 1) / 2;
+    const int hh = (height + 1) / 2;
+    pass.width = hw;
+    pass.height = hh;
+    pass.rgbw.assign(static_cast<std::size_t>(hw) * hh * 4, 0.0f);
+    blur_scratch.resize(pass.rgbw.size());
+    WorkerPool& pool = Workers();
+    pool.Run(hh, [&](int y2) {
+      float* row = pass.rgbw.data() + static_cast<std::size_t>(y2) * hw * 4;
+      for (int sy = y2 * 2; sy < std::min(height, y2 * 2 + 2); ++sy) {
+        const std::uint32_t* src = pixels.data() + static_cast<std::size_t>(sy) * width;
+        for (int sx = 0; sx < width; ++sx) {
+          const Pixel p = UnpackPixel(src[sx]);
+          if ((p.r * 30 + p.g * 59 + p.b * 11) / 100 < threshold) {
+            continue;
+          }
+          float* cell = row + (sx / 2) * 4;
+          cell[0] += static_cast<float>(p.r);
+          cell[1] += static_cast<float>(p.g);
+          cell[2] += static_cast<float>(p.b);
+          cell[3] += 1.0f;
+        }
+      }
+    });
+
+    const int r2 = std::max(1, (radius + 1) / 2);
+    float* a = pass.rgbw.data();
+    float* b = blur_scratch.data();
+    const std::size_t row_stride = static_cast<std::size_t>(hw) * 4;
+    for (int round = 0; round < 2; ++round) {
+      pool.Run(hh, [&](int y2) {
+        BoxBlurLine(a + y2 * row_stride, b + y2 * row_stride, hw, 4, r2);
+      });
+      std::swap(a, b);
+    }
+    constexpr int kColumnsPerTask = 16;
+    const int column_tasks = (hw + kColumnsPerTask - 1) / kColumnsPerTask;
+    for (int round = 0; round < 2; ++round) {
+      pool.Run(column_tasks, [&](int task) {
+        const int x_end = std::min(hw, (task + 1) * kColumnsPerTask);
+        for (int x2 = task * kColumnsPerTask; x2 < x_end; ++x2) {
+          BoxBlurLine(a + x2 * 4, b + x2 * 4, hh, row_stride, r2);
+        }
+      });
+      std::swap(a, b);
+    }
+    // Four passes leave the result back in pass.rgbw.
+  }
+
+  // Sliding-window box blur of one row or column of rgbw cells, clamped at
+  // the edges like ReadPixelShaderSource. `stride` is in floats.
+  static void BoxBlurLine(const float* src, float* dst, int n, std::size_t stride,
+                          int radius) {
+    auto cell = [&](int i) {
+      return src + static_cast<std::size_t>(std::max(0, std::min(n - 1, i))) * stride;
+    };
+    const double inv = 1.0 / static_cast<double>(2 * radius + 1);
+    double acc[4] = {0.0, 0.0, 0.0, 0.0};
+    for (int k = -radius; k <= radius; ++k) {
+      for (int c = 0; c < 4; ++c) {
+        acc[c] += cell(k)[c];
+      }
+    }
+    for (int i = 0; i < n; ++i) {
+      float* out = dst + static_cast<std::size_t>(i) * stride;
+      const float* leaving = cell(i - radius);
+      const float* entering = cell(i + radius + 1);
+      for (int c = 0; c < 4; ++c) {
+        out[c] = static_cast<float>(acc[c] * inv);
+        acc[c] += entering[c] - leaving[c];
+      }
+    }
   }
 
-  void ShaderAdd(int program_id, int mode, int p1, int p2, int p3) {
-    if (program_id < 0 ||
-        static_cast<std::size_t>(program_id) >= shader_programs.size()) {
-      throw std::runtime_error("gfx.shader_add invalid program id");
+  // Bilinear lookup of the half-resolution pass at full-resolution pixel
+  // (x, y). Returns false where no pixel passed the threshold.
+  static bool SampleBlurPass(const BlurPass& pass, int x, int y, Pixel& out) {
+    if (pass.rgbw.empty()) {
+      return false;
     }
-    if (mode <= 0) {
-      throw std::runtime_error("gfx.shader_add expects mode > 0");
+    const double fx = std::max(0.0, (static_cast<double>(x) + 0.5) * 0.5 - 0.5);
+    const double fy = std::max(0.0, (static_cast<double>(y) + 0.5) * 0.5 - 0.5);
+    const int x0 = std::min(pass.width - 1, static_cast<int>(fx));
+    const int y0 = std::min(pass.height - 1, static_cast<int>(fy));
+    const int x1 = std::min(pass.width - 1, x0 + 1);
+    const int y1 = std::min(pass.height - 1, y0 + 1);
+    const double tx = fx - x0;
+    const double ty = fy - y0;
+    double v[4] = {0.0, 0.0, 0.0, 0.0};
+    const int xs[2] = {x0, x1};
+    const int ys[2] = {y0, y1};
+    for (int j = 0; j < 2; ++j) {
+      for (int i = 0; i < 2; ++i) {
+        const double w = (i == 0 ? 1.0 - tx : tx) * (j == 0 ? 1.0 - ty : ty);
+        const float* c =
+            pass.rgbw.data() +
+            (static_cast<std::size_t>(ys[j]) * pass.width + xs[i]) * 4;
+        for (int k = 0; k < 4; ++k) {
+          v[k] += c[k] * w;
+        }
+      }
     }
-    ShaderOp op;
-    op.mode = mode;
-    op.p1 = p1;
-    op.p2 = p2;
-    op.p3 = p3;
-    shader_programs[static_cast<std::size_t>(program_id)].ops.push_back(op);
+    // Float residue from the sliding windows must not count as weight.
+    if (v[3] < 1e-6) {
+      return false;
+    }
+    out = Pixel{ClampColor(static_cast<int>(v[0] / v[3])),
+                ClampColor(static_cast<int>(v[1] / v[3])),
+                ClampColor(static_cast<int>(v[2] / v[3]))};
+    return true;
   }
 
-  int ShaderProgramLen(int program_id) const {
-    if (program_id < 0 ||
-        static_cast<std::size_t>(program_id) >= shader_programs.size()) {
-      throw std::runtime_error("gfx.shader_program_len invalid program id");
+  WorkerPool& Workers() {
+    const int want = shader_threads > 0
+                         ? shader_threads
+                         : std::min(8, WorkerPool::HardwareThreads());
+    if (!workers || workers->Size() != want) {
+      workers = std::make_unique<WorkerPool>(want);
     }
-    return static_cast<int>(
-        shader_programs[static_cast<std::size_t>(program_id)].ops.size());
+    return *workers;
+  }
+
+  int SetThreads(int n) {
+    if (n < 0 || n > 64) {
+      throw std::runtime_error("gfx.threads expects 0 (auto) or 1..64");
+    }
+    shader_threads = n;
+    return Workers().Size();
   }
 
   void ShaderUseProgram(int program_id) {
@@ -1778,6 +4062,7 @@ struct GraphicsState {
     }
     shader_program_active = program_id;
     shader_mode = 0;
+    CompileShader(shader_programs[static_cast<std::size_t>(program_id)]);
   }
 
   int AnimRegister(int first_sprite, int frame_count, int frame_ticks,
@@ -1851,7 +4136,7 @@ struct GraphicsState {
 
   void Text(int x, int y, const std::string& text, int r, int g, int b) {
     EnsureOpen("gfx.text");
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
+    const std::uint32_t color = PackColor(r, g, b);
     int cx = x;
     int cy = y;
     for (char raw : text) {
@@ -1871,7 +4156,7 @@ struct GraphicsState {
     if (scale <= 0) {
       return;
     }
-    Pixel color{ClampColor(r), ClampColor(g), ClampColor(b)};
+    const std::uint32_t color = PackColor(r, g, b);
     int cx = x;
     int cy = y;
     for (char raw : text) {
@@ -1975,7 +4260,12 @@ struct GraphicsState {
     return (hover && mouse_left_down && !mouse_left_prev) ? 1 : 0;
   }
 
-  const SpriteAsset& GetSpriteAsset(int sprite_id, const std::string& fn) const {
+  // Takes a C string so per-triangle lookups do not build a std::string;
+  // only the error path does.
+  const SpriteAsset& GetSpriteAsset(int sprite_id, const char* fn) const {
+    if (sprite_id >= 0 && static_cast<std::size_t>(sprite_id) < sprites.size()) {
+      return sprites[static_cast<std::size_t>(sprite_id)];
+    }
     return GetSprite(sprite_id, fn);
   }
 
@@ -1992,7 +4282,46 @@ struct GraphicsState {
 
   static int ClampColor(int v) { return std::max(0, std::min(255, v)); }
 
-  void SetPixelRaw(int x, int y, const Pixel& pixel) {
+  static std::uint32_t PackColor(int r, int g, int b) {
+    return PackPixel(ClampColor(r), ClampColor(g), ClampColor(b));
+  }
+
+  static int ISqrt(int v) {
+    int m = static_cast<int>(std::sqrt(static_cast<double>(v)));
+    while (m > 0 && m * m > v) {
+      --m;
+    }
+    while ((m + 1) * (m + 1) <= v) {
+      ++m;
+    }
+    return m;
+  }
+
+  // Fills [x0, x1) of row y, clipped to the framebuffer.
+  void FillRowClipped(int y, int x0, int x1, std::uint32_t color) {
+    if (y < 0 || y >= height) {
+      return;
+    }
+    x0 = std::max(0, x0);
+    x1 = std::min(width, x1);
+    if (x0 >= x1) {
+      return;
+    }
+    ActiveSpanKernels().fill(
+        pixels.data() + static_cast<std::size_t>(y) * width + x0, x1 - x0,
+        color);
+  }
+
+  // Tints and alpha-blends n texels into row y starting at x; the caller has
+  // already clipped the run to the framebuffer.
+  void BlendRow(int x, int y, const SpriteTexel* src, int n, int tint_r,
+                int tint_g, int tint_b) {
+    ActiveSpanKernels().blend(
+        pixels.data() + static_cast<std::size_t>(y) * width + x,
+        reinterpret_cast<const std::uint8_t*>(src), n, tint_r, tint_g, tint_b);
+  }
+
+  void SetPixelRaw(int x, int y, std::uint32_t pixel) {
     if (x < 0 || y < 0 || x >= width || y >= height) {
       return;
     }
@@ -2007,84 +4336,466 @@ struct GraphicsState {
     return sprites[static_cast<std::size_t>(sprite_id)];
   }
 
-  static bool TryLoadP3Ppm(const std::string& path, SpriteAsset& out) {
-    std::ifstream in(path);
+  // Portable sprite decoders. The file is read with one bulk read and each
+  // format decodes straight into texels. Decode* returns false when the
+  // data is not its format and throws when it is but is malformed.
+  static bool ReadFileBytes(const std::string& path, std::vector<std::uint8_t>& out) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
     if (!in) {
       return false;
     }
+    const std::streamsize size = in.tellg();
+    if (size < 0) {
+      return false;
+    }
+    out.resize(static_cast<std::size_t>(size));
+    in.seekg(0);
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(out.data()), size));
+  }
 
-    auto next_token = [&in]() -> std::optional<std::string> {
-      std::string tok;
-      while (in >> tok) {
-        if (!tok.empty() && tok[0] == '#') {
-          std::string rest;
-          std::getline(in, rest);
-          continue;
+  static bool DecodeSprite(const std::vector<std::uint8_t>& data,
+                           const std::string& path, SpriteAsset& out) {
+    if (DecodePnm(data, path, out) || DecodeQoi(data, path, out) ||
+        DecodeBmp(data, path, out)) {
+      return true;
+    }
+    // TGA has no magic number, so only trust the extension.
+    std::string ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return ext == ".tga" && DecodeTga(data, path, out);
+  }
+
+  static void SizeSprite(SpriteAsset& out, long long w, long long h,
+                         const std::string& path) {
+    if (w <= 0 || h <= 0 || w > 32768 || h > 32768) {
+      throw std::runtime_error("gfx.load_sprite invalid image size: " + path);
+    }
+    out.width = static_cast<int>(w);
+    out.height = static_cast<int>(h);
+    out.texels.assign(static_cast<std::size_t>(w * h), SpriteTexel{});
+  }
+
+  static std::uint32_t ReadLe(const std::uint8_t* p, int bytes) {
+    std::uint32_t v = 0;
+    for (int i = bytes - 1; i >= 0; --i) {
+      v = (v << 8) | p[i];
+    }
+    return v;
+  }
+
+  static std::uint32_t ReadBe32(const std::uint8_t* p) {
+    return (static_cast<std::uint32_t>(p[0]) << 24) |
+           (static_cast<std::uint32_t>(p[1]) << 16) |
+           (static_cast<std::uint32_t>(p[2]) << 8) | p[3];
+  }
+
+  // Netpbm: ASCII P3, binary P6 (8 or 16 bit) and P7 PAM with RGB,
+  // RGB_ALPHA, GRAYSCALE or GRAYSCALE_ALPHA tuples.
+  static bool DecodePnm(const std::vector<std::uint8_t>& data,
+                        const std::string& path, SpriteAsset& out) {
+    if (data.size() < 2 || data[0] != 'P' ||
+        (data[1] != '3' && data[1] != '6' && data[1] != '7')) {
+      return false;
+    }
+    const char kind = static_cast<char>(data[1]);
+    const std::string bad = "gfx.load_sprite malformed PNM image: " + path;
+    std::size_t pos = 2;
+    auto skip_space = [&]() {
+      while (pos < data.size()) {
+        if (data[pos] == '#') {
+          while (pos < data.size() && data[pos] != '\n') {
+            ++pos;
+          }
+        } else if (std::isspace(data[pos]) != 0) {
+          ++pos;
+        } else {
+          break;
         }
-        return tok;
       }
-      return std::nullopt;
+    };
+    auto read_word = [&]() {
+      skip_space();
+      const std::size_t begin = pos;
+      while (pos < data.size() && std::isspace(data[pos]) == 0) {
+        ++pos;
+      }
+      return std::string(reinterpret_cast<const char*>(data.data()) + begin, pos - begin);
+    };
+    auto read_int = [&]() -> long long {
+      skip_space();
+      long long v = 0;
+      int digits = 0;
+      while (pos < data.size() && data[pos] >= '0' && data[pos] <= '9' && digits < 10) {
+        v = v * 10 + (data[pos] - '0');
+        ++pos;
+        ++digits;
+      }
+      if (digits == 0) {
+        throw std::runtime_error(bad);
+      }
+      return v;
     };
 
-    auto magic = next_token();
-    if (!magic.has_value() || magic.value() != "P3") {
-      return false;
+    long long w = 0;
+    long long h = 0;
+    long long maxv = 255;
+    int depth = 3;
+    if (kind == '7') {
+      std::string tuple;
+      while (true) {
+        const std::string key = read_word();
+        if (key.empty()) {
+          throw std::runtime_error(bad);
+        }
+        if (key == "ENDHDR") {
+          break;
+        }
+        if (key == "WIDTH") {
+          w = read_int();
+        } else if (key == "HEIGHT") {
+          h = read_int();
+        } else if (key == "DEPTH") {
+          depth = static_cast<int>(read_int());
+        } else if (key == "MAXVAL") {
+          maxv = read_int();
+        } else if (key == "TUPLTYPE") {
+          tuple = read_word();
+        }
+      }
+      if (depth < 1 || depth > 4) {
+        throw std::runtime_error("gfx.load_sprite unsupported PAM depth: " + path);
+      }
+      (void)tuple;  // DEPTH alone decides: 1 gray, 2 gray+alpha, 3 rgb, 4 rgba
+    } else {
+      w = read_int();
+      h = read_int();
+      maxv = read_int();
+    }
+    if (maxv <= 0 || maxv > 65535) {
+      throw std::runtime_error(bad);
+    }
+    SizeSprite(out, w, h, path);
+    const std::size_t count = out.texels.size();
+    auto scale = [maxv](long long v) {
+      return static_cast<std::uint8_t>(std::min(maxv, v) * 255 / maxv);
+    };
+
+    if (kind == '3') {
+      for (std::size_t i = 0; i < count; ++i) {
+        SpriteTexel& t = out.texels[i];
+        t.r = scale(read_int());
+        t.g = scale(read_int());
+        t.b = scale(read_int());
+      }
+      return true;
+    }
+
+    ++pos;  // the single whitespace byte that ends the header
+    const std::size_t sample_bytes = maxv > 255 ? 2 : 1;
+    const std::size_t stride = sample_bytes * static_cast<std::size_t>(depth);
+    if (pos > data.size() || data.size() - pos < count * stride) {
+      throw std::runtime_error("gfx.load_sprite truncated PNM image: " + path);
+    }
+    const std::uint8_t* src = data.data() + pos;
+    if (sample_bytes == 1 && maxv == 255 && depth == 3) {
+      for (std::size_t i = 0; i < count; ++i, src += 3) {
+        out.texels[i] = SpriteTexel{src[0], src[1], src[2], 255};
+      }
+      return true;
+    }
+    if (sample_bytes == 1 && maxv == 255 && depth == 4) {
+      std::memcpy(out.texels.data(), src, count * 4);
+      return true;
+    }
+    for (std::size_t i = 0; i < count; ++i, src += stride) {
+      std::uint8_t s[4] = {0, 0, 0, 255};
+      for (int c = 0; c < depth; ++c) {
+        const long long v = sample_bytes == 2 ? (src[c * 2] << 8) | src[c * 2 + 1] : src[c];
+        s[c] = scale(v);
+      }
+      SpriteTexel& t = out.texels[i];
+      if (depth <= 2) {
+        t = SpriteTexel{s[0], s[0], s[0], depth == 2 ? s[1] : std::uint8_t{255}};
+      } else {
+        t = SpriteTexel{s[0], s[1], s[2], s[3]};
+      }
     }
-    auto w_tok = next_token();
-    auto h_tok = next_token();
-    auto max_tok = next_token();
-    if (!w_tok.has_value() || !h_tok.has_value() || !max_tok.has_value()) {
+    return true;
+  }
+
+  static bool DecodeQoi(const std::vector<std::uint8_t>& data,
+                        const std::string& path, SpriteAsset& out) {
+    if (data.size() < 14 || std::memcmp(data.data(), "qoif", 4) != 0) {
       return false;
     }
+    SizeSprite(out, ReadBe32(data.data() + 4), ReadBe32(data.data() + 8), path);
+    std::array<SpriteTexel, 64> index{};
+    for (SpriteTexel& t : index) {
+      t.a = 0;
+    }
+    SpriteTexel px{0, 0, 0, 255};
+    std::size_t pos = 14;
+    int run = 0;
+    for (SpriteTexel& t : out.texels) {
+      if (run > 0) {
+        --run;
+      } else {
+        if (pos >= data.size()) {
+          throw std::runtime_error("gfx.load_sprite truncated QOI image: " + path);
+        }
+        const std::uint8_t b1 = data[pos++];
+        if (b1 == 0xFE || b1 == 0xFF) {
+          const std::size_t n = b1 == 0xFE ? 3 : 4;
+          if (data.size() - pos < n) {
+            throw std::runtime_error("gfx.load_sprite truncated QOI image: " + path);
+          }
+          px.r = data[pos];
+          px.g = data[pos + 1];
+          px.b = data[pos + 2];
+          if (n == 4) {
+            px.a = data[pos + 3];
+          }
+          pos += n;
+        } else if ((b1 & 0xC0) == 0x00) {
+          px = index[b1];
+        } else if ((b1 & 0xC0) == 0x40) {
+          px.r = static_cast<std::uint8_t>(px.r + ((b1 >> 4) & 3) - 2);
+          px.g = static_cast<std::uint8_t>(px.g + ((b1 >> 2) & 3) - 2);
+          px.b = static_cast<std::uint8_t>(px.b + (b1 & 3) - 2);
+        } else if ((b1 & 0xC0) == 0x80) {
+          if (pos >= data.size()) {
+            throw std::runtime_error("gfx.load_sprite truncated QOI image: " + path);
+          }
+          const std::uint8_t b2 = data[pos++];
+          const int vg = (b1 & 0x3F) - 32;
+          px.r = static_cast<std::uint8_t>(px.r + vg - 8 + ((b2 >> 4) & 0x0F));
+          px.g = static_cast<std::uint8_t>(px.g + vg);
+          px.b = static_cast<std::uint8_t>(px.b + vg - 8 + (b2 & 0x0F));
+        } else {
+          run = b1 & 0x3F;
+        }
+        index[static_cast<std::size_t>((px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64)] = px;
+      }
+      t = px;
+    }
+    return true;
+  }
 
-    int w = 0;
-    int h = 0;
-    int maxv = 0;
-    try {
-      w = std::stoi(w_tok.value());
-      h = std::stoi(h_tok.value());
-      maxv = std::stoi(max_tok.value());
-    } catch (...) {
+  // Uncompressed BMP: 24/32-bit BI_RGB, 16/32-bit BI_BITFIELDS and 8-bit
+  // or smaller palettes, bottom-up or top-down.
+  static bool DecodeBmp(const std::vector<std::uint8_t>& data,
+                        const std::string& path, SpriteAsset& out) {
+    if (data.size() < 30 || data[0] != 'B' || data[1] != 'M') {
       return false;
     }
-    if (w <= 0 || h <= 0 || maxv <= 0) {
+    const std::string bad = "gfx.load_sprite unsupported or malformed BMP: " + path;
+    const std::uint32_t pixel_offset = ReadLe(data.data() + 10, 4);
+    const std::uint32_t header_size = ReadLe(data.data() + 14, 4);
+    if (header_size < 40 || data.size() < 14 + static_cast<std::size_t>(header_size)) {
+      throw std::runtime_error(bad);
+    }
+    const long long w = static_cast<std::int32_t>(ReadLe(data.data() + 18, 4));
+    const long long raw_h = static_cast<std::int32_t>(ReadLe(data.data() + 22, 4));
+    const int bpp = static_cast<int>(ReadLe(data.data() + 28, 2));
+    const std::uint32_t compression = ReadLe(data.data() + 30, 4);
+    const bool top_down = raw_h < 0;
+    const long long h = top_down ? -raw_h : raw_h;
+    SizeSprite(out, w, h, path);
+
+    std::uint32_t masks[4] = {0x00FF0000u, 0x0000FF00u, 0x000000FFu, 0};
+    if (bpp == 16) {
+      masks[0] = 0x7C00u;
+      masks[1] = 0x03E0u;
+      masks[2] = 0x001Fu;
+    }
+    if (compression == 3 || compression == 6) {
+      // Masks follow a 40-byte header and sit inside larger (V4/V5) ones.
+      if (data.size() < 14 + 40 + 16) {
+        throw std::runtime_error(bad);
+      }
+      for (int i = 0; i < (header_size >= 56 || compression == 6 ? 4 : 3); ++i) {
+        masks[i] = ReadLe(data.data() + 54 + i * 4, 4);
+      }
+    } else if (compression != 0) {
+      throw std::runtime_error("gfx.load_sprite compressed BMP is not supported: " + path);
+    }
+
+    std::vector<SpriteTexel> palette;
+    if (bpp <= 8) {
+      if (bpp != 1 && bpp != 2 && bpp != 4 && bpp != 8) {
+        throw std::runtime_error(bad);
+      }
+      std::size_t colors = ReadLe(data.data() + 46, 4);
+      if (colors == 0 || colors > 256) {
+        colors = static_cast<std::size_t>(1) << bpp;
+      }
+      const std::size_t pal = 14 + header_size;
+      if (data.size() < pal + colors * 4) {
+        throw std::runtime_error(bad);
+      }
+      palette.resize(colors);
+      for (std::size_t i = 0; i < colors; ++i) {
+        const std::uint8_t* c = data.data() + pal + i * 4;
+        palette[i] = SpriteTexel{c[2], c[1], c[0], 255};
+      }
+    } else if (bpp != 16 && bpp != 24 && bpp != 32) {
+      throw std::runtime_error(bad);
+    }
+
+    const std::size_t row_bytes = ((static_cast<std::size_t>(w) * bpp + 31) / 32) * 4;
+    if (pixel_offset > data.size() ||
+        data.size() - pixel_offset < row_bytes * static_cast<std::size_t>(h)) {
+      throw std::runtime_error("gfx.load_sprite truncated BMP: " + path);
+    }
+    // Channel extraction for bitfield layouts: shift down, then widen to 8 bits.
+    int shift[4] = {0, 0, 0, 0};
+    int bits[4] = {0, 0, 0, 0};
+    for (int c = 0; c < 4; ++c) {
+      std::uint32_t m = masks[c];
+      while (m != 0 && (m & 1u) == 0) {
+        m >>= 1;
+        ++shift[c];
+      }
+      while ((m & 1u) != 0) {
+        m >>= 1;
+        ++bits[c];
+      }
+    }
+    auto channel = [&](std::uint32_t v, int c) -> std::uint8_t {
+      if (bits[c] == 0) {
+        return 255;
+      }
+      const std::uint32_t x = (v & masks[c]) >> shift[c];
+      const std::uint32_t maxv = (1u << bits[c]) - 1u;
+      return static_cast<std::uint8_t>(x * 255u / maxv);
+    };
+    bool any_alpha = false;
+    for (long long y = 0; y < h; ++y) {
+      const std::uint8_t* row =
+          data.data() + pixel_offset +
+          row_bytes * static_cast<std::size_t>(top_down ? y : h - 1 - y);
+      SpriteTexel* dst = out.texels.data() + static_cast<std::size_t>(y * w);
+      if (bpp == 24) {
+        for (long long x = 0; x < w; ++x, row += 3) {
+          dst[x] = SpriteTexel{row[2], row[1], row[0], 255};
+        }
+      } else if (bpp <= 8) {
+        const int per_byte = 8 / bpp;
+        for (long long x = 0; x < w; ++x) {
+          const std::uint8_t byte = row[x / per_byte];
+          const int bit = (per_byte - 1 - static_cast<int>(x % per_byte)) * bpp;
+          const std::size_t i = (byte >> bit) & ((1u << bpp) - 1u);
+          dst[x] = i < palette.size() ? palette[i] : SpriteTexel{0, 0, 0, 255};
+        }
+      } else {
+        const int bytes = bpp / 8;
+        for (long long x = 0; x < w; ++x, row += bytes) {
+          const std::uint32_t v = ReadLe(row, bytes);
+          dst[x] = SpriteTexel{channel(v, 0), channel(v, 1), channel(v, 2),
+                               channel(v, 3)};
+          any_alpha = any_alpha || (masks[3] != 0 && (v & masks[3]) != 0);
+        }
+      }
+    }
+    // Many writers leave the alpha byte zero; treat that as opaque.
+    if (masks[3] != 0 && bpp > 8 && !any_alpha) {
+      for (SpriteTexel& t : out.texels) {
+        t.a = 255;
+      }
+    }
+    return true;
+  }
+
+  // TGA types 2/3 (true-color/gray) and their RLE forms 10/11, 8/16/24/32 bit.
+  static bool DecodeTga(const std::vector<std::uint8_t>& data,
+                        const std::string& path, SpriteAsset& out) {
+    if (data.size() < 18) {
       return false;
     }
+    const std::string bad = "gfx.load_sprite unsupported or malformed TGA: " + path;
+    const int id_length = data[0];
+    const int colormap_type = data[1];
+    const int type = data[2];
+    const std::size_t colormap_bytes =
+        colormap_type != 0 ? ReadLe(data.data() + 5, 2) * ((data[7] + 7u) / 8u) : 0;
+    const int bpp = data[16];
+    const int descriptor = data[17];
+    const bool gray = type == 3 || type == 11;
+    const bool rle = type == 10 || type == 11;
+    if ((type != 2 && type != 3 && type != 10 && type != 11) ||
+        (gray && bpp != 8 && bpp != 16) ||
+        (!gray && bpp != 16 && bpp != 24 && bpp != 32)) {
+      throw std::runtime_error(bad);
+    }
+    const long long w = ReadLe(data.data() + 12, 2);
+    const long long h = ReadLe(data.data() + 14, 2);
+    SizeSprite(out, w, h, path);
+    const int bytes = bpp / 8;
+    std::size_t pos = 18 + static_cast<std::size_t>(id_length) + colormap_bytes;
+
+    auto texel = [&](const std::uint8_t* p) -> SpriteTexel {
+      if (gray) {
+        return SpriteTexel{p[0], p[0], p[0], bytes == 2 ? p[1] : std::uint8_t{255}};
+      }
+      if (bytes == 2) {
+        const std::uint32_t v = ReadLe(p, 2);
+        auto five = [](std::uint32_t x) {
+          return static_cast<std::uint8_t>((x & 31u) * 255u / 31u);
+        };
+        return SpriteTexel{five(v >> 10), five(v >> 5), five(v),
+                           (descriptor & 0x0F) != 0 && (v & 0x8000u) == 0
+                               ? std::uint8_t{0}
+                               : std::uint8_t{255}};
+      }
+      return SpriteTexel{p[2], p[1], p[0], bytes == 4 ? p[3] : std::uint8_t{255}};
+    };
 
-    out.width = w;
-    out.height = h;
-    out.texels.assign(static_cast<std::size_t>(w * h), SpriteTexel{});
-    for (int i = 0; i < w * h; ++i) {
-      auto r_tok = next_token();
-      auto g_tok = next_token();
-      auto b_tok = next_token();
-      if (!r_tok.has_value() || !g_tok.has_value() || !b_tok.has_value()) {
-        return false;
+    const std::size_t count = out.texels.size();
+    std::vector<SpriteTexel> decoded(count);
+    if (!rle) {
+      if (pos > data.size() || data.size() - pos < count * bytes) {
+        throw std::runtime_error("gfx.load_sprite truncated TGA: " + path);
       }
-      int r = 0;
-      int g = 0;
-      int b = 0;
-      try {
-        r = std::stoi(r_tok.value());
-        g = std::stoi(g_tok.value());
-        b = std::stoi(b_tok.value());
-      } catch (...) {
-        return false;
+      for (std::size_t i = 0; i < count; ++i) {
+        decoded[i] = texel(data.data() + pos + i * bytes);
+      }
+    } else {
+      std::size_t i = 0;
+      while (i < count) {
+        if (pos >= data.size()) {
+          throw std::runtime_error("gfx.load_sprite truncated TGA: " + path);
+        }
+        const std::uint8_t head = data[pos++];
+        const std::size_t n = std::min<std::size_t>((head & 0x7Fu) + 1u, count - i);
+        const std::size_t need = (head & 0x80u) != 0 ? bytes : n * bytes;
+        if (data.size() - pos < need) {
+          throw std::runtime_error("gfx.load_sprite truncated TGA: " + path);
+        }
+        if ((head & 0x80u) != 0) {
+          std::fill_n(decoded.begin() + static_cast<std::ptrdiff_t>(i), n,
+                      texel(data.data() + pos));
+        } else {
+          for (std::size_t k = 0; k < n; ++k) {
+            decoded[i + k] = texel(data.data() + pos + k * bytes);
+          }
+        }
+        pos += need;
+        i += n;
+      }
+    }
+    // Descriptor bit 5 set means rows are stored top to bottom, bit 4 right
+    // to left.
+    const bool top_down = (descriptor & 0x20) != 0;
+    const bool right_to_left = (descriptor & 0x10) != 0;
+    for (long long y = 0; y < h; ++y) {
+      const SpriteTexel* src = decoded.data() + static_cast<std::size_t>((top_down ? y : h - 1 - y) * w);
+      SpriteTexel* dst = out.texels.data() + static_cast<std::size_t>(y * w);
+      if (right_to_left) {
+        std::reverse_copy(src, src + w, dst);
+      } else {
+        std::copy(src, src + w, dst);
       }
-      r = std::max(0, std::min(maxv, r));
-      g = std::max(0, std::min(maxv, g));
-      b = std::max(0, std::min(maxv, b));
-      if (maxv != 255) {
-        r = (r * 255) / maxv;
-        g = (g * 255) / maxv;
-        b = (b * 255) / maxv;
-      }
-      SpriteTexel t;
-      t.r = static_cast<std::uint8_t>(r);
-      t.g = static_cast<std::uint8_t>(g);
-      t.b = static_cast<std::uint8_t>(b);
-      t.a = 255;
-      out.texels[static_cast<std::size_t>(i)] = t;
     }
     return true;
   }
@@ -2105,34 +4816,258 @@ struct GraphicsState {
     return tilemaps[static_cast<std::size_t>(map_id)];
   }
 
-  void BlitSprite(const SpriteAsset& s, int dst_x, int dst_y, int dst_w,
-                  int dst_h) {
-    for (int yy = 0; yy < dst_h; ++yy) {
-      const int sy = (yy * s.height) / dst_h;
-      for (int xx = 0; xx < dst_w; ++xx) {
-        const int sx = (xx * s.width) / dst_w;
-        const SpriteTexel& t =
-            s.texels[static_cast<std::size_t>(sy * s.width + sx)];
-        if (t.a == 0) {
-          continue;
+  // Builds the mip chain with a 2x2 box filter. Colors are averaged weighted
+  // by alpha so transparent texels do not darken sprite edges; odd edges
+  // repeat their last row/column.
+  static void BuildMips(SpriteAsset& s) {
+    s.mips.clear();
+    SpriteLevel src = s.Level(0);
+    while (src.width > 1 || src.height > 1) {
+      MipLevel m;
+      m.width = (src.width + 1) / 2;
+      m.height = (src.height + 1) / 2;
+      m.texels.resize(static_cast<std::size_t>(m.width) * m.height);
+      for (int y = 0; y < m.height; ++y) {
+        const SpriteTexel* r0 =
+            src.texels + static_cast<std::size_t>(2 * y) * src.width;
+        const SpriteTexel* r1 =
+            src.texels +
+            static_cast<std::size_t>(std::min(2 * y + 1, src.height - 1)) *
+                src.width;
+        for (int x = 0; x < m.width; ++x) {
+          const int x0 = 2 * x;
+          const int x1 = std::min(x0 + 1, src.width - 1);
+          const SpriteTexel* q[4] = {r0 + x0, r0 + x1, r1 + x0, r1 + x1};
+          int sum_a = 0;
+          int sum_r = 0;
+          int sum_g = 0;
+          int sum_b = 0;
+          for (const SpriteTexel* t : q) {
+            sum_a += t->a;
+            sum_r += t->r * t->a;
+            sum_g += t->g * t->a;
+            sum_b += t->b * t->a;
+          }
+          SpriteTexel& out = m.texels[static_cast<std::size_t>(y * m.width + x)];
+          out.a = static_cast<std::uint8_t>((sum_a + 2) / 4);
+          if (sum_a > 0) {
+            out.r = static_cast<std::uint8_t>((sum_r + sum_a / 2) / sum_a);
+            out.g = static_cast<std::uint8_t>((sum_g + sum_a / 2) / sum_a);
+            out.b = static_cast<std::uint8_t>((sum_b + sum_a / 2) / sum_a);
+          } else {
+            out.r = out.g = out.b = 0;
+          }
         }
-        const int tx = dst_x + xx;
-        const int ty = dst_y + yy;
-        if (tx < 0 || ty < 0 || tx >= width || ty >= height) {
+      }
+      s.mips.push_back(std::move(m));
+      src = s.Level(static_cast<int>(s.mips.size()));
+    }
+  }
+
+  // Deepest mip level that still has at least one texel per destination
+  // pixel when the src rect is drawn into dst_w x dst_h pixels. The mips
+  // cover the whole texture, so a sub-rect (an atlas entry or sheet tile)
+  // only goes as deep as its origin and size are multiples of 2^level;
+  // deeper texels would average in the neighbouring sprite or the gutter.
+  static int MipLevelFor(const SpriteAsset& s, int src_x, int src_y, int src_w,
+                         int src_h, int dst_w, int dst_h) {
+    const bool whole =
+        src_x == 0 && src_y == 0 && src_w == s.width && src_h == s.height;
+    const int align = src_x | src_y | src_w | src_h;
+    int level = 0;
+    while (level + 1 < s.LevelCount() &&
+           (static_cast<long long>(dst_w) << (level + 1)) <= src_w &&
+           (static_cast<long long>(dst_h) << (level + 1)) <= src_h &&
+           (whole || (align & ((2 << level) - 1)) == 0)) {
+      ++level;
+    }
+    return level;
+  }
+
+  static int FloorDiv(int a, int b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+  }
+
+  // Returns the chunk cache of `map` for this layout. Up to
+  // kMaxTileLayouts layouts stay cached per map; past that the least
+  // recently drawn one is released and reused.
+  static TileLayout& GetTileLayout(Tilemap2D& map, int sprite_id, int tiles_per_row,
+                                   int src_w, int src_h) {
+    constexpr std::size_t kMaxTileLayouts = 4;
+    TileLayout* oldest = nullptr;
+    for (TileLayout& layout : map.layouts) {
+      if (layout.sprite == sprite_id && layout.tiles_per_row == tiles_per_row &&
+          layout.src_w == src_w && layout.src_h == src_h) {
+        return layout;
+      }
+      if (oldest == nullptr || layout.last_used < oldest->last_used) {
+        oldest = &layout;
+      }
+    }
+    TileLayout* layout = oldest;
+    if (map.layouts.size() < kMaxTileLayouts) {
+      map.layouts.emplace_back();
+      layout = &map.layouts.back();
+      layout->chunks.resize(static_cast<std::size_t>(map.chunk_cols) * map.chunk_rows);
+    } else {
+      for (TileChunk& chunk : layout->chunks) {
+        ReleaseTileChunk(*layout, chunk);
+        chunk.dirty = true;
+      }
+    }
+    layout->sprite = sprite_id;
+    layout->tiles_per_row = tiles_per_row;
+    layout->src_w = src_w;
+    layout->src_h = src_h;
+    return *layout;
+  }
+
+  // Renders one chunk of `map` with the same nearest/mip sampling as
+  // BlitRegion, so blending the block equals blending each tile.
+  void RenderTileChunk(const Tilemap2D& map, TileLayout& layout, const SpriteAsset& s,
+                       int cx, int cy, TileChunk& chunk) {
+    const int cell_x0 = cx * kTileChunkSize;
+    const int cell_y0 = cy * kTileChunkSize;
+    const int cells_w = std::min(kTileChunkSize, map.cols - cell_x0);
+    const int cells_h = std::min(kTileChunkSize, map.rows - cell_y0);
+    SpriteAsset& img = chunk.image;
+    if (img.texels.empty()) {
+      ++layout.resident_chunks;
+    }
+    img.width = cells_w * map.tile_w;
+    img.height = cells_h * map.tile_h;
+    img.texels.assign(static_cast<std::size_t>(img.width) * img.height,
+                      SpriteTexel{0, 0, 0, 0});
+    const int tpr = layout.tiles_per_row;
+    const int src_w = layout.src_w;
+    const int src_h = layout.src_h;
+    // Tiles sit on multiples of their size, so the second column and row
+    // stand in for every tile when limiting the level to the tile grid.
+    const int level =
+        MipLevelFor(s, tpr > 1 ? src_w : 0, s.height > src_h ? src_h : 0, src_w,
+                    src_h, map.tile_w, map.tile_h);
+    const SpriteLevel tex = s.Level(level);
+    bool any = false;
+    bool opaque = true;
+    for (int y = 0; y < cells_h; ++y) {
+      for (int x = 0; x < cells_w; ++x) {
+        const int tile_id = map.tiles[static_cast<std::size_t>(
+            (cell_y0 + y) * map.cols + cell_x0 + x)];
+        if (tile_id < 0) {
+          opaque = false;
           continue;
         }
-        Pixel& out = pixels[static_cast<std::size_t>(ty * width + tx)];
-        if (t.a == 255) {
-          out = Pixel{static_cast<int>(t.r), static_cast<int>(t.g),
-                      static_cast<int>(t.b)};
-        } else {
-          const int a = static_cast<int>(t.a);
-          out.r = (static_cast<int>(t.r) * a + out.r * (255 - a)) / 255;
-          out.g = (static_cast<int>(t.g) * a + out.g * (255 - a)) / 255;
-          out.b = (static_cast<int>(t.b) * a + out.b * (255 - a)) / 255;
+        any = true;
+        const int src_x = (tile_id % tpr) * src_w;
+        const int src_y = (tile_id / tpr) * src_h;
+        for (int yy = 0; yy < map.tile_h; ++yy) {
+          const int sy = src_y + ((yy * src_h) / map.tile_h);
+          SpriteTexel* out = img.texels.data() +
+                             static_cast<std::size_t>(y * map.tile_h + yy) * img.width +
+                             x * map.tile_w;
+          if (sy < 0 || sy >= s.height) {
+            opaque = false;
+            continue;
+          }
+          const SpriteTexel* row =
+              tex.texels + static_cast<std::size_t>(sy >> level) * tex.width;
+          for (int xx = 0; xx < map.tile_w; ++xx) {
+            const int sx = src_x + ((xx * src_w) / map.tile_w);
+            if (sx < 0 || sx >= s.width) {
+              opaque = false;
+              continue;
+            }
+            out[xx] = row[sx >> level];
+            opaque = opaque && out[xx].a == 255;
+          }
+        }
+      }
+    }
+    chunk.dirty = false;
+    chunk.empty = !any;
+    chunk.opaque = any && opaque;
+    if (chunk.empty) {
+      ReleaseTileChunk(layout, chunk);
+    }
+  }
+
+  static void ReleaseTileChunk(TileLayout& layout, TileChunk& chunk) {
+    if (!chunk.image.texels.empty()) {
+      std::vector<SpriteTexel>().swap(chunk.image.texels);
+      --layout.resident_chunks;
+    }
+  }
+
+  // Frees the least recently drawn chunk blocks once a layout holds more
+  // than kMaxResidentTileChunks; they are re-rendered when scrolled back in.
+  // Chunks drawn at `draw_clock` are never evicted.
+  static void EvictTileChunks(TileLayout& layout, std::uint64_t draw_clock) {
+    constexpr int kMaxResidentTileChunks = 64;
+    while (layout.resident_chunks > kMaxResidentTileChunks) {
+      TileChunk* oldest = nullptr;
+      for (TileChunk& chunk : layout.chunks) {
+        if (!chunk.image.texels.empty() && chunk.last_used < draw_clock &&
+            (oldest == nullptr || chunk.last_used < oldest->last_used)) {
+          oldest = &chunk;
         }
       }
+      if (oldest == nullptr) {
+        return;
+      }
+      ReleaseTileChunk(layout, *oldest);
+      oldest->dirty = true;
+    }
+  }
+
+  // Blends the src rect of `s` into the dst rect with nearest sampling.
+  // Source texels outside the sprite count as transparent. Unscaled rows
+  // blend straight from the texture; downscaled draws sample the mip level
+  // matching the scale.
+  void BlitRegion(const SpriteAsset& s, int src_x, int src_y, int src_w,
+                  int src_h, int dst_x, int dst_y, int dst_w, int dst_h,
+                  int tint_r, int tint_g, int tint_b) {
+    const int xx0 = std::max(0, -dst_x);
+    const int xx1 = std::min(dst_w, width - dst_x);
+    if (xx0 >= xx1) {
+      return;
+    }
+    const int n = xx1 - xx0;
+    const bool direct = dst_w == src_w && src_x >= 0 && src_x + src_w <= s.width;
+    const int level = MipLevelFor(s, src_x, src_y, src_w, src_h, dst_w, dst_h);
+    const SpriteLevel tex = s.Level(level);
+    for (int yy = std::max(0, -dst_y); yy < dst_h && dst_y + yy < height; ++yy) {
+      const int sy = src_y + ((yy * src_h) / dst_h);
+      if (sy < 0 || sy >= s.height) {
+        continue;
+      }
+      const SpriteTexel* row =
+          tex.texels + static_cast<std::size_t>(sy >> level) * tex.width;
+      if (direct) {
+        BlendRow(dst_x + xx0, dst_y + yy, row + src_x + xx0, n, tint_r, tint_g,
+                 tint_b);
+        continue;
+      }
+      span_scratch.resize(static_cast<std::size_t>(n));
+      for (int xx = xx0; xx < xx1; ++xx) {
+        const int sx = src_x + ((xx * src_w) / dst_w);
+        span_scratch[static_cast<std::size_t>(xx - xx0)] =
+            (sx < 0 || sx >= s.width) ? SpriteTexel{0, 0, 0, 0} : row[sx >> level];
+      }
+      BlendRow(dst_x + xx0, dst_y + yy, span_scratch.data(), n, tint_r, tint_g,
+               tint_b);
+    }
+  }
+
+  const SpriteAtlas& GetAtlas(int atlas_id, const std::string& fn) const {
+    if (atlas_id < 0 || static_cast<std::size_t>(atlas_id) >= atlases.size()) {
+      throw std::runtime_error(fn + " invalid atlas id: " + std::to_string(atlas_id));
     }
+    return atlases[static_cast<std::size_t>(atlas_id)];
+  }
+
+  void BlitSprite(const SpriteAsset& s, int dst_x, int dst_y, int dst_w,
+                  int dst_h) {
+    BlitSpriteTinted(s, dst_x, dst_y, dst_w, dst_h, 255, 255, 255);
   }
 
   void BlitSpriteTinted(const SpriteAsset& s, int dst_x, int dst_y, int dst_w,
@@ -2140,59 +5075,51 @@ struct GraphicsState {
     const int tr = ClampColor(tint_r);
     const int tg = ClampColor(tint_g);
     const int tb = ClampColor(tint_b);
-    for (int yy = 0; yy < dst_h; ++yy) {
-      const int sy = (yy * s.height) / dst_h;
-      for (int xx = 0; xx < dst_w; ++xx) {
-        const int sx = (xx * s.width) / dst_w;
-        const SpriteTexel& t =
-            s.texels[static_cast<std::size_t>(sy * s.width + sx)];
-        if (t.a == 0) {
-          continue;
-        }
-        const int tx = dst_x + xx;
-        const int ty = dst_y + yy;
-        if (tx < 0 || ty < 0 || tx >= width || ty >= height) {
-          continue;
-        }
-        const int rr = (static_cast<int>(t.r) * tr) / 255;
-        const int gg = (static_cast<int>(t.g) * tg) / 255;
-        const int bb = (static_cast<int>(t.b) * tb) / 255;
-        Pixel& out = pixels[static_cast<std::size_t>(ty * width + tx)];
-        if (t.a == 255) {
-          out = Pixel{rr, gg, bb};
-        } else {
-          const int a = static_cast<int>(t.a);
-          out.r = (rr * a + out.r * (255 - a)) / 255;
-          out.g = (gg * a + out.g * (255 - a)) / 255;
-          out.b = (bb * a + out.b * (255 - a)) / 255;
+    const int xx0 = std::max(0, -dst_x);
+    const int xx1 = std::min(dst_w, width - dst_x);
+    if (xx0 >= xx1) {
+      return;
+    }
+    const int n = xx1 - xx0;
+    // Unscaled rows blend straight from the sprite; scaled rows are sampled
+    // into the scratch span once per source row.
+    // Downscaled draws read the mip level matching the scale.
+    const bool scaled = dst_w != s.width;
+    const int level = MipLevelFor(s, 0, 0, s.width, s.height, dst_w, dst_h);
+    const SpriteLevel tex = s.Level(level);
+    int gathered_sy = -1;
+    for (int yy = std::max(0, -dst_y); yy < dst_h && dst_y + yy < height; ++yy) {
+      const int sy = ((yy * s.height) / dst_h) >> level;
+      const SpriteTexel* row =
+          tex.texels + static_cast<std::size_t>(sy) * tex.width;
+      const SpriteTexel* src = row + xx0;
+      if (scaled) {
+        if (sy != gathered_sy) {
+          span_scratch.resize(static_cast<std::size_t>(n));
+          for (int xx = xx0; xx < xx1; ++xx) {
+            span_scratch[static_cast<std::size_t>(xx - xx0)] =
+                row[((xx * s.width) / dst_w) >> level];
+          }
+          gathered_sy = sy;
         }
+        src = span_scratch.data();
       }
+      BlendRow(dst_x + xx0, dst_y + yy, src, n, tr, tg, tb);
     }
   }
 
   Pixel ReadPixelShaderSource(int x, int y) const {
     x = std::max(0, std::min(width - 1, x));
     y = std::max(0, std::min(height - 1, y));
-    return pixels[static_cast<std::size_t>(y * width + x)];
+    return UnpackPixel(pixels[static_cast<std::size_t>(y * width + x)]);
   }
 
-  Pixel ApplyShaderOp(int mode, int p1, int p2, int p3, int x, int y,
-                      Pixel p) const {
+  Pixel ApplyShaderOp(int mode, int p1, int p2, int p3, int x, int y, Pixel p,
+                      const BlurPass* blur = nullptr) const {
+    // Per-channel, grayscale and threshold modes are compiled into tables
+    // by CompileShader and never reach this function.
     const double pi = 3.14159265358979323846;
-    const int mix = std::max(0, std::min(1000, p1));
-    if (mode == 1) {
-      int lum = (p.r * 30 + p.g * 59 + p.b * 11) / 100;
-      p.r = (p.r * (1000 - mix) + lum * mix) / 1000;
-      p.g = (p.g * (1000 - mix) + lum * mix) / 1000;
-      p.b = (p.b * (1000 - mix) + lum * mix) / 1000;
-    } else if (mode == 2) {
-      const int dark = std::max(0, std::min(255, p1));
-      if (((y + present_frame) & 1) != 0) {
-        p.r = (p.r * (255 - dark)) / 255;
-        p.g = (p.g * (255 - dark)) / 255;
-        p.b = (p.b * (255 - dark)) / 255;
-      }
-    } else if (mode == 3) {
+    if (mode == 3) {
       const int amp = std::max(0, std::min(64, p1));
       const double freq = std::max(1, p2) / 1000.0;
       const double speed = static_cast<double>(p3);
@@ -2201,21 +5128,6 @@ struct GraphicsState {
       const int offset = static_cast<int>(
           std::round(std::sin(phase * pi) * static_cast<double>(amp)));
       p = ReadPixelShaderSource(x + offset, y);
-    } else if (mode == 4) {
-      const int inv_r = 255 - p.r;
-      const int inv_g = 255 - p.g;
-      const int inv_b = 255 - p.b;
-      p.r = (p.r * (1000 - mix) + inv_r * mix) / 1000;
-      p.g = (p.g * (1000 - mix) + inv_g * mix) / 1000;
-      p.b = (p.b * (1000 - mix) + inv_b * mix) / 1000;
-    } else if (mode == 5) {
-      int levels = p1;
-      if (levels < 2) levels = 2;
-      if (levels > 64) levels = 64;
-      const int step = std::max(1, 255 / (levels - 1));
-      p.r = ((p.r + step / 2) / step) * step;
-      p.g = ((p.g + step / 2) / step) * step;
-      p.b = ((p.b + step / 2) / step) * step;
     } else if (mode == 6) {
       const int off = std::max(0, std::min(24, p1));
       const Pixel pr = ReadPixelShaderSource(x - off, y);
@@ -2263,16 +5175,6 @@ struct GraphicsState {
       const int bx = (x / block) * block;
       const int by = (y / block) * block;
       p = ReadPixelShaderSource(bx, by);
-    } else if (mode == 10) {
-      // Threshold/duotone: p1 threshold 0..255, p2 high level, p3 low level
-      const int threshold = std::max(0, std::min(255, p1));
-      const int hi = std::max(0, std::min(255, p2));
-      const int lo = std::max(0, std::min(255, p3));
-      const int lum = (p.r * 30 + p.g * 59 + p.b * 11) / 100;
-      const int out = (lum >= threshold) ? hi : lo;
-      p.r = out;
-      p.g = out;
-      p.b = out;
     } else if (mode == 11) {
       // Minecraft-like voxel post shader:
       // p1 block size 1..32, p2 color levels 2..32, p3 edge strength 0..255.
@@ -2307,30 +5209,6 @@ struct GraphicsState {
       p.r = (q.r * (255 - dark)) / 255;
       p.g = (q.g * (255 - dark)) / 255;
       p.b = (q.b * (255 - dark)) / 255;
-    } else if (mode == 12) {
-      // Bayer-style dither quantization:
-      // p1 strength 0..255, p2 levels 2..32.
-      const int strength = std::max(0, std::min(255, p1));
-      int levels = p2;
-      if (levels < 2) levels = 2;
-      if (levels > 32) levels = 32;
-      static const int bayer4[4][4] = {
-          {0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
-      const int t = bayer4[y & 3][x & 3];
-      const int bias = ((t - 7) * strength) / 16;
-
-      auto quant = [&](int c) {
-        int v = c + bias;
-        if (v < 0) v = 0;
-        if (v > 255) v = 255;
-        const int step = std::max(1, 255 / (levels - 1));
-        int out = ((v + step / 2) / step) * step;
-        if (out > 255) out = 255;
-        return out;
-      };
-      p.r = quant(p.r);
-      p.g = quant(p.g);
-      p.b = quant(p.b);
     } else if (mode == 13) {
       // CRT-like effect:
       // p1 curvature 0..200, p2 scanline darken 0..255, p3 chroma offset 0..8.
@@ -2369,40 +5247,23 @@ struct GraphicsState {
       p.g = (p.g * (255 - vignette)) / 255;
       p.b = (p.b * (255 - vignette)) / 255;
     } else if (mode == 14) {
-      // Bloom-lite:
-      // p1 threshold 0..255, p2 radius 1..4, p3 intensity 0..255.
-      const int threshold = std::max(0, std::min(255, p1));
-      int radius = p2;
-      if (radius < 1) radius = 1;
-      if (radius > 4) radius = 4;
+      // Bloom: p1 threshold 0..255, p2 radius 1..64, p3 intensity 0..255.
+      // The bright-pass blur comes precomputed in `blur`.
       const int intensity = std::max(0, std::min(255, p3));
-
-      int acc_r = 0;
-      int acc_g = 0;
-      int acc_b = 0;
-      int acc_n = 0;
-      for (int oy = -radius; oy <= radius; ++oy) {
-        for (int ox = -radius; ox <= radius; ++ox) {
-          const Pixel s = ReadPixelShaderSource(x + ox, y + oy);
-          const int lum = (s.r * 30 + s.g * 59 + s.b * 11) / 100;
-          if (lum < threshold) {
-            continue;
-          }
-          const int dist = std::abs(ox) + std::abs(oy);
-          const int w = std::max(1, (radius + 1) - dist);
-          acc_r += s.r * w;
-          acc_g += s.g * w;
-          acc_b += s.b * w;
-          acc_n += w;
-        }
-      }
-      if (acc_n > 0) {
-        const int br = acc_r / acc_n;
-        const int bg = acc_g / acc_n;
-        const int bb = acc_b / acc_n;
-        p.r = ClampColor(p.r + (br * intensity) / 255);
-        p.g = ClampColor(p.g + (bg * intensity) / 255);
-        p.b = ClampColor(p.b + (bb * intensity) / 255);
+      Pixel glow;
+      if (blur != nullptr && SampleBlurPass(*blur, x, y, glow)) {
+        p.r = ClampColor(p.r + (glow.r * intensity) / 255);
+        p.g = ClampColor(p.g + (glow.g * intensity) / 255);
+        p.b = ClampColor(p.b + (glow.b * intensity) / 255);
+      }
+    } else if (mode == 15) {
+      // Blur: p1 radius 1..64, p2 mix 0..1000.
+      Pixel soft;
+      if (blur != nullptr && SampleBlurPass(*blur, x, y, soft)) {
+        const int amount = std::max(0, std::min(1000, p2));
+        p.r = (p.r * (1000 - amount) + soft.r * amount) / 1000;
+        p.g = (p.g * (1000 - amount) + soft.g * amount) / 1000;
+        p.b = (p.b * (1000 - amount) + soft.b * amount) / 1000;
       }
     }
     p.r = ClampColor(p.r);
@@ -2411,35 +5272,6 @@ struct GraphicsState {
     return p;
   }
 
-  void BuildPresentBuffer() {
-    const bool has_program =
-        (shader_program_active >= 0 &&
-         static_cast<std::size_t>(shader_program_active) < shader_programs.size() &&
-         !shader_programs[static_cast<std::size_t>(shader_program_active)]
-              .ops.empty());
-    const std::vector<ShaderOp>* ops =
-        has_program ? &shader_programs[static_cast<std::size_t>(shader_program_active)].ops
-                    : nullptr;
-
-    for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-        Pixel p = ReadPixelShaderSource(x, y);
-        if (ops != nullptr) {
-          for (const ShaderOp& op : *ops) {
-            p = ApplyShaderOp(op.mode, op.p1, op.p2, op.p3, x, y, p);
-          }
-        } else if (shader_mode != 0) {
-          p = ApplyShaderOp(shader_mode, shader_p1, shader_p2, shader_p3, x, y,
-                            p);
-        }
-        std::uint32_t value = (static_cast<std::uint32_t>(p.b) << 16) |
-                              (static_cast<std::uint32_t>(p.g) << 8) |
-                              static_cast<std::uint32_t>(p.r);
-        rgba_buffer[static_cast<std::size_t>(y * width + x)] = value;
-      }
-    }
-  }
-
   using Glyph5x7 = std::array<std::string_view, 7>;
 
   static const Glyph5x7& GlyphForChar(char raw) {
@@ -2587,7 +5419,7 @@ struct GraphicsState {
     return kUnknown;
   }
 
-  void DrawGlyph5x7(int x, int y, char c, const Pixel& color) {
+  void DrawGlyph5x7(int x, int y, char c, std::uint32_t color) {
     const Glyph5x7& glyph = GlyphForChar(c);
     for (int row = 0; row < 7; ++row) {
       for (int col = 0; col < 5; ++col) {
@@ -2599,7 +5431,8 @@ struct GraphicsState {
     }
   }
 
-  void DrawGlyph5x7Scaled(int x, int y, char c, int scale, const Pixel& color) {
+  void DrawGlyph5x7Scaled(int x, int y, char c, int scale,
+                          std::uint32_t color) {
     const Glyph5x7& glyph = GlyphForChar(c);
     for (int row = 0; row < 7; ++row) {
       for (int col = 0; col < 5; ++col) {
@@ -2888,16 +5721,323 @@ struct GraphicsState {
 #endif
 };
 
-std::vector<Instruction> CompileSource(const std::filesystem::path& source_file);
+// Low-overhead sampling profiler. The VM publishes its instruction pointer
+// with a relaxed store per instruction; a timer (SIGPROF on POSIX, a sampler
+// thread on Windows) copies it into a lock-free ring that the VM drains at
+// loop back-edges. Samples are attributed to source lines and builtins only
+// when a report is requested.
+std::atomic<const std::vector<Instruction>*> g_profile_code{nullptr};
+std::atomic<std::size_t> g_profile_ip{0};
+std::atomic<bool> g_profile_drain_requested{false};
+
+class SamplingProfiler {
+ public:
+  static constexpr std::size_t kRingSize = 1u << 16;
+
+  static SamplingProfiler& Instance() {
+    static SamplingProfiler profiler;
+    return profiler;
+  }
+
+  bool Running() const { return running_; }
+
+  void SetProgram(const std::vector<Instruction>* code, LineTable lines,
+                  std::string source_name) {
+    root_code_.store(code, std::memory_order_relaxed);
+    root_lines_ = std::move(lines);
+    source_name_ = std::move(source_name);
+  }
+
+  void Start(int hz) {
+    if (hz <= 0) {
+      hz = 1000;
+    }
+    if (hz > 10000) {
+      hz = 10000;
+    }
+    Stop();
+    hz_ = hz;
+    running_ = true;
+#ifdef _WIN32
+    sampler_stop_.store(false);
+    sampler_ = std::thread([this]() {
+      const auto period = std::chrono::microseconds(1000000 / hz_);
+      while (!sampler_stop_.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(period);
+        Record();
+      }
+    });
+#else
+    struct sigaction sa {};
+    sa.sa_handler = &SamplingProfiler::OnSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, nullptr);
+#if defined(__linux__)
+    // A POSIX CPU-time timer is not bound to the scheduler tick, so rates
+    // above CONFIG_HZ are honored (ITIMER_PROF would cap them).
+    sigevent sev{};
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGPROF;
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &timer_) == 0) {
+      itimerspec spec{};
+      spec.it_interval.tv_nsec = 1000000000L / hz_;
+      spec.it_value = spec.it_interval;
+      timer_settime(timer_, 0, &spec, nullptr);
+      timer_active_ = true;
+      return;
+    }
+#endif
+    itimerval timer{};
+    timer.it_interval.tv_usec = 1000000 / hz_;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+  }
+
+  void Stop() {
+    if (!running_) {
+      return;
+    }
+#ifdef _WIN32
+    sampler_stop_.store(true);
+    if (sampler_.joinable()) {
+      sampler_.join();
+    }
+#else
+#if defined(__linux__)
+    if (timer_active_) {
+      timer_delete(timer_);
+      timer_active_ = false;
+    }
+#endif
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_IGN);
+#endif
+    running_ = false;
+    Drain();
+  }
+
+  // Moves pending ring entries into the per-ip histogram. Called from the VM
+  // thread only.
+  void Drain() {
+    g_profile_drain_requested.store(false, std::memory_order_relaxed);
+    while (true) {
+      const std::size_t tail = tail_.load(std::memory_order_relaxed);
+      const std::uint64_t sample =
+          ring_[tail & (kRingSize - 1)].exchange(0, std::memory_order_acquire);
+      if (sample == 0) {
+        break;
+      }
+      tail_.store(tail + 1, std::memory_order_relaxed);
+      total_ += 1;
+      if ((sample >> 32) != kTagRoot) {
+        foreign_ += 1;
+        continue;
+      }
+      const std::size_t ip = static_cast<std::size_t>(sample & 0xFFFFFFFFu) - 1;
+      per_ip_[ip] += 1;
+    }
+  }
+
+  void Report(std::ostream& out) {
+    Drain();
+    const std::vector<Instruction>* code =
+        root_code_.load(std::memory_order_relaxed);
+    out << "[profile] " << total_ << " samples @ " << hz_ << " Hz ("
+        << dropped_.load() << " dropped";
+    if (foreign_ > 0) {
+      out << ", " << foreign_ << " in imported modules";
+    }
+    out << ")\n";
+    if (total_ == 0 || code == nullptr) {
+      return;
+    }
+
+    std::map<int, std::uint64_t> by_line;
+    std::map<std::string, std::uint64_t> by_builtin;
+    std::map<int, std::string> line_label;
+    for (const auto& [ip, count] : per_ip_) {
+      const auto loc = root_lines_.Lookup(ip);
+      const int line = loc.has_value() ? loc->line : 0;
+      by_line[line] += count;
+      if (ip < code->size() && (*code)[ip].op == "CALL") {
+        by_builtin[(*code)[ip].args[0]] += count;
+        line_label.emplace(line, (*code)[ip].args[0]);
+      } else if (ip < code->size()) {
+        by_builtin["<vm:" + (*code)[ip].op + ">"] += count;
+      }
+    }
+
+    auto print_top = [&](const auto& table, const std::string& title,
+                         const auto& label_of) {
+      std::vector<std::pair<std::uint64_t, std::string>> rows;
+      for (const auto& [key, count] : table) {
+        rows.emplace_back(count, label_of(key));
+      }
+      std::sort(rows.begin(), rows.end(),
+                [](const auto& a, const auto& b) { return a.first > b.first; });
+      out << "[profile] " << title << ":\n";
+      const std::size_t shown = std::min<std::size_t>(rows.size(), 15);
+      for (std::size_t i = 0; i < shown; ++i) {
+        const double pct = (100.0 * static_cast<double>(rows[i].first)) /
+                           static_cast<double>(total_);
+        out << "  " << std::setw(6) << std::fixed << std::setprecision(1) << pct
+            << "% " << std::setw(8) << rows[i].first << "  " << rows[i].second
+            << "\n";
+      }
+    };
+    print_top(by_line, "by source line", [&](int line) {
+      std::string label = source_name_ + ":" + std::to_string(line);
+      auto it = line_label.find(line);
+      if (it != line_label.end()) {
+        label += "  " + it->second;
+      }
+      return label;
+    });
+    print_top(by_builtin, "by builtin", [](const std::string& n) { return n; });
+  }
+
+ private:
+  static constexpr std::uint64_t kTagRoot = 1;
+  static constexpr std::uint64_t kTagForeign = 2;
+
+  SamplingProfiler() = default;
+
+#ifndef _WIN32
+  static void OnSignal(int) { Instance().Record(); }
+#endif
+
+  // Async-signal-safe: only lock-free atomics are touched.
+  void Record() {
+    const std::vector<Instruction>* code =
+        g_profile_code.load(std::memory_order_relaxed);
+    if (code == nullptr) {
+      return;
+    }
+    const std::size_t ip = g_profile_ip.load(std::memory_order_relaxed);
+    const std::uint64_t tag =
+        code == root_code_.load(std::memory_order_relaxed) ? kTagRoot : kTagForeign;
+    const std::uint64_t sample =
+        (tag << 32) | (static_cast<std::uint64_t>(ip + 1) & 0xFFFFFFFFu);
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    std::uint64_t expected = 0;
+    if (!ring_[head & (kRingSize - 1)].compare_exchange_strong(
+            expected, sample, std::memory_order_release,
+            std::memory_order_relaxed)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    head_.store(head + 1, std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_relaxed) > kRingSize / 2) {
+      g_profile_drain_requested.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  std::array<std::atomic<std::uint64_t>, kRingSize> ring_{};
+  std::atomic<std::size_t> head_{0};
+  std::atomic<std::size_t> tail_{0};
+  std::atomic<std::uint64_t> dropped_{0};
+  std::atomic<const std::vector<Instruction>*> root_code_{nullptr};
+  std::unordered_map<std::size_t, std::uint64_t> per_ip_;
+  LineTable root_lines_;
+  std::string source_name_ = "<program>";
+  std::uint64_t total_ = 0;
+  std::uint64_t foreign_ = 0;
+  int hz_ = 1000;
+  bool running_ = false;
+#ifdef _WIN32
+  std::thread sampler_;
+  std::atomic<bool> sampler_stop_{false};
+#elif defined(__linux__)
+  timer_t timer_{};
+  bool timer_active_ = false;
+#endif
+};
+
+std::vector<Instruction> CompileSource(const std::filesystem::path& source_file,
+                                       LineTable* lines = nullptr);
 
 class VM {
  public:
   explicit VM(std::filesystem::path module_base = std::filesystem::current_path())
       : module_base_(std::move(module_base)) {}
 
-  void Execute(const std::vector<Instruction>& code) {
+  // `lines` is only consulted after a failure, to prefix the error with the
+  // source position of the faulting instruction.
+  void Execute(const std::vector<Instruction>& code,
+               const LineTable* lines = nullptr) {
     std::size_t ip = 0;
+    try {
+      Run(code, ip);
+    } catch (const std::exception& ex) {
+      if (lines == nullptr || ip >= code.size()) {
+        throw;
+      }
+      std::string where = lines->Describe(ip);
+      const Instruction& ins = code[ip];
+      if (ins.op == "CALL" && !ins.args.empty()) {
+        where += " in " + ins.args[0];
+      }
+      throw std::runtime_error(std::string(ex.what()) + "\n  at " + where);
+    }
+  }
+
+  const std::unordered_map<std::string, Value>& Globals() const { return vars_; }
+
+  // Native micro-benchmarks behind `pypp bench <suite>`. They drive the
+  // renderers directly so interpreter overhead does not hide the numbers.
+  void Benchmark(const std::string& suite, std::ostream& out) {
+    if (suite == "raster") {
+      BenchmarkRaster(out);
+      return;
+    }
+    if (suite == "spans") {
+      BenchmarkSpans(out);
+      return;
+    }
+    if (suite == "shaders") {
+      BenchmarkShaders(out);
+      return;
+    }
+    if (suite == "save") {
+      BenchmarkSave(out);
+      return;
+    }
+    if (suite == "particles") {
+      BenchmarkParticles(out);
+      return;
+    }
+    if (suite == "gx3d") {
+      BenchmarkGx3d(out);
+      return;
+    }
+    if (suite == "alloc") {
+      BenchmarkAlloc(out);
+      return;
+    }
+    throw std::runtime_error(
+        "Unknown benchmark suite: " + suite +
+        " (available: raster, spans, shaders, save, particles, gx3d, alloc)");
+  }
+
+ private:
+  void Run(const std::vector<Instruction>& code, std::size_t& ip) {
+    struct ProfileScope {
+      const std::vector<Instruction>* saved_code;
+      std::size_t saved_ip;
+      explicit ProfileScope(const std::vector<Instruction>* code)
+          : saved_code(g_profile_code.exchange(code)),
+            saved_ip(g_profile_ip.load(std::memory_order_relaxed)) {}
+      ~ProfileScope() {
+        g_profile_code.store(saved_code);
+        g_profile_ip.store(saved_ip, std::memory_order_relaxed);
+      }
+    } profile_scope(&code);
+
     while (ip < code.size()) {
+      g_profile_ip.store(ip, std::memory_order_relaxed);
       const Instruction& ins = code[ip];
       if (ins.op == "HALT") {
         return;
@@ -2966,6 +6106,9 @@ class VM {
           continue;
         }
       } else if (ins.op == "JMP") {
+        if (g_profile_drain_requested.load(std::memory_order_relaxed)) {
+          SamplingProfiler::Instance().Drain();
+        }
         int target = std::stoi(ins.args[0]);
         if (target < 0 || static_cast<std::size_t>(target) >= code.size()) {
           throw std::runtime_error("Invalid jump target");
@@ -2983,9 +6126,6 @@ class VM {
     }
   }
 
-  const std::unordered_map<std::string, Value>& Globals() const { return vars_; }
-
- private:
   class Gx3dState {
    public:
     struct ScreenVertex {
@@ -3001,13 +6141,19 @@ class VM {
       double v = 0.0;
     };
 
-    explicit Gx3dState(GraphicsState& gfx) : gfx_(gfx) {}
+    explicit Gx3dState(GraphicsState& gfx) : gfx_(gfx) {
+      UpdateModel();
+      UpdateView();
+    }
+    friend class VM;
 
     void Reset() {
       cam_ = Vec3{0.0, 0.0, -220.0};
       rot_deg_ = Vec3{0.0, 0.0, 0.0};
       trans_ = Vec3{0.0, 0.0, 0.0};
       scale_ = Vec3{1.0, 1.0, 1.0};
+      UpdateModel();
+      UpdateView();
       fov_ = 300.0;
       near_clip_ = 1.0;
       far_clip_ = 10000.0;
@@ -3016,17 +6162,65 @@ class VM {
       depth_dirty_ = true;
     }
 
-    void OnFrameReset() { depth_dirty_ = true; }
+    void OnFrameReset() {
+      depth_dirty_ = true;
+      stats_ = Stats{};
+    }
+
+    // Objects drawn, rejected by the frustum test and rejected as hidden
+    // behind the depth buffer since the last gfx.clear/gfx.present (mesh
+    // draws and voxel chunks count once each).
+    int StatsDrawn() const { return stats_.drawn; }
+    int StatsCulled() const { return stats_.culled; }
+    int StatsOccluded() const { return stats_.occluded; }
+
+    // Deferred mode: between BeginFrame and EndFrame, solid and textured
+    // triangles are projected, clipped and culled as usual but only
+    // recorded. EndFrame draws the opaque ones front to back (so the depth
+    // test rejects hidden pixels before they are shaded) and then the
+    // translucent ones back to front (so they blend in the right order).
+    // Lines, points and billboards still draw immediately.
+    void BeginFrame() {
+      if (deferred_) {
+        throw std::runtime_error("gx3d.begin_frame called twice without gx3d.end_frame");
+      }
+      deferred_ = true;
+      deferred_opaque_.clear();
+      deferred_translucent_.clear();
+    }
+
+    // Returns the number of triangles drawn.
+    int EndFrame() {
+      if (!deferred_) {
+        throw std::runtime_error("gx3d.end_frame without gx3d.begin_frame");
+      }
+      deferred_ = false;
+      const int count =
+          static_cast<int>(deferred_opaque_.size() + deferred_translucent_.size());
+      if (count == 0 || !gfx_.IsOpen()) {
+        return 0;
+      }
+      EnsureDepthBuffer();
+      deferred_draw_.clear();
+      SortDeferred(deferred_opaque_, false);
+      SortDeferred(deferred_translucent_, true);
+      RasterizeDeferred();
+      deferred_opaque_.clear();
+      deferred_translucent_.clear();
+      return count;
+    }
 
     void Camera(int x, int y, int z) {
       cam_ = Vec3{static_cast<double>(x), static_cast<double>(y),
                   static_cast<double>(z)};
+      UpdateView();
     }
 
     void CameraMove(int dx, int dy, int dz) {
       cam_.x += static_cast<double>(dx);
       cam_.y += static_cast<double>(dy);
       cam_.z += static_cast<double>(dz);
+      UpdateView();
     }
 
     int CameraX() const { return static_cast<int>(std::lround(cam_.x)); }
@@ -3036,17 +6230,20 @@ class VM {
     void Rotate(int x_deg, int y_deg, int z_deg) {
       rot_deg_ = Vec3{static_cast<double>(x_deg), static_cast<double>(y_deg),
                       static_cast<double>(z_deg)};
+      UpdateModel();
     }
 
     void RotateAdd(int dx_deg, int dy_deg, int dz_deg) {
       rot_deg_.x += static_cast<double>(dx_deg);
       rot_deg_.y += static_cast<double>(dy_deg);
       rot_deg_.z += static_cast<double>(dz_deg);
+      UpdateModel();
     }
 
     void Translate(int x, int y, int z) {
       trans_ = Vec3{static_cast<double>(x), static_cast<double>(y),
                     static_cast<double>(z)};
+      UpdateModel();
     }
 
     void Scale(int sx, int sy, int sz) {
@@ -3056,6 +6253,7 @@ class VM {
       scale_ = Vec3{static_cast<double>(sx) / 1000.0,
                     static_cast<double>(sy) / 1000.0,
                     static_cast<double>(sz) / 1000.0};
+      UpdateModel();
     }
 
     void ScaleUniform(int s) {
@@ -3196,9 +6394,10 @@ class VM {
           gfx_.GetSpriteAsset(sprite_id, "gx3d.sprite_billboard");
       Vec3 w = ApplyTransform(
           Vec3{static_cast<double>(x), static_cast<double>(y), static_cast<double>(z)});
-      const double rel_x = w.x - cam_.x;
-      const double rel_y = w.y - cam_.y;
-      const double rel_z = w.z - cam_.z;
+      const Vec3 eye = EyePosition(w);
+      const double rel_x = eye.x;
+      const double rel_y = eye.y;
+      const double rel_z = eye.z;
       if (rel_z <= near_clip_ || rel_z >= far_clip_) {
         return;
       }
@@ -3247,17 +6446,17 @@ class VM {
       }
 
       const double h = static_cast<double>(size) / 2.0;
+      if (CullBox(Vec3{-h, -h, -h}, Vec3{h, h, h}, IntVec(cx, cy, cz))) {
+        return;
+      }
       std::array<Vec3, 8> verts = {
           Vec3{-h, -h, -h}, Vec3{h, -h, -h},  Vec3{h, h, -h},  Vec3{-h, h, -h},
           Vec3{-h, -h, h},  Vec3{h, -h, h},   Vec3{h, h, h},   Vec3{-h, h, h},
       };
 
-      for (Vec3& v : verts) {
-        v = ApplyTransform(v);
-        v.x += static_cast<double>(cx);
-        v.y += static_cast<double>(cy);
-        v.z += static_cast<double>(cz);
-      }
+      ApplyTransform(verts.data(), verts.size(),
+                     Vec3{static_cast<double>(cx), static_cast<double>(cy),
+                          static_cast<double>(cz)});
 
       static const std::array<std::pair<int, int>, 12> edges = {
           std::pair<int, int>{0, 1}, {1, 2}, {2, 3}, {3, 0},
@@ -3284,17 +6483,17 @@ class VM {
       const double hx = static_cast<double>(sx) / 2.0;
       const double hy = static_cast<double>(sy) / 2.0;
       const double hz = static_cast<double>(sz) / 2.0;
+      if (CullBox(Vec3{-hx, -hy, -hz}, Vec3{hx, hy, hz}, IntVec(cx, cy, cz))) {
+        return;
+      }
       std::array<Vec3, 8> verts = {
           Vec3{-hx, -hy, -hz}, Vec3{hx, -hy, -hz},  Vec3{hx, hy, -hz},
           Vec3{-hx, hy, -hz},  Vec3{-hx, -hy, hz},  Vec3{hx, -hy, hz},
           Vec3{hx, hy, hz},    Vec3{-hx, hy, hz},
       };
-      for (Vec3& v : verts) {
-        v = ApplyTransform(v);
-        v.x += static_cast<double>(cx);
-        v.y += static_cast<double>(cy);
-        v.z += static_cast<double>(cz);
-      }
+      ApplyTransform(verts.data(), verts.size(),
+                     Vec3{static_cast<double>(cx), static_cast<double>(cy),
+                          static_cast<double>(cz)});
       static const std::array<std::pair<int, int>, 12> edges = {
           std::pair<int, int>{0, 1}, {1, 2}, {2, 3}, {3, 0},
           {4, 5},                    {5, 6}, {6, 7}, {7, 4},
@@ -3323,16 +6522,16 @@ class VM {
         return;
       }
       const double h = static_cast<double>(size) / 2.0;
+      if (CullBox(Vec3{-h, -h, -h}, Vec3{h, h, h}, IntVec(cx, cy, cz))) {
+        return;
+      }
       std::array<Vec3, 5> verts = {
           Vec3{-h, -h, -h}, Vec3{h, -h, -h}, Vec3{h, -h, h},
           Vec3{-h, -h, h},  Vec3{0.0, h, 0.0},
       };
-      for (Vec3& v : verts) {
-        v = ApplyTransform(v);
-        v.x += static_cast<double>(cx);
-        v.y += static_cast<double>(cy);
-        v.z += static_cast<double>(cz);
-      }
+      ApplyTransform(verts.data(), verts.size(),
+                     Vec3{static_cast<double>(cx), static_cast<double>(cy),
+                          static_cast<double>(cz)});
 
       static const std::array<std::pair<int, int>, 8> edges = {
           std::pair<int, int>{0, 1}, {1, 2}, {2, 3}, {3, 0},
@@ -3359,18 +6558,18 @@ class VM {
       const double hx = static_cast<double>(sx) / 2.0;
       const double hy = static_cast<double>(sy) / 2.0;
       const double hz = static_cast<double>(sz) / 2.0;
+      if (CullBox(Vec3{-hx, -hy, -hz}, Vec3{hx, hy, hz}, IntVec(cx, cy, cz), true)) {
+        return;
+      }
       std::array<Vec3, 8> verts = {
           Vec3{-hx, -hy, -hz}, Vec3{hx, -hy, -hz},  Vec3{hx, hy, -hz},
           Vec3{-hx, hy, -hz},  Vec3{-hx, -hy, hz},  Vec3{hx, -hy, hz},
           Vec3{hx, hy, hz},    Vec3{-hx, hy, hz},
       };
 
-      for (Vec3& v : verts) {
-        v = ApplyTransform(v);
-        v.x += static_cast<double>(cx);
-        v.y += static_cast<double>(cy);
-        v.z += static_cast<double>(cz);
-      }
+      ApplyTransform(verts.data(), verts.size(),
+                     Vec3{static_cast<double>(cx), static_cast<double>(cy),
+                          static_cast<double>(cz)});
 
       static const std::array<std::array<int, 4>, 6> faces = {{
           {0, 1, 2, 3},
@@ -3466,36 +6665,51 @@ class VM {
         segments = 64;
       }
       const double pi = 3.14159265358979323846;
+      const Vec3 origin{static_cast<double>(cx), static_cast<double>(cy),
+                        static_cast<double>(cz)};
+      const double rad_box = static_cast<double>(radius);
+      if (CullBox(Vec3{-rad_box, -rad_box, -rad_box},
+                  Vec3{rad_box, rad_box, rad_box}, origin)) {
+        return;
+      }
       auto draw_local_line = [&](const Vec3& a, const Vec3& c) {
-        Vec3 ta = ApplyTransform(a);
-        Vec3 tc = ApplyTransform(c);
-        ta.x += static_cast<double>(cx);
-        ta.y += static_cast<double>(cy);
-        ta.z += static_cast<double>(cz);
-        tc.x += static_cast<double>(cx);
-        tc.y += static_cast<double>(cy);
-        tc.z += static_cast<double>(cz);
-        auto p1 = Project(ta);
-        auto p2 = Project(tc);
+        Vec3 ends[2] = {a, c};
+        ApplyTransform(ends, 2, origin);
+        auto p1 = Project(ends[0]);
+        auto p2 = Project(ends[1]);
         if (p1.has_value() && p2.has_value()) {
           gfx_.Line(p1->first, p1->second, p2->first, p2->second, ClampColor(r),
                     ClampColor(g), ClampColor(b));
         }
       };
-      for (int lat = 1; lat < segments; ++lat) {
-        const double t = static_cast<double>(lat) / static_cast<double>(segments);
+      // Ring and arc angles are shared by every line, so their sines and
+      // cosines are computed once per call.
+      std::array<double, 65> lon_cos{};
+      std::array<double, 65> lon_sin{};
+      std::array<double, 65> lat_cos{};
+      std::array<double, 65> lat_sin{};
+      for (int i = 0; i <= segments; ++i) {
+        const double a = (2.0 * pi * static_cast<double>(i)) /
+                         static_cast<double>(segments);
+        const double t = static_cast<double>(i) / static_cast<double>(segments);
         const double phi = -pi / 2.0 + pi * t;
-        const double y = std::sin(phi) * static_cast<double>(radius);
-        const double rr = std::cos(phi) * static_cast<double>(radius);
+        const std::size_t k = static_cast<std::size_t>(i);
+        lon_cos[k] = std::cos(a);
+        lon_sin[k] = std::sin(a);
+        lat_cos[k] = std::cos(phi);
+        lat_sin[k] = std::sin(phi);
+      }
+      const double rad = static_cast<double>(radius);
+      for (int lat = 1; lat < segments; ++lat) {
+        const double y = lat_sin[static_cast<std::size_t>(lat)] * rad;
+        const double rr = lat_cos[static_cast<std::size_t>(lat)] * rad;
         for (int lon = 0; lon < segments; ++lon) {
-          const double a0 = (2.0 * pi * static_cast<double>(lon)) /
-                            static_cast<double>(segments);
-          const double a1 = (2.0 * pi * static_cast<double>(lon + 1)) /
-                            static_cast<double>(segments);
-          const int x0 = static_cast<int>(std::round(std::cos(a0) * rr));
-          const int z0 = static_cast<int>(std::round(std::sin(a0) * rr));
-          const int x1 = static_cast<int>(std::round(std::cos(a1) * rr));
-          const int z1 = static_cast<int>(std::round(std::sin(a1) * rr));
+          const std::size_t k0 = static_cast<std::size_t>(lon);
+          const std::size_t k1 = k0 + 1;
+          const int x0 = static_cast<int>(std::round(lon_cos[k0] * rr));
+          const int z0 = static_cast<int>(std::round(lon_sin[k0] * rr));
+          const int x1 = static_cast<int>(std::round(lon_cos[k1] * rr));
+          const int z1 = static_cast<int>(std::round(lon_sin[k1] * rr));
           draw_local_line(
               Vec3{static_cast<double>(x0), y, static_cast<double>(z0)},
               Vec3{static_cast<double>(x1), y, static_cast<double>(z1)});
@@ -3503,20 +6717,18 @@ class VM {
       }
       // Longitudinal arcs
       for (int lon = 0; lon < segments; ++lon) {
-        const double a = (2.0 * pi * static_cast<double>(lon)) /
-                         static_cast<double>(segments);
+        const double ca = lon_cos[static_cast<std::size_t>(lon)];
+        const double sa = lon_sin[static_cast<std::size_t>(lon)];
         int prev_x = 0;
         int prev_y = 0;
         int prev_z = 0;
         bool has_prev = false;
         for (int lat = 0; lat <= segments; ++lat) {
-          const double t = static_cast<double>(lat) / static_cast<double>(segments);
-          const double phi = -pi / 2.0 + pi * t;
-          const double rr = std::cos(phi) * static_cast<double>(radius);
-          const int x = static_cast<int>(std::round(std::cos(a) * rr));
-          const int y = static_cast<int>(std::round(std::sin(phi) *
-                                                    static_cast<double>(radius)));
-          const int z = static_cast<int>(std::round(std::sin(a) * rr));
+          const double rr = lat_cos[static_cast<std::size_t>(lat)] * rad;
+          const int x = static_cast<int>(std::round(ca * rr));
+          const int y = static_cast<int>(
+              std::round(lat_sin[static_cast<std::size_t>(lat)] * rad));
+          const int z = static_cast<int>(std::round(sa * rr));
           if (has_prev) {
             draw_local_line(
                 Vec3{static_cast<double>(prev_x), static_cast<double>(prev_y),
@@ -3540,16 +6752,16 @@ class VM {
       EnsureDepthBuffer();
 
       const double h = static_cast<double>(size) / 2.0;
+      if (CullBox(Vec3{-h, -h, -h}, Vec3{h, h, h}, IntVec(cx, cy, cz), true)) {
+        return;
+      }
       std::array<Vec3, 5> verts = {
           Vec3{-h, -h, -h}, Vec3{h, -h, -h}, Vec3{h, -h, h},
           Vec3{-h, -h, h},  Vec3{0.0, h, 0.0},
       };
-      for (Vec3& v : verts) {
-        v = ApplyTransform(v);
-        v.x += static_cast<double>(cx);
-        v.y += static_cast<double>(cy);
-        v.z += static_cast<double>(cz);
-      }
+      ApplyTransform(verts.data(), verts.size(),
+                     Vec3{static_cast<double>(cx), static_cast<double>(cy),
+                          static_cast<double>(cz)});
 
       static const std::array<std::array<int, 3>, 6> faces = {{
           {0, 1, 4},
@@ -3598,17 +6810,17 @@ class VM {
       const double hx = static_cast<double>(sx) / 2.0;
       const double hy = static_cast<double>(sy) / 2.0;
       const double hz = static_cast<double>(sz) / 2.0;
+      if (CullBox(Vec3{-hx, -hy, -hz}, Vec3{hx, hy, hz}, IntVec(cx, cy, cz), true)) {
+        return;
+      }
       std::array<Vec3, 8> verts = {
           Vec3{-hx, -hy, -hz}, Vec3{hx, -hy, -hz},  Vec3{hx, hy, -hz},
           Vec3{-hx, hy, -hz},  Vec3{-hx, -hy, hz},  Vec3{hx, -hy, hz},
           Vec3{hx, hy, hz},    Vec3{-hx, hy, hz},
       };
-      for (Vec3& v : verts) {
-        v = ApplyTransform(v);
-        v.x += static_cast<double>(cx);
-        v.y += static_cast<double>(cy);
-        v.z += static_cast<double>(cz);
-      }
+      ApplyTransform(verts.data(), verts.size(),
+                     Vec3{static_cast<double>(cx), static_cast<double>(cy),
+                          static_cast<double>(cz)});
 
       static const std::array<std::array<int, 4>, 6> faces = {{
           {0, 1, 2, 3},
@@ -3633,7 +6845,7 @@ class VM {
             verts[static_cast<std::size_t>(f[2])],
             verts[static_cast<std::size_t>(f[3])], uv[0].first, uv[0].second,
             uv[1].first, uv[1].second, uv[2].first, uv[2].second, uv[3].first,
-            uv[3].second, spr);
+            uv[3].second, spr, sprite_id);
       }
     }
 
@@ -3658,90 +6870,638 @@ class VM {
       }
     }
 
+    // Retained meshes: triangles are staged with MeshAddTri/MeshAddQuad and
+    // MeshUpload packs them into shared vertices plus an index list, so one
+    // MeshDraw transforms and projects every vertex once for all of its
+    // triangles. Draws use the uploaded data until the next upload.
+    int MeshCreate() {
+      meshes_.emplace_back();
+      return static_cast<int>(meshes_.size() - 1);
+    }
+
+    void MeshClear(int mesh_id) {
+      Mesh& mesh = GetMesh(mesh_id, "gx3d.mesh_clear");
+      mesh.staged.clear();
+      mesh.staged_colors.clear();
+    }
+
+    void MeshAddTri(int mesh_id, int x1, int y1, int z1, int x2, int y2, int z2,
+                    int x3, int y3, int z3, int r, int g, int b) {
+      Mesh& mesh = GetMesh(mesh_id, "gx3d.mesh_add_tri");
+      mesh.staged.push_back(MeshKey{x1, y1, z1});
+      mesh.staged.push_back(MeshKey{x2, y2, z2});
+      mesh.staged.push_back(MeshKey{x3, y3, z3});
+      mesh.staged_colors.push_back(Pixel{ClampColor(r), ClampColor(g), ClampColor(b)});
+    }
+
+    // Split like QuadSolid: (1, 2, 3) and (1, 3, 4).
+    void MeshAddQuad(int mesh_id, int x1, int y1, int z1, int x2, int y2, int z2,
+                     int x3, int y3, int z3, int x4, int y4, int z4, int r,
+                     int g, int b) {
+      MeshAddTri(mesh_id, x1, y1, z1, x2, y2, z2, x3, y3, z3, r, g, b);
+      MeshAddTri(mesh_id, x1, y1, z1, x3, y3, z3, x4, y4, z4, r, g, b);
+    }
+
+    // Returns the number of unique vertices.
+    int MeshUpload(int mesh_id) {
+      Mesh& mesh = GetMesh(mesh_id, "gx3d.mesh_upload");
+      mesh.vertices.clear();
+      mesh.indices.clear();
+      mesh.indices.reserve(mesh.staged.size());
+      std::unordered_map<MeshKey, std::uint32_t, MeshKeyHash> index_of;
+      index_of.reserve(mesh.staged.size());
+      for (const MeshKey& k : mesh.staged) {
+        auto [it, inserted] =
+            index_of.emplace(k, static_cast<std::uint32_t>(mesh.vertices.size()));
+        if (inserted) {
+          mesh.vertices.push_back(Vec3{static_cast<double>(k.x),
+                                       static_cast<double>(k.y),
+                                       static_cast<double>(k.z)});
+        }
+        mesh.indices.push_back(it->second);
+      }
+      mesh.colors = mesh.staged_colors;
+      mesh.bounds_lo = Vec3{};
+      mesh.bounds_hi = Vec3{};
+      for (std::size_t i = 0; i < mesh.vertices.size(); ++i) {
+        const Vec3& v = mesh.vertices[i];
+        if (i == 0) {
+          mesh.bounds_lo = v;
+          mesh.bounds_hi = v;
+          continue;
+        }
+        mesh.bounds_lo = Vec3{std::min(mesh.bounds_lo.x, v.x),
+                              std::min(mesh.bounds_lo.y, v.y),
+                              std::min(mesh.bounds_lo.z, v.z)};
+        mesh.bounds_hi = Vec3{std::max(mesh.bounds_hi.x, v.x),
+                              std::max(mesh.bounds_hi.y, v.y),
+                              std::max(mesh.bounds_hi.z, v.z)};
+      }
+      return static_cast<int>(mesh.vertices.size());
+    }
+
+    int MeshTriangleCount(int mesh_id) {
+      return static_cast<int>(GetMesh(mesh_id, "gx3d.mesh_tri_count").colors.size());
+    }
+
+    // Same result as drawing each triangle with gx3d.triangle_solid.
+    void MeshDraw(int mesh_id) {
+      RequireGfx("gx3d.mesh_draw");
+      const Mesh& mesh = GetMesh(mesh_id, "gx3d.mesh_draw");
+      if (mesh.indices.empty()) {
+        return;
+      }
+      EnsureDepthBuffer();
+      if (CullBox(mesh.bounds_lo, mesh.bounds_hi, Vec3{}, true)) {
+        return;
+      }
+      const std::size_t n = mesh.vertices.size();
+      mesh_world_.assign(mesh.vertices.begin(), mesh.vertices.end());
+      ApplyTransform(mesh_world_.data(), n, Vec3{});
+      // Vertices inside the clip volume are projected once; triangles with
+      // a vertex outside go through the clipper.
+      mesh_screen_.resize(n);
+      mesh_state_.resize(n);
+      for (std::size_t i = 0; i < n; ++i) {
+        mesh_state_[i] = static_cast<std::uint8_t>(ClipCode(mesh_world_[i]));
+        if (mesh_state_[i] == 0) {
+          mesh_screen_[i] = ProjectClipped(mesh_world_[i]);
+        }
+      }
+      for (std::size_t t = 0; t < mesh.colors.size(); ++t) {
+        const std::uint32_t ia = mesh.indices[t * 3];
+        const std::uint32_t ib = mesh.indices[t * 3 + 1];
+        const std::uint32_t ic = mesh.indices[t * 3 + 2];
+        const Pixel& c = mesh.colors[t];
+        if ((mesh_state_[ia] & mesh_state_[ib] & mesh_state_[ic]) != 0) {
+          continue;
+        }
+        if ((mesh_state_[ia] | mesh_state_[ib] | mesh_state_[ic]) != 0) {
+          DrawSolidPolygonClipped({mesh_world_[ia], mesh_world_[ib], mesh_world_[ic]},
+                                  c.r, c.g, c.b);
+          continue;
+        }
+        const ScreenVertex& a = mesh_screen_[ia];
+        const ScreenVertex& b = mesh_screen_[ib];
+        const ScreenVertex& cv = mesh_screen_[ic];
+        if (backface_cull_ && IsBackface(a, b, cv)) {
+          continue;
+        }
+        EmitTriangle(a, b, cv, c.r, c.g, c.b);
+      }
+    }
+
+    // Voxel volumes: one material byte per cell (0 = empty), meshed per
+    // kVoxelChunk^3 chunk. Faces between two solid cells are dropped and
+    // coplanar color faces of one material are merged greedily; textured
+    // faces stay one per cell so the sprite is not stretched. VoxelSet only
+    // marks the touched chunks (and neighbours across a chunk border) dirty,
+    // and VoxelDraw rebuilds those before drawing.
+    int VoxelCreate(int w, int h, int d) {
+      if (w <= 0 || h <= 0 || d <= 0 || w > 1024 || h > 1024 || d > 1024 ||
+          static_cast<long long>(w) * h * d > (1LL << 26)) {
+        throw std::runtime_error(
+            "gx3d.voxel_create expects sizes 1..1024 and at most 64M cells");
+      }
+      VoxelVolume vol;
+      vol.w = w;
+      vol.h = h;
+      vol.d = d;
+      vol.cells.assign(static_cast<std::size_t>(w) * h * d, 0);
+      vol.chunks_x = (w + kVoxelChunk - 1) / kVoxelChunk;
+      vol.chunks_y = (h + kVoxelChunk - 1) / kVoxelChunk;
+      vol.chunks_z = (d + kVoxelChunk - 1) / kVoxelChunk;
+      vol.chunks.resize(static_cast<std::size_t>(vol.chunks_x) * vol.chunks_y *
+                        vol.chunks_z);
+      voxels_.push_back(std::move(vol));
+      return static_cast<int>(voxels_.size() - 1);
+    }
+
+    void VoxelMaterial(int vol_id, int material, int r, int g, int b) {
+      VoxelVolume& vol = GetVoxels(vol_id, "gx3d.voxel_material");
+      VoxelMaterialDef& def = vol.materials[CheckVoxelMaterial(material, "gx3d.voxel_material")];
+      def.color = Pixel{ClampColor(r), ClampColor(g), ClampColor(b)};
+      def.sprite = -1;
+      MarkAllVoxelChunksDirty(vol);
+    }
+
+    void VoxelMaterialSprite(int vol_id, int material, int sprite_id) {
+      VoxelVolume& vol = GetVoxels(vol_id, "gx3d.voxel_material_sprite");
+      (void)gfx_.GetSpriteAsset(sprite_id, "gx3d.voxel_material_sprite");
+      vol.materials[CheckVoxelMaterial(material, "gx3d.voxel_material_sprite")]
+          .sprite = sprite_id;
+      MarkAllVoxelChunksDirty(vol);
+    }
+
+    void VoxelSet(int vol_id, int x, int y, int z, int material) {
+      VoxelVolume& vol = GetVoxels(vol_id, "gx3d.voxel_set");
+      const std::uint8_t m =
+          static_cast<std::uint8_t>(CheckVoxelMaterial(material, "gx3d.voxel_set"));
+      if (x < 0 || y < 0 || z < 0 || x >= vol.w || y >= vol.h || z >= vol.d) {
+        return;
+      }
+      std::uint8_t& cell = vol.cells[vol.Index(x, y, z)];
+      if (cell == m) {
+        return;
+      }
+      cell = m;
+      const int cx = x / kVoxelChunk;
+      const int cy = y / kVoxelChunk;
+      const int cz = z / kVoxelChunk;
+      MarkVoxelChunkDirty(vol, cx, cy, cz);
+      const int lx = x % kVoxelChunk;
+      const int ly = y % kVoxelChunk;
+      const int lz = z % kVoxelChunk;
+      if (lx == 0) MarkVoxelChunkDirty(vol, cx - 1, cy, cz);
+      if (lx == kVoxelChunk - 1) MarkVoxelChunkDirty(vol, cx + 1, cy, cz);
+      if (ly == 0) MarkVoxelChunkDirty(vol, cx, cy - 1, cz);
+      if (ly == kVoxelChunk - 1) MarkVoxelChunkDirty(vol, cx, cy + 1, cz);
+      if (lz == 0) MarkVoxelChunkDirty(vol, cx, cy, cz - 1);
+      if (lz == kVoxelChunk - 1) MarkVoxelChunkDirty(vol, cx, cy, cz + 1);
+    }
+
+    int VoxelGet(int vol_id, int x, int y, int z) {
+      const VoxelVolume& vol = GetVoxels(vol_id, "gx3d.voxel_get");
+      if (x < 0 || y < 0 || z < 0 || x >= vol.w || y >= vol.h || z >= vol.d) {
+        return 0;
+      }
+      return vol.cells[vol.Index(x, y, z)];
+    }
+
+    // Draws the volume with its (0, 0, 0) cell corner at (x, y, z) and
+    // `size` world units per cell; like mesh_draw, the whole volume goes
+    // through the current gx3d transform.
+    // Color faces are shaded by direction (top brightest, bottom darkest).
+    // Returns the number of quads drawn.
+    int VoxelDraw(int vol_id, int x, int y, int z, int size) {
+      RequireGfx("gx3d.voxel_draw");
+      VoxelVolume& vol = GetVoxels(vol_id, "gx3d.voxel_draw");
+      if (size <= 0) {
+        return 0;
+      }
+      EnsureDepthBuffer();
+      static const int kFaceShade[6] = {200, 170, 255, 130, 185, 215};
+      const Vec3 origin{static_cast<double>(x), static_cast<double>(y),
+                        static_cast<double>(z)};
+      const double unit = static_cast<double>(size);
+      const double span = unit * kVoxelChunk;
+      // Chunks go front to back so near terrain fills the depth tiles
+      // before the chunks it hides are tested against them.
+      voxel_order_.clear();
+      for (int cz = 0; cz < vol.chunks_z; ++cz) {
+        for (int cy = 0; cy < vol.chunks_y; ++cy) {
+          for (int cx = 0; cx < vol.chunks_x; ++cx) {
+            VoxelChunk& chunk = vol.chunks[vol.ChunkIndex(cx, cy, cz)];
+            if (chunk.dirty) {
+              BuildVoxelChunk(vol, cx, cy, cz, chunk);
+            }
+            if (chunk.quads.empty()) {
+              continue;
+            }
+            const Vec3 center = EyePosition(ApplyTransform(
+                Vec3{origin.x + span * (cx + 0.5), origin.y + span * (cy + 0.5),
+                     origin.z + span * (cz + 0.5)}));
+            voxel_order_.emplace_back(
+                center.x * center.x + center.y * center.y + center.z * center.z,
+                static_cast<int>(vol.ChunkIndex(cx, cy, cz)));
+          }
+        }
+      }
+      std::sort(voxel_order_.begin(), voxel_order_.end());
+      int drawn = 0;
+      for (const auto& entry : voxel_order_) {
+        const int ci = entry.second;
+        const int cx = ci % vol.chunks_x;
+        const int cy = (ci / vol.chunks_x) % vol.chunks_y;
+        const int cz = ci / (vol.chunks_x * vol.chunks_y);
+        const VoxelChunk& chunk = vol.chunks[static_cast<std::size_t>(ci)];
+        const Vec3 lo{origin.x + span * cx, origin.y + span * cy,
+                      origin.z + span * cz};
+        if (CullBox(lo, Vec3{lo.x + span, lo.y + span, lo.z + span}, Vec3{},
+                    true)) {
+          continue;
+        }
+        voxel_world_.resize(chunk.quads.size() * 4);
+        for (std::size_t q = 0; q < chunk.quads.size(); ++q) {
+          for (int k = 0; k < 4; ++k) {
+            const auto& c = chunk.quads[q].corner[k];
+            voxel_world_[q * 4 + static_cast<std::size_t>(k)] =
+                Vec3{origin.x + static_cast<double>(c[0]) * unit,
+                     origin.y + static_cast<double>(c[1]) * unit,
+                     origin.z + static_cast<double>(c[2]) * unit};
+          }
+        }
+        ApplyTransform(voxel_world_.data(), voxel_world_.size(), Vec3{});
+        for (std::size_t q = 0; q < chunk.quads.size(); ++q) {
+          const VoxelQuad& quad = chunk.quads[q];
+          const Vec3* v = voxel_world_.data() + q * 4;
+          const VoxelMaterialDef& mat = vol.materials[quad.material];
+          if (mat.sprite >= 0) {
+            DrawTexturedQuadClipped(
+                v[0], v[1], v[2], v[3], quad.uv[0][0], quad.uv[0][1],
+                quad.uv[1][0], quad.uv[1][1], quad.uv[2][0], quad.uv[2][1],
+                quad.uv[3][0], quad.uv[3][1],
+                gfx_.GetSpriteAsset(mat.sprite, "gx3d.voxel_draw"), mat.sprite);
+          } else {
+            const int shade = kFaceShade[quad.face];
+            DrawSolidPolygonClipped({v[0], v[1], v[2], v[3]},
+                                    (mat.color.r * shade) / 255,
+                                    (mat.color.g * shade) / 255,
+                                    (mat.color.b * shade) / 255);
+          }
+          ++drawn;
+        }
+      }
+      return drawn;
+    }
+
    private:
+    struct MeshKey {
+      int x;
+      int y;
+      int z;
+      bool operator==(const MeshKey& o) const {
+        return x == o.x && y == o.y && z == o.z;
+      }
+    };
+    struct MeshKeyHash {
+      std::size_t operator()(const MeshKey& k) const {
+        std::uint64_t h = static_cast<std::uint32_t>(k.x);
+        h = h * 0x9E3779B97F4A7C15ull ^ static_cast<std::uint32_t>(k.y);
+        h = h * 0x9E3779B97F4A7C15ull ^ static_cast<std::uint32_t>(k.z);
+        return static_cast<std::size_t>(h ^ (h >> 29));
+      }
+    };
+    struct Mesh {
+      std::vector<MeshKey> staged;
+      std::vector<Pixel> staged_colors;
+      std::vector<Vec3> vertices;
+      std::vector<std::uint32_t> indices;
+      std::vector<Pixel> colors;
+      Vec3 bounds_lo;
+      Vec3 bounds_hi;
+    };
+
+    Mesh& GetMesh(int mesh_id, const char* fn) {
+      if (mesh_id < 0 || static_cast<std::size_t>(mesh_id) >= meshes_.size()) {
+        throw std::runtime_error(std::string(fn) + " invalid mesh id: " +
+                                 std::to_string(mesh_id));
+      }
+      return meshes_[static_cast<std::size_t>(mesh_id)];
+    }
+
+    static constexpr int kVoxelChunk = 16;
+    // Faces are numbered +x, -x, +y, -y, +z, -z. Corners are in cell units
+    // relative to the volume, wound so the outside is the front face.
+    struct VoxelQuad {
+      std::array<std::array<int, 3>, 4> corner;
+      std::array<std::array<double, 2>, 4> uv;
+      std::uint8_t material;
+      std::uint8_t face;
+    };
+    struct VoxelChunk {
+      std::vector<VoxelQuad> quads;
+      bool dirty = true;
+    };
+    struct VoxelMaterialDef {
+      Pixel color{200, 200, 200};
+      int sprite = -1;
+    };
+    struct VoxelVolume {
+      int w = 0;
+      int h = 0;
+      int d = 0;
+      std::vector<std::uint8_t> cells;
+      int chunks_x = 0;
+      int chunks_y = 0;
+      int chunks_z = 0;
+      std::vector<VoxelChunk> chunks;
+      std::array<VoxelMaterialDef, 256> materials{};
+
+      std::size_t Index(int x, int y, int z) const {
+        return (static_cast<std::size_t>(z) * h + static_cast<std::size_t>(y)) * w +
+               static_cast<std::size_t>(x);
+      }
+      std::size_t ChunkIndex(int cx, int cy, int cz) const {
+        return (static_cast<std::size_t>(cz) * chunks_y + static_cast<std::size_t>(cy)) *
+                   chunks_x +
+               static_cast<std::size_t>(cx);
+      }
+      std::uint8_t At(int x, int y, int z) const {
+        if (x < 0 || y < 0 || z < 0 || x >= w || y >= h || z >= d) {
+          return 0;
+        }
+        return cells[Index(x, y, z)];
+      }
+    };
+
+    VoxelVolume& GetVoxels(int vol_id, const char* fn) {
+      if (vol_id < 0 || static_cast<std::size_t>(vol_id) >= voxels_.size()) {
+        throw std::runtime_error(std::string(fn) + " invalid voxel volume id: " +
+                                 std::to_string(vol_id));
+      }
+      return voxels_[static_cast<std::size_t>(vol_id)];
+    }
+
+    static std::size_t CheckVoxelMaterial(int material, const std::string& fn) {
+      if (material < 0 || material > 255) {
+        throw std::runtime_error(fn + " expects material 0..255");
+      }
+      return static_cast<std::size_t>(material);
+    }
+
+    static void MarkVoxelChunkDirty(VoxelVolume& vol, int cx, int cy, int cz) {
+      if (cx < 0 || cy < 0 || cz < 0 || cx >= vol.chunks_x || cy >= vol.chunks_y ||
+          cz >= vol.chunks_z) {
+        return;
+      }
+      vol.chunks[vol.ChunkIndex(cx, cy, cz)].dirty = true;
+    }
+
+    static void MarkAllVoxelChunksDirty(VoxelVolume& vol) {
+      for (VoxelChunk& chunk : vol.chunks) {
+        chunk.dirty = true;
+      }
+    }
+
+    // Greedy meshing: for each axis and direction, every slice of the chunk
+    // gets a mask of exposed faces (solid cell, empty neighbour), and runs
+    // of one color material grow into the largest rectangles first along
+    // u, then along v.
+    void BuildVoxelChunk(const VoxelVolume& vol, int cx, int cy, int cz,
+                         VoxelChunk& chunk) {
+      chunk.quads.clear();
+      chunk.dirty = false;
+      const int lo[3] = {cx * kVoxelChunk, cy * kVoxelChunk, cz * kVoxelChunk};
+      const int dims[3] = {vol.w, vol.h, vol.d};
+      int hi[3];
+      for (int a = 0; a < 3; ++a) {
+        hi[a] = std::min(dims[a], lo[a] + kVoxelChunk);
+      }
+      std::array<std::uint8_t, kVoxelChunk * kVoxelChunk> mask{};
+      for (int axis = 0; axis < 3; ++axis) {
+        const int u = (axis + 1) % 3;
+        const int v = (axis + 2) % 3;
+        const int nu = hi[u] - lo[u];
+        const int nv = hi[v] - lo[v];
+        for (int dir = 1; dir >= -1; dir -= 2) {
+          const std::uint8_t face =
+              static_cast<std::uint8_t>(axis * 2 + (dir > 0 ? 0 : 1));
+          for (int slice = lo[axis]; slice < hi[axis]; ++slice) {
+            for (int j = 0; j < nv; ++j) {
+              for (int i = 0; i < nu; ++i) {
+                int p[3];
+                p[axis] = slice;
+                p[u] = lo[u] + i;
+                p[v] = lo[v] + j;
+                const std::uint8_t m = vol.At(p[0], p[1], p[2]);
+                p[axis] += dir;
+                mask[static_cast<std::size_t>(j * nu + i)] =
+                    (m != 0 && vol.At(p[0], p[1], p[2]) == 0) ? m : 0;
+              }
+            }
+            for (int j = 0; j < nv; ++j) {
+              for (int i = 0; i < nu;) {
+                const std::uint8_t m = mask[static_cast<std::size_t>(j * nu + i)];
+                if (m == 0) {
+                  ++i;
+                  continue;
+                }
+                int run_w = 1;
+                int run_h = 1;
+                if (vol.materials[m].sprite < 0) {
+                  while (i + run_w < nu &&
+                         mask[static_cast<std::size_t>(j * nu + i + run_w)] == m) {
+                    ++run_w;
+                  }
+                  for (bool grow = true; grow && j + run_h < nv;) {
+                    for (int k = 0; k < run_w; ++k) {
+                      if (mask[static_cast<std::size_t>((j + run_h) * nu + i + k)] != m) {
+                        grow = false;
+                        break;
+                      }
+                    }
+                    if (grow) {
+                      ++run_h;
+                    }
+                  }
+                }
+                for (int jj = 0; jj < run_h; ++jj) {
+                  std::fill_n(mask.begin() + (j + jj) * nu + i, run_w, 0);
+                }
+                int base[3];
+                base[axis] = slice + (dir > 0 ? 1 : 0);
+                base[u] = lo[u] + i;
+                base[v] = lo[v] + j;
+                VoxelQuad quad{};
+                quad.material = m;
+                quad.face = face;
+                // (du, dv) span the rectangle and du x dv points along
+                // +axis; screen y is flipped, so -axis faces take the
+                // corners in reverse order to stay front-facing.
+                static const double kUv[4][2] = {
+                    {0.0, 1.0}, {1.0, 1.0}, {1.0, 0.0}, {0.0, 0.0}};
+                for (int k = 0; k < 4; ++k) {
+                  const int src = dir < 0 ? (4 - k) % 4 : k;
+                  std::array<int, 3> c = {base[0], base[1], base[2]};
+                  if (src == 1 || src == 2) {
+                    c[static_cast<std::size_t>(u)] += run_w;
+                  }
+                  if (src == 2 || src == 3) {
+                    c[static_cast<std::size_t>(v)] += run_h;
+                  }
+                  quad.corner[static_cast<std::size_t>(k)] = c;
+                  quad.uv[static_cast<std::size_t>(k)] = {kUv[src][0], kUv[src][1]};
+                }
+                chunk.quads.push_back(quad);
+                i += run_w;
+              }
+            }
+          }
+        }
+      }
+    }
+
+    // The pixel rect a fill may touch and the rasterizer scratch it uses.
+    // Immediate draws target the whole screen; EndFrame gives each bin
+    // tile its own target so tiles can fill in parallel.
+    struct FillTarget {
+      int x0 = 0;
+      int y0 = 0;
+      int x1 = 0;
+      int y1 = 0;
+      EdgeRasterizer* rast = nullptr;
+    };
+
+    struct DeferredTri {
+      std::array<ScreenVertexUv, 3> v;
+      Pixel color{0, 0, 0};
+      int sprite = -1;  // -1: flat color
+    };
+
     struct WorldVertexUv {
       Vec3 p;
       double u = 0.0;
       double v = 0.0;
     };
 
-    std::vector<Vec3> ClipPolygonNear(const std::vector<Vec3>& in) const {
-      std::vector<Vec3> out;
-      if (in.empty()) {
-        return out;
-      }
-      const double near_plane_z = cam_.z + near_clip_;
-      auto inside = [&](const Vec3& v) { return v.z >= near_plane_z; };
-      auto intersect = [&](const Vec3& a, const Vec3& b) {
-        const double dz = b.z - a.z;
-        double t = 0.0;
-        if (std::abs(dz) > 1e-12) {
-          t = (near_plane_z - a.z) / dz;
-        }
-        if (t < 0.0) t = 0.0;
-        if (t > 1.0) t = 1.0;
-        return Vec3{a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t,
-                    near_plane_z};
-      };
+    // Polygons are clipped in eye space against near and far and against a
+    // guard band kGuardBand pixels outside each screen edge; the planes are
+    // those of the homogeneous clip volume. Polygons whose vertices all lie
+    // inside the band skip clipping, so only the rare ones reaching far off
+    // screen pay for it, and no projected coordinate gets large enough to
+    // blow up the rasterizer's bounding box or edge products.
+    enum ClipPlane { kClipNear, kClipFar, kClipLeft, kClipRight, kClipTop, kClipBottom };
+    static constexpr int kClipPlanes = 6;
+    static constexpr std::size_t kMaxClipInput = 4;
+
+    // Fixed-capacity polygon used while clipping and projecting. A convex
+    // polygon gains at most one vertex per plane, so inputs of up to
+    // kMaxClipInput vertices never need the heap.
+    template <typename V>
+    struct ClipBuffer {
+      std::array<V, kMaxClipInput + kClipPlanes> items;
+      std::size_t count = 0;
+
+      void clear() { count = 0; }
+      void push_back(const V& v) { items[count++] = v; }
+      std::size_t size() const { return count; }
+      const V& back() const { return items[count - 1]; }
+      const V& operator[](std::size_t i) const { return items[i]; }
+      const V* begin() const { return items.data(); }
+      const V* end() const { return items.data() + count; }
+    };
 
-      Vec3 s = in.back();
-      bool s_in = inside(s);
-      for (const Vec3& e : in) {
-        const bool e_in = inside(e);
-        if (s_in && e_in) {
-          out.push_back(e);
-        } else if (s_in && !e_in) {
-          out.push_back(intersect(s, e));
-        } else if (!s_in && e_in) {
-          out.push_back(intersect(s, e));
-          out.push_back(e);
-        }
-        s = e;
-        s_in = e_in;
+    // Eye-space position of a world point. Clipping, projection and culling
+    // all go through view_ here, so they cannot disagree about the camera.
+    Vec3 EyePosition(const Vec3& world) const { return view_.TransformPoint(world); }
+
+    double ClipDistance(int plane, const Vec3& world) const {
+      const Vec3 eye = EyePosition(world);
+      const double x = eye.x;
+      const double y = eye.y;
+      const double z = eye.z;
+      const double gx = static_cast<double>(gfx_.Width()) / 2.0 + kGuardBand;
+      const double gy = static_cast<double>(gfx_.Height()) / 2.0 + kGuardBand;
+      switch (plane) {
+        case kClipNear:
+          return z - near_clip_;
+        case kClipFar:
+          return far_clip_ - z;
+        case kClipLeft:
+          return gx * z + x * fov_;
+        case kClipRight:
+          return gx * z - x * fov_;
+        case kClipTop:
+          return gy * z - y * fov_;
+        default:
+          return gy * z + y * fov_;
+      }
+    }
+
+    // Bit p is set when the point lies outside plane p (same tests as
+    // ClipDistance(p, world) < 0).
+    unsigned ClipCode(const Vec3& world) const {
+      const Vec3 eye = EyePosition(world);
+      const double x = eye.x * fov_;
+      const double y = eye.y * fov_;
+      const double z = eye.z;
+      const double gx = (static_cast<double>(gfx_.Width()) / 2.0 + kGuardBand) * z;
+      const double gy = (static_cast<double>(gfx_.Height()) / 2.0 + kGuardBand) * z;
+      return (z < near_clip_ ? 1u << kClipNear : 0u) |
+             (z > far_clip_ ? 1u << kClipFar : 0u) |
+             (gx + x < 0.0 ? 1u << kClipLeft : 0u) |
+             (gx - x < 0.0 ? 1u << kClipRight : 0u) |
+             (gy - y < 0.0 ? 1u << kClipTop : 0u) |
+             (gy + y < 0.0 ? 1u << kClipBottom : 0u);
+    }
+
+    static const Vec3& ClipPosition(const Vec3& v) { return v; }
+    static const Vec3& ClipPosition(const WorldVertexUv& v) { return v.p; }
+    static Vec3 ClipLerp(const Vec3& a, const Vec3& b, double t) {
+      return Vec3{a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t};
+    }
+    static WorldVertexUv ClipLerp(const WorldVertexUv& a, const WorldVertexUv& b,
+                                  double t) {
+      return WorldVertexUv{ClipLerp(a.p, b.p, t), a.u + (b.u - a.u) * t,
+                           a.v + (b.v - a.v) * t};
+    }
+
+    // Sutherland-Hodgman against the planes in `planes` (ClipCode bits),
+    // ping-ponging between poly and scratch; the result ends up in poly.
+    template <typename V>
+    void ClipPolygon(ClipBuffer<V>& poly, ClipBuffer<V>& scratch,
+                     unsigned planes) const {
+      for (int plane = 0; plane < kClipPlanes && poly.size() >= 3; ++plane) {
+        if ((planes & (1u << plane)) == 0) {
+          continue;
+        }
+        scratch.clear();
+        const V* s = &poly.back();
+        double ds = ClipDistance(plane, ClipPosition(*s));
+        for (const V& e : poly) {
+          const double de = ClipDistance(plane, ClipPosition(e));
+          if ((ds >= 0.0) != (de >= 0.0)) {
+            scratch.push_back(ClipLerp(*s, e, ds / (ds - de)));
+          }
+          if (de >= 0.0) {
+            scratch.push_back(e);
+          }
+          s = &e;
+          ds = de;
+        }
+        std::swap(poly, scratch);
       }
-      return out;
     }
 
-    std::vector<WorldVertexUv> ClipPolygonNearUv(
-        const std::vector<WorldVertexUv>& in) const {
-      std::vector<WorldVertexUv> out;
-      if (in.empty()) {
-        return out;
-      }
-      const double near_plane_z = cam_.z + near_clip_;
-      auto inside = [&](const WorldVertexUv& v) { return v.p.z >= near_plane_z; };
-      auto intersect = [&](const WorldVertexUv& a, const WorldVertexUv& b) {
-        const double dz = b.p.z - a.p.z;
-        double t = 0.0;
-        if (std::abs(dz) > 1e-12) {
-          t = (near_plane_z - a.p.z) / dz;
-        }
-        if (t < 0.0) t = 0.0;
-        if (t > 1.0) t = 1.0;
-        WorldVertexUv out_v;
-        out_v.p = Vec3{a.p.x + (b.p.x - a.p.x) * t, a.p.y + (b.p.y - a.p.y) * t,
-                       near_plane_z};
-        out_v.u = a.u + (b.u - a.u) * t;
-        out_v.v = a.v + (b.v - a.v) * t;
-        return out_v;
-      };
-
-      WorldVertexUv s = in.back();
-      bool s_in = inside(s);
-      for (const WorldVertexUv& e : in) {
-        const bool e_in = inside(e);
-        if (s_in && e_in) {
-          out.push_back(e);
-        } else if (s_in && !e_in) {
-          out.push_back(intersect(s, e));
-        } else if (!s_in && e_in) {
-          out.push_back(intersect(s, e));
-          out.push_back(e);
-        }
-        s = e;
-        s_in = e_in;
-      }
-      return out;
+    // Projects a point already inside the clip volume.
+    ScreenVertex ProjectClipped(const Vec3& world) const {
+      const Vec3 eye = EyePosition(world);
+      const double z = std::max(eye.z, near_clip_);
+      const double sx = (eye.x / z) * fov_ + static_cast<double>(gfx_.Width()) / 2.0;
+      const double sy = (-eye.y / z) * fov_ + static_cast<double>(gfx_.Height()) / 2.0;
+      return ScreenVertex{static_cast<int>(std::round(sx)),
+                          static_cast<int>(std::round(sy)), z};
     }
 
     bool IsBackface(const ScreenVertex& a, const ScreenVertex& b,
@@ -3754,26 +7514,39 @@ class VM {
       return cross <= 0;
     }
 
-    void DrawSolidPolygonClipped(const std::vector<Vec3>& poly_world, int r, int g,
+    void DrawSolidPolygonClipped(std::initializer_list<Vec3> poly_world, int r, int g,
                                  int b) {
-      std::vector<Vec3> clipped = ClipPolygonNear(poly_world);
-      if (clipped.size() < 3) {
+      unsigned all = ~0u;
+      unsigned any = 0;
+      for (const Vec3& v : poly_world) {
+        const unsigned code = ClipCode(v);
+        all &= code;
+        any |= code;
+      }
+      if (all != 0) {
         return;
       }
-      std::vector<ScreenVertex> sv;
-      sv.reserve(clipped.size());
-      for (const Vec3& v : clipped) {
-        auto p = ProjectVertex(v);
-        if (!p.has_value()) {
-          return;
-        }
-        sv.push_back(*p);
+      if (poly_world.size() > kMaxClipInput) {
+        throw std::runtime_error("gx3d polygons have at most 4 vertices");
+      }
+      ClipBuffer<Vec3> poly;
+      ClipBuffer<Vec3> scratch;
+      for (const Vec3& v : poly_world) {
+        poly.push_back(v);
+      }
+      ClipPolygon(poly, scratch, any);
+      if (poly.size() < 3) {
+        return;
+      }
+      ClipBuffer<ScreenVertex> sv;
+      for (const Vec3& v : poly) {
+        sv.push_back(ProjectClipped(v));
       }
       for (std::size_t i = 1; i + 1 < sv.size(); ++i) {
         if (backface_cull_ && IsBackface(sv[0], sv[i], sv[i + 1])) {
           continue;
         }
-        FillTriangleDepth(sv[0], sv[i], sv[i + 1], r, g, b);
+        EmitTriangle(sv[0], sv[i], sv[i + 1], r, g, b);
       }
     }
 
@@ -3781,23 +7554,29 @@ class VM {
                                  const Vec3& p3, double u0, double v0, double u1,
                                  double v1, double u2, double v2, double u3,
                                  double v3,
-                                 const GraphicsState::SpriteAsset& spr) {
-      std::vector<WorldVertexUv> poly = {
-          WorldVertexUv{p0, u0, v0}, WorldVertexUv{p1, u1, v1},
-          WorldVertexUv{p2, u2, v2}, WorldVertexUv{p3, u3, v3},
-      };
-      std::vector<WorldVertexUv> clipped = ClipPolygonNearUv(poly);
-      if (clipped.size() < 3) {
+                                 const GraphicsState::SpriteAsset& spr,
+                                 int sprite_id) {
+      const unsigned c0 = ClipCode(p0);
+      const unsigned c1 = ClipCode(p1);
+      const unsigned c2 = ClipCode(p2);
+      const unsigned c3 = ClipCode(p3);
+      if ((c0 & c1 & c2 & c3) != 0) {
         return;
       }
-      std::vector<ScreenVertexUv> sv;
-      sv.reserve(clipped.size());
-      for (const WorldVertexUv& v : clipped) {
-        auto p = ProjectVertexUv(v.p, v.u, v.v);
-        if (!p.has_value()) {
-          return;
-        }
-        sv.push_back(*p);
+      ClipBuffer<WorldVertexUv> poly;
+      ClipBuffer<WorldVertexUv> scratch;
+      poly.push_back(WorldVertexUv{p0, u0, v0});
+      poly.push_back(WorldVertexUv{p1, u1, v1});
+      poly.push_back(WorldVertexUv{p2, u2, v2});
+      poly.push_back(WorldVertexUv{p3, u3, v3});
+      ClipPolygon(poly, scratch, c0 | c1 | c2 | c3);
+      if (poly.size() < 3) {
+        return;
+      }
+      ClipBuffer<ScreenVertexUv> sv;
+      for (const WorldVertexUv& v : poly) {
+        const ScreenVertex p = ProjectClipped(v.p);
+        sv.push_back(ScreenVertexUv{p.x, p.y, p.z, v.u, v.v});
       }
       for (std::size_t i = 1; i + 1 < sv.size(); ++i) {
         if (backface_cull_) {
@@ -3808,51 +7587,254 @@ class VM {
             continue;
           }
         }
-        FillTriangleDepthTextured(sv[0], sv[i], sv[i + 1], spr);
+        EmitTriangleTextured(sv[0], sv[i], sv[i + 1], spr, sprite_id);
+      }
+    }
+
+    // Every depth-tested triangle goes through these two. Outside a
+    // begin_frame/end_frame pair they rasterize at once; inside, they only
+    // record the projected triangle for EndFrame. Callers pass the sprite
+    // they already resolved; a deferred triangle keeps only its id.
+    void EmitTriangle(const ScreenVertex& a, const ScreenVertex& b,
+                      const ScreenVertex& c, int r, int g, int bl) {
+      if (!deferred_) {
+        FillTriangleDepth(a, b, c, r, g, bl);
+        return;
+      }
+      DeferredTri t;
+      t.v = {ScreenVertexUv{a.x, a.y, a.z}, ScreenVertexUv{b.x, b.y, b.z},
+             ScreenVertexUv{c.x, c.y, c.z}};
+      t.color = Pixel{ClampColor(r), ClampColor(g), ClampColor(bl)};
+      deferred_opaque_.push_back(t);
+    }
+
+    void EmitTriangleTextured(const ScreenVertexUv& a, const ScreenVertexUv& b,
+                              const ScreenVertexUv& c,
+                              const GraphicsState::SpriteAsset& spr,
+                              int sprite_id) {
+      if (!deferred_) {
+        FillTriangleDepthTextured(a, b, c, spr);
+        return;
+      }
+      DeferredTri t;
+      t.v = {a, b, c};
+      t.sprite = sprite_id;
+      (spr.translucent ? deferred_translucent_ : deferred_opaque_).push_back(t);
+    }
+
+    // Appends tris to deferred_draw_ sorted by mean depth, nearest first
+    // (or farthest first when back_to_front); equal depths keep their
+    // recording order.
+    void SortDeferred(const std::vector<DeferredTri>& tris, bool back_to_front) {
+      deferred_order_.resize(tris.size());
+      for (std::size_t i = 0; i < tris.size(); ++i) {
+        const auto& v = tris[i].v;
+        const double z = (v[0].z + v[1].z + v[2].z) / 3.0;
+        deferred_order_[i] = {back_to_front ? -z : z, static_cast<std::uint32_t>(i)};
+      }
+      std::sort(deferred_order_.begin(), deferred_order_.end());
+      for (const auto& entry : deferred_order_) {
+        deferred_draw_.push_back(&tris[entry.second]);
+      }
+    }
+
+    // Bins deferred_draw_ into kBinTile-pixel screen tiles by bounding box,
+    // keeping draw order inside every bin, then fills the bins on the
+    // worker pool. A tile's pixels, depth and hierarchical-Z cells belong
+    // to the one task filling it, so no locks are needed, and the result
+    // does not depend on the thread count.
+    void RasterizeDeferred() {
+      const int w = gfx_.Width();
+      const int h = gfx_.Height();
+      const int cols = (w + kBinTile - 1) / kBinTile;
+      const int rows = (h + kBinTile - 1) / kBinTile;
+      const std::size_t tiles = static_cast<std::size_t>(cols * rows);
+      if (bins_.size() != tiles) {
+        bins_.assign(tiles, {});
+        bin_raster_.assign(tiles, EdgeRasterizer{});
+      }
+      for (auto& bin : bins_) {
+        bin.clear();
+      }
+      for (std::size_t i = 0; i < deferred_draw_.size(); ++i) {
+        const auto& v = deferred_draw_[i]->v;
+        const int min_x = std::max(0, std::min(v[0].x, std::min(v[1].x, v[2].x)));
+        const int min_y = std::max(0, std::min(v[0].y, std::min(v[1].y, v[2].y)));
+        const int max_x = std::min(w - 1, std::max(v[0].x, std::max(v[1].x, v[2].x)));
+        const int max_y = std::min(h - 1, std::max(v[0].y, std::max(v[1].y, v[2].y)));
+        if (min_x > max_x || min_y > max_y) {
+          continue;
+        }
+        for (int ty = min_y / kBinTile; ty <= max_y / kBinTile; ++ty) {
+          for (int tx = min_x / kBinTile; tx <= max_x / kBinTile; ++tx) {
+            bins_[static_cast<std::size_t>(ty * cols + tx)].push_back(
+                static_cast<std::uint32_t>(i));
+          }
+        }
+      }
+      auto fill_tile = [&](int tile) {
+        const std::vector<std::uint32_t>& bin = bins_[static_cast<std::size_t>(tile)];
+        if (bin.empty()) {
+          return;
+        }
+        const int tx = tile % cols;
+        const int ty = tile / cols;
+        const FillTarget target{tx * kBinTile, ty * kBinTile,
+                                std::min(w, (tx + 1) * kBinTile),
+                                std::min(h, (ty + 1) * kBinTile),
+                                &bin_raster_[static_cast<std::size_t>(tile)]};
+        for (const std::uint32_t i : bin) {
+          const DeferredTri& t = *deferred_draw_[i];
+          if (t.sprite < 0) {
+            const ScreenVertex a{t.v[0].x, t.v[0].y, t.v[0].z};
+            const ScreenVertex b{t.v[1].x, t.v[1].y, t.v[1].z};
+            const ScreenVertex c{t.v[2].x, t.v[2].y, t.v[2].z};
+            FillTriangleDepth(a, b, c, t.color.r, t.color.g, t.color.b, target);
+          } else {
+            FillTriangleDepthTextured(
+                t.v[0], t.v[1], t.v[2],
+                gfx_.GetSpriteAsset(t.sprite, "gx3d.end_frame"), target);
+          }
+        }
+      };
+      // std::ref keeps std::function from copying the closure to the heap.
+      gfx_.Workers().Run(static_cast<int>(tiles), std::ref(fill_tile));
+    }
+
+    static Vec3 IntVec(int x, int y, int z) {
+      return Vec3{static_cast<double>(x), static_cast<double>(y),
+                  static_cast<double>(z)};
+    }
+
+    // View-frustum rejection for a local box [lo, hi] placed at `offset`
+    // under the current model transform. The six planes are in eye space:
+    // near/far from gx3d.clip and four sides through the screen edges
+    // (one pixel of slack for rounding). The box's bounding sphere settles
+    // most cases; only spheres crossing a plane test the eight corners.
+    // Boxes of depth-tested draws that survive are also checked against the
+    // hierarchical-Z tiles under their screen rect. Counts the object in
+    // stats_ either way.
+    bool CullBox(const Vec3& lo, const Vec3& hi, const Vec3& offset,
+                 bool depth_tested = false) {
+      const double hw = static_cast<double>(gfx_.Width()) / 2.0 + 1.0;
+      const double hh = static_cast<double>(gfx_.Height()) / 2.0 + 1.0;
+      const double lx = std::sqrt(fov_ * fov_ + hw * hw);
+      const double ly = std::sqrt(fov_ * fov_ + hh * hh);
+      const std::array<std::array<double, 4>, 6> planes = {{
+          {0.0, 0.0, 1.0, -near_clip_},
+          {0.0, 0.0, -1.0, far_clip_},
+          {fov_ / lx, 0.0, hw / lx, 0.0},
+          {-fov_ / lx, 0.0, hw / lx, 0.0},
+          {0.0, fov_ / ly, hh / ly, 0.0},
+          {0.0, -fov_ / ly, hh / ly, 0.0},
+      }};
+      auto eye = [&](const Vec3& local) {
+        const Vec3 w = model_.TransformPoint(local);
+        return EyePosition(Vec3{w.x + offset.x, w.y + offset.y, w.z + offset.z});
+      };
+      auto dist = [](const std::array<double, 4>& p, const Vec3& v) {
+        return p[0] * v.x + p[1] * v.y + p[2] * v.z + p[3];
+      };
+
+      const Vec3 center = eye(Vec3{(lo.x + hi.x) / 2.0, (lo.y + hi.y) / 2.0,
+                                   (lo.z + hi.z) / 2.0});
+      const double ex = (hi.x - lo.x) / 2.0 * scale_.x;
+      const double ey = (hi.y - lo.y) / 2.0 * scale_.y;
+      const double ez = (hi.z - lo.z) / 2.0 * scale_.z;
+      const double radius = std::sqrt(ex * ex + ey * ey + ez * ez);
+      bool straddles = false;
+      bool outside = false;
+      for (const auto& p : planes) {
+        const double d = dist(p, center);
+        if (d < -radius) {
+          outside = true;
+          break;
+        }
+        if (d < radius) {
+          straddles = true;
+        }
+      }
+      std::array<Vec3, 8> corners;
+      const bool need_corners = !outside && (straddles || depth_tested);
+      if (need_corners) {
+        for (int i = 0; i < 8; ++i) {
+          corners[static_cast<std::size_t>(i)] =
+              eye(Vec3{(i & 1) ? hi.x : lo.x, (i & 2) ? hi.y : lo.y,
+                       (i & 4) ? hi.z : lo.z});
+        }
+      }
+      if (!outside && straddles) {
+        for (const auto& p : planes) {
+          bool all_out = true;
+          for (const Vec3& c : corners) {
+            if (dist(p, c) >= 0.0) {
+              all_out = false;
+              break;
+            }
+          }
+          if (all_out) {
+            outside = true;
+            break;
+          }
+        }
+      }
+      if (outside) {
+        ++stats_.culled;
+        return true;
+      }
+      if (depth_tested && BoxOccluded(corners)) {
+        ++stats_.occluded;
+        return true;
+      }
+      ++stats_.drawn;
+      return false;
+    }
+
+    // Eye-space corners; a box reaching the near plane is never occluded.
+    bool BoxOccluded(const std::array<Vec3, 8>& corners) {
+      double min_x = 1e30;
+      double min_y = 1e30;
+      double max_x = -1e30;
+      double max_y = -1e30;
+      double z_near = 1e30;
+      const double half_w = static_cast<double>(gfx_.Width()) / 2.0;
+      const double half_h = static_cast<double>(gfx_.Height()) / 2.0;
+      for (const Vec3& c : corners) {
+        if (c.z <= near_clip_) {
+          return false;
+        }
+        const double sx = (c.x / c.z) * fov_ + half_w;
+        const double sy = (-c.y / c.z) * fov_ + half_h;
+        min_x = std::min(min_x, sx);
+        max_x = std::max(max_x, sx);
+        min_y = std::min(min_y, sy);
+        max_y = std::max(max_y, sy);
+        z_near = std::min(z_near, c.z);
       }
+      return HizOccluded(static_cast<int>(std::floor(min_x)) - 1,
+                         static_cast<int>(std::floor(min_y)) - 1,
+                         static_cast<int>(std::ceil(max_x)) + 1,
+                         static_cast<int>(std::ceil(max_y)) + 1,
+                         z_near + depth_bias_ - 1e-9, ScreenTarget());
     }
 
-    static Vec3 RotateVec(Vec3 v, const Vec3& rot_deg) {
-      const double rx = rot_deg.x * (3.14159265358979323846 / 180.0);
-      const double ry = rot_deg.y * (3.14159265358979323846 / 180.0);
-      const double rz = rot_deg.z * (3.14159265358979323846 / 180.0);
-
-      const double cx = std::cos(rx);
-      const double sx = std::sin(rx);
-      const double cy = std::cos(ry);
-      const double sy = std::sin(ry);
-      const double cz = std::cos(rz);
-      const double sz = std::sin(rz);
-
-      // X rotation
-      double y1 = v.y * cx - v.z * sx;
-      double z1 = v.y * sx + v.z * cx;
-      v.y = y1;
-      v.z = z1;
-
-      // Y rotation
-      double x2 = v.x * cy + v.z * sy;
-      double z2 = -v.x * sy + v.z * cy;
-      v.x = x2;
-      v.z = z2;
+    // The model matrix (scale, then rotation, then translation) and the view
+    // matrix (camera offset) are rebuilt only when their inputs change, so
+    // vertex transforms never touch trig.
+    void UpdateModel() {
+      model_ = Mat4::Translation(trans_) * Mat4::RotationXyz(rot_deg_) *
+               Mat4::Scaling(scale_);
+    }
 
-      // Z rotation
-      double x3 = v.x * cz - v.y * sz;
-      double y3 = v.x * sz + v.y * cz;
-      v.x = x3;
-      v.y = y3;
-      return v;
+    void UpdateView() {
+      view_ = Mat4::Translation(Vec3{-cam_.x, -cam_.y, -cam_.z});
     }
 
-    Vec3 ApplyTransform(Vec3 v) const {
-      v.x *= scale_.x;
-      v.y *= scale_.y;
-      v.z *= scale_.z;
-      v = RotateVec(v, rot_deg_);
-      v.x += trans_.x;
-      v.y += trans_.y;
-      v.z += trans_.z;
-      return v;
+    Vec3 ApplyTransform(const Vec3& v) const { return model_.TransformPoint(v); }
+
+    // Model transform for a batch of local vertices placed at `origin`.
+    void ApplyTransform(Vec3* verts, std::size_t n, const Vec3& origin) const {
+      TransformPoints(model_, verts, n, origin);
     }
 
     std::optional<std::pair<int, int>> Project(const Vec3& world) const {
@@ -3864,9 +7846,10 @@ class VM {
     }
 
     std::optional<ScreenVertex> ProjectVertex(const Vec3& world) const {
-      const double x = world.x - cam_.x;
-      const double y = world.y - cam_.y;
-      double z = world.z - cam_.z;
+      const Vec3 eye = EyePosition(world);
+      const double x = eye.x;
+      const double y = eye.y;
+      double z = eye.z;
 
       // Reject points behind camera. Near-plane crossing points are clamped to
       // avoid face popping/flicker when objects move very close to the camera.
@@ -3895,137 +7878,314 @@ class VM {
       return ScreenVertexUv{base->x, base->y, base->z, u, v};
     }
 
+    // Depth is 32-bit float eye z. Every byte of the clear value is 0x7F
+    // (about 3.4e38), so clearing the buffer is a plain memset. Each
+    // kHizTile x kHizTile tile keeps the min and max depth inside it: max
+    // rejects triangles and boxes that lie entirely behind what is drawn,
+    // min lets spans in front of everything skip the per-pixel test.
+    // Writes only lower a tile's min and mark its max stale; HizMax()
+    // rescans a stale tile when it is next asked.
     void EnsureDepthBuffer() {
-      const std::size_t need =
-          static_cast<std::size_t>(gfx_.Width() * gfx_.Height());
+      const int w = gfx_.Width();
+      const int h = gfx_.Height();
+      const std::size_t need = static_cast<std::size_t>(w * h);
       if (depth_.size() != need) {
-        depth_.assign(need, 1e30);
-        depth_dirty_ = false;
-        return;
+        depth_.resize(need);
+        hiz_cols_ = (w + kHizTile - 1) / kHizTile;
+        hiz_rows_ = (h + kHizTile - 1) / kHizTile;
+        const std::size_t tiles = static_cast<std::size_t>(hiz_cols_ * hiz_rows_);
+        hiz_min_.resize(tiles);
+        hiz_max_.resize(tiles);
+        hiz_stale_.resize(tiles);
+        depth_dirty_ = true;
       }
       if (depth_dirty_) {
-        std::fill(depth_.begin(), depth_.end(), 1e30);
+        std::memset(depth_.data(), kDepthClearByte, depth_.size() * sizeof(float));
+        std::memset(hiz_min_.data(), kDepthClearByte, hiz_min_.size() * sizeof(float));
+        std::memset(hiz_max_.data(), kDepthClearByte, hiz_max_.size() * sizeof(float));
+        std::fill(hiz_stale_.begin(), hiz_stale_.end(), 0);
         depth_dirty_ = false;
       }
     }
 
+    float HizMax(int tx, int ty) {
+      const std::size_t t = static_cast<std::size_t>(ty * hiz_cols_ + tx);
+      if (hiz_stale_[t] != 0) {
+        const int x0 = tx * kHizTile;
+        const int y0 = ty * kHizTile;
+        const int x1 = std::min(gfx_.Width(), x0 + kHizTile);
+        const int y1 = std::min(gfx_.Height(), y0 + kHizTile);
+        const std::size_t width = static_cast<std::size_t>(gfx_.Width());
+        float m = 0.0f;
+        for (int y = y0; y < y1; ++y) {
+          const float* row = depth_.data() + static_cast<std::size_t>(y) * width;
+          for (int x = x0; x < x1; ++x) {
+            m = std::max(m, row[x]);
+          }
+        }
+        hiz_max_[t] = m;
+        hiz_stale_[t] = 0;
+      }
+      return hiz_max_[t];
+    }
+
+    // True if nothing at depth >= z_near inside the screen rect
+    // [x0, x1] x [y0, y1] can pass the depth test. Only tiles inside the
+    // target are read.
+    bool HizOccluded(int x0, int y0, int x1, int y1, double z_near,
+                     const FillTarget& target) {
+      x0 = std::max(target.x0, x0);
+      y0 = std::max(target.y0, y0);
+      x1 = std::min(target.x1 - 1, x1);
+      y1 = std::min(target.y1 - 1, y1);
+      if (x0 > x1 || y0 > y1) {
+        return true;
+      }
+      for (int ty = y0 / kHizTile; ty <= y1 / kHizTile; ++ty) {
+        for (int tx = x0 / kHizTile; tx <= x1 / kHizTile; ++tx) {
+          if (static_cast<float>(z_near) < HizMax(tx, ty)) {
+            return false;
+          }
+        }
+      }
+      return true;
+    }
+
+    bool TriangleOccluded(double ax, double ay, double az, double bx, double by,
+                          double bz, double cx, double cy, double cz,
+                          const FillTarget& target) {
+      const double z_near = std::min(az, std::min(bz, cz)) + depth_bias_ - 1e-9;
+      return HizOccluded(static_cast<int>(std::min(ax, std::min(bx, cx))),
+                         static_cast<int>(std::min(ay, std::min(by, cy))),
+                         static_cast<int>(std::max(ax, std::max(bx, cx))),
+                         static_cast<int>(std::max(ay, std::max(by, cy))), z_near,
+                         target);
+    }
+
+    // Records depth writes in the span [x_begin, x_end) of row y whose
+    // nearest written value is z_min.
+    void HizNoteSpan(int y, int x_begin, int x_end, double z_min) {
+      const std::size_t row = static_cast<std::size_t>((y / kHizTile) * hiz_cols_);
+      const float zf = static_cast<float>(z_min);
+      for (int tx = x_begin / kHizTile; tx <= (x_end - 1) / kHizTile; ++tx) {
+        const std::size_t t = row + static_cast<std::size_t>(tx);
+        hiz_min_[t] = std::min(hiz_min_[t], zf);
+        hiz_stale_[t] = 1;
+      }
+    }
+
+    // Smallest tile min over the tiles the span [x_begin, x_end) touches.
+    float HizSpanMin(int y, int x_begin, int x_end) const {
+      const std::size_t row = static_cast<std::size_t>((y / kHizTile) * hiz_cols_);
+      float m = hiz_min_[row + static_cast<std::size_t>(x_begin / kHizTile)];
+      for (int tx = x_begin / kHizTile + 1; tx <= (x_end - 1) / kHizTile; ++tx) {
+        m = std::min(m, hiz_min_[row + static_cast<std::size_t>(tx)]);
+      }
+      return m;
+    }
+
+    FillTarget ScreenTarget() {
+      return FillTarget{0, 0, gfx_.Width(), gfx_.Height(), &gfx_.triangle_raster};
+    }
+
     void FillTriangleDepth(const ScreenVertex& a, const ScreenVertex& b,
                            const ScreenVertex& c, int r, int g, int bl) {
-      int min_x = std::min(a.x, std::min(b.x, c.x));
-      int max_x = std::max(a.x, std::max(b.x, c.x));
-      int min_y = std::min(a.y, std::min(b.y, c.y));
-      int max_y = std::max(a.y, std::max(b.y, c.y));
-
-      min_x = std::max(0, min_x);
-      min_y = std::max(0, min_y);
-      max_x = std::min(gfx_.Width() - 1, max_x);
-      max_y = std::min(gfx_.Height() - 1, max_y);
-      if (min_x > max_x || min_y > max_y) {
-        return;
-      }
+      FillTriangleDepth(a, b, c, r, g, bl, ScreenTarget());
+    }
 
-      const double denom =
-          static_cast<double>((b.y - c.y) * (a.x - c.x) +
-                              (c.x - b.x) * (a.y - c.y));
-      if (std::abs(denom) < 1e-9) {
+    void FillTriangleDepth(const ScreenVertex& a, const ScreenVertex& b,
+                           const ScreenVertex& c, int r, int g, int bl,
+                           const FillTarget& target) {
+      EdgeRasterizer& rast = *target.rast;
+      if (TriangleOccluded(a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z, target) ||
+          !rast.Setup(a.x, a.y, b.x, b.y, c.x, c.y, target.x0, target.y0,
+                      target.x1, target.y1)) {
         return;
       }
-
-      for (int y = min_y; y <= max_y; ++y) {
-        for (int x = min_x; x <= max_x; ++x) {
-          const double px = static_cast<double>(x) + 0.5;
-          const double py = static_cast<double>(y) + 0.5;
-          const double w1 = ((b.y - c.y) * (px - c.x) + (c.x - b.x) * (py - c.y)) / denom;
-          const double w2 = ((c.y - a.y) * (px - c.x) + (a.x - c.x) * (py - c.y)) / denom;
-          const double w3 = 1.0 - w1 - w2;
-          const bool inside_ccw = (w1 >= 0.0 && w2 >= 0.0 && w3 >= 0.0);
-          const bool inside_cw = (w1 <= 0.0 && w2 <= 0.0 && w3 <= 0.0);
-          if (!inside_ccw && !inside_cw) {
-            continue;
+      const double z_far = std::max(a.z, std::max(b.z, c.z)) + depth_bias_;
+      // Depth is affine in screen space: evaluate it once per span from the
+      // edge weights and step it per pixel.
+      const double inv_area = 1.0 / static_cast<double>(rast.Area());
+      const double dzdx = (static_cast<double>(rast.StepX(0)) * a.z +
+                           static_cast<double>(rast.StepX(1)) * b.z +
+                           static_cast<double>(rast.StepX(2)) * c.z) *
+                          inv_area;
+      const std::uint32_t color =
+          PackPixel(ClampColor(r), ClampColor(g), ClampColor(bl));
+      const std::size_t width = static_cast<std::size_t>(gfx_.Width());
+      rast.Run([&](int y, int x_begin, int x_end, const std::int64_t* w) {
+        double z = (static_cast<double>(w[0]) * a.z +
+                    static_cast<double>(w[1]) * b.z +
+                    static_cast<double>(w[2]) * c.z) *
+                       inv_area +
+                   depth_bias_;
+        const std::size_t row = static_cast<std::size_t>(y) * width;
+        float* depth = depth_.data() + row;
+        std::uint32_t* out = gfx_.pixels.data() + row;
+        const double z_first = z;
+        const double z_last = z + dzdx * static_cast<double>(x_end - 1 - x_begin);
+        if (static_cast<float>(z_far + 1e-6) < HizSpanMin(y, x_begin, x_end)) {
+          // The whole triangle is in front of everything in these tiles.
+          for (int x = x_begin; x < x_end; ++x, z += dzdx) {
+            depth[x] = static_cast<float>(z);
+            out[x] = color;
           }
-
-          const double z = (w1 * a.z + w2 * b.z + w3 * c.z) + depth_bias_;
-          const std::size_t idx =
-              static_cast<std::size_t>(y * gfx_.Width() + x);
-          if (z < (depth_[idx] - 1e-6)) {
-            depth_[idx] = z;
-            gfx_.PixelAtFast(x, y, r, g, bl);
+          HizNoteSpan(y, x_begin, x_end, std::min(z_first, z_last));
+          return;
+        }
+        bool wrote = false;
+        for (int x = x_begin; x < x_end; ++x, z += dzdx) {
+          const float zf = static_cast<float>(z);
+          if (zf < depth[x]) {
+            depth[x] = zf;
+            out[x] = color;
+            wrote = true;
           }
         }
-      }
+        if (wrote) {
+          HizNoteSpan(y, x_begin, x_end, std::min(z_first, z_last));
+        }
+      });
     }
 
     void FillTriangleDepthTextured(const ScreenVertexUv& a,
                                    const ScreenVertexUv& b,
                                    const ScreenVertexUv& c,
                                    const GraphicsState::SpriteAsset& spr) {
-      int min_x = std::min(a.x, std::min(b.x, c.x));
-      int max_x = std::max(a.x, std::max(b.x, c.x));
-      int min_y = std::min(a.y, std::min(b.y, c.y));
-      int max_y = std::max(a.y, std::max(b.y, c.y));
-
-      min_x = std::max(0, min_x);
-      min_y = std::max(0, min_y);
-      max_x = std::min(gfx_.Width() - 1, max_x);
-      max_y = std::min(gfx_.Height() - 1, max_y);
-      if (min_x > max_x || min_y > max_y) {
-        return;
-      }
+      FillTriangleDepthTextured(a, b, c, spr, ScreenTarget());
+    }
 
-      const double denom =
-          static_cast<double>((b.y - c.y) * (a.x - c.x) +
-                              (c.x - b.x) * (a.y - c.y));
-      if (std::abs(denom) < 1e-9) {
+    void FillTriangleDepthTextured(const ScreenVertexUv& a,
+                                   const ScreenVertexUv& b,
+                                   const ScreenVertexUv& c,
+                                   const GraphicsState::SpriteAsset& spr,
+                                   const FillTarget& target) {
+      EdgeRasterizer& rast = *target.rast;
+      if (TriangleOccluded(a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z, target) ||
+          !rast.Setup(a.x, a.y, b.x, b.y, c.x, c.y, target.x0, target.y0,
+                      target.x1, target.y1)) {
         return;
       }
-
-      for (int y = min_y; y <= max_y; ++y) {
-        for (int x = min_x; x <= max_x; ++x) {
-          const double px = static_cast<double>(x) + 0.5;
-          const double py = static_cast<double>(y) + 0.5;
-          const double w1 =
-              ((b.y - c.y) * (px - c.x) + (c.x - b.x) * (py - c.y)) / denom;
-          const double w2 =
-              ((c.y - a.y) * (px - c.x) + (a.x - c.x) * (py - c.y)) / denom;
-          const double w3 = 1.0 - w1 - w2;
-          const bool inside_ccw = (w1 >= 0.0 && w2 >= 0.0 && w3 >= 0.0);
-          const bool inside_cw = (w1 <= 0.0 && w2 <= 0.0 && w3 <= 0.0);
-          if (!inside_ccw && !inside_cw) {
-            continue;
-          }
-
-          const double z = (w1 * a.z + w2 * b.z + w3 * c.z) + depth_bias_;
-          const std::size_t idx =
-              static_cast<std::size_t>(y * gfx_.Width() + x);
-          if (z >= (depth_[idx] - 1e-6)) {
-            continue;
-          }
-
-          const double u = w1 * a.u + w2 * b.u + w3 * c.u;
-          const double v = w1 * a.v + w2 * b.v + w3 * c.v;
-          int tx = static_cast<int>(u * static_cast<double>(spr.width - 1));
-          int ty = static_cast<int>(v * static_cast<double>(spr.height - 1));
-          tx = std::max(0, std::min(spr.width - 1, tx));
-          ty = std::max(0, std::min(spr.height - 1, ty));
-          const auto& t = spr.texels[static_cast<std::size_t>(ty * spr.width + tx)];
-          if (t.a == 0) {
-            continue;
-          }
-          depth_[idx] = z;
-          if (t.a == 255) {
-            gfx_.PixelAtFast(x, y, static_cast<int>(t.r), static_cast<int>(t.g),
-                             static_cast<int>(t.b));
-          } else {
-            // Translucent texels blend with current framebuffer color.
-            const auto base_idx = static_cast<std::size_t>(y * gfx_.Width() + x);
-            Pixel& out = gfx_.pixels[base_idx];
-            const int a8 = static_cast<int>(t.a);
-            out.r = (static_cast<int>(t.r) * a8 + out.r * (255 - a8)) / 255;
-            out.g = (static_cast<int>(t.g) * a8 + out.g * (255 - a8)) / 255;
-            out.b = (static_cast<int>(t.b) * a8 + out.b * (255 - a8)) / 255;
-          }
+      const double inv_area = 1.0 / static_cast<double>(rast.Area());
+      auto step = [&](double qa, double qb, double qc) {
+        return (static_cast<double>(rast.StepX(0)) * qa +
+                static_cast<double>(rast.StepX(1)) * qb +
+                static_cast<double>(rast.StepX(2)) * qc) *
+               inv_area;
+      };
+      const double dzdx = step(a.z, b.z, c.z);
+      const double dudx = step(a.u, b.u, c.u);
+      const double dvdx = step(a.v, b.v, c.v);
+      // One mip level for the whole triangle: the largest texel step per
+      // pixel along x or y of the screen-affine u and v, i.e. the average
+      // footprint over the triangle.
+      const double ex1 = b.x - a.x;
+      const double ey1 = b.y - a.y;
+      const double ex2 = c.x - a.x;
+      const double ey2 = c.y - a.y;
+      const double det = ex1 * ey2 - ex2 * ey1;
+      int level = 0;
+      if (std::fabs(det) > 1e-12) {
+        const double du1 = b.u - a.u;
+        const double du2 = c.u - a.u;
+        const double dv1 = b.v - a.v;
+        const double dv2 = c.v - a.v;
+        const double dudy = (ex1 * du2 - ex2 * du1) / det;
+        const double dvdy = (ex1 * dv2 - ex2 * dv1) / det;
+        const double sw = static_cast<double>(spr.width);
+        const double sh = static_cast<double>(spr.height);
+        const double rho = std::max(std::hypot(dudx * sw, dvdx * sh),
+                                    std::hypot(dudy * sw, dvdy * sh));
+        while (level + 1 < spr.LevelCount() &&
+               rho >= static_cast<double>(2 << level)) {
+          ++level;
         }
       }
+      const GraphicsState::SpriteLevel tex = spr.Level(level);
+      const double tex_w = static_cast<double>(tex.width - 1);
+      const double tex_h = static_cast<double>(tex.height - 1);
+      // Perspective-correct texturing: 1/z and the texel coordinates over z
+      // are affine in screen space, so they step per pixel like depth. The
+      // divide back to texels happens once every kPerspectiveRun pixels;
+      // in between, 16.16 fixed-point texel coordinates step linearly.
+      const double iza = 1.0 / std::max(a.z, 1e-6);
+      const double izb = 1.0 / std::max(b.z, 1e-6);
+      const double izc = 1.0 / std::max(c.z, 1e-6);
+      const double sua = a.u * tex_w * iza;
+      const double sub = b.u * tex_w * izb;
+      const double suc = c.u * tex_w * izc;
+      const double sva = a.v * tex_h * iza;
+      const double svb = b.v * tex_h * izb;
+      const double svc = c.v * tex_h * izc;
+      const double dizdx = step(iza, izb, izc);
+      const double dsudx = step(sua, sub, suc);
+      const double dsvdx = step(sva, svb, svc);
+      // Run ends are clamped to [1/65536, last texel + kTexelEdge]. The
+      // steps truncate toward zero, so they never overshoot the far end by
+      // a whole fixed-point unit, and every texel in between is inside the
+      // texture.
+      const double lo = 1.0 / 65536.0;
+      const double u_max = tex_w + kTexelEdge;
+      const double v_max = tex_h + kTexelEdge;
+      auto fixed = [](double texel) { return static_cast<std::int32_t>(texel * 65536.0); };
+      const std::size_t width = static_cast<std::size_t>(gfx_.Width());
+      rast.Run([&](int y, int x_begin, int x_end, const std::int64_t* w) {
+        const double w0 = static_cast<double>(w[0]) * inv_area;
+        const double w1 = static_cast<double>(w[1]) * inv_area;
+        const double w2 = static_cast<double>(w[2]) * inv_area;
+        double z = w0 * a.z + w1 * b.z + w2 * c.z + depth_bias_;
+        double iz = w0 * iza + w1 * izb + w2 * izc;
+        double su = w0 * sua + w1 * sub + w2 * suc;
+        double sv = w0 * sva + w1 * svb + w2 * svc;
+        const std::size_t row = static_cast<std::size_t>(y) * width;
+        float* depth = depth_.data() + row;
+        std::uint32_t* out_row = gfx_.pixels.data() + row;
+        const double z_first = z;
+        const double z_last = z + dzdx * static_cast<double>(x_end - 1 - x_begin);
+        bool wrote = false;
+        double u0 = std::max(lo, std::min(u_max, su / iz));
+        double v0 = std::max(lo, std::min(v_max, sv / iz));
+        for (int x = x_begin; x < x_end;) {
+          const int run = std::min(kPerspectiveRun, x_end - x);
+          const double n = static_cast<double>(run);
+          iz += dizdx * n;
+          su += dsudx * n;
+          sv += dsvdx * n;
+          const double rz = 1.0 / iz;
+          const double u1 = std::max(lo, std::min(u_max, su * rz));
+          const double v1 = std::max(lo, std::min(v_max, sv * rz));
+          const double inv_run = run == kPerspectiveRun ? 1.0 / kPerspectiveRun : 1.0 / n;
+          std::int32_t fu = fixed(u0);
+          std::int32_t fv = fixed(v0);
+          const std::int32_t dfu = fixed((u1 - u0) * inv_run);
+          const std::int32_t dfv = fixed((v1 - v0) * inv_run);
+          for (const int x_stop = x + run; x < x_stop;
+               ++x, z += dzdx, fu += dfu, fv += dfv) {
+            const float zf = static_cast<float>(z);
+            if (zf >= depth[x]) {
+              continue;
+            }
+            const auto& t = tex.texels[static_cast<std::size_t>(
+                (fv >> 16) * tex.width + (fu >> 16))];
+            if (t.a == 0) {
+              continue;
+            }
+            depth[x] = zf;
+            wrote = true;
+            if (t.a == 255) {
+              out_row[x] = PackPixel(t.r, t.g, t.b);
+            } else {
+              // Translucent texels blend with current framebuffer color.
+              BlendSpanScalar(out_row + x, &t.r, 1, 255, 255, 255);
+            }
+          }
+          u0 = u1;
+          v0 = v1;
+        }
+        if (wrote) {
+          HizNoteSpan(y, x_begin, x_end, std::min(z_first, z_last));
+        }
+      });
     }
 
     GraphicsState& gfx_;
@@ -4033,19 +8193,55 @@ class VM {
     Vec3 rot_deg_{0.0, 0.0, 0.0};
     Vec3 trans_{0.0, 0.0, 0.0};
     Vec3 scale_{1.0, 1.0, 1.0};
+    Mat4 model_;
+    Mat4 view_;
     double fov_ = 300.0;
     double near_clip_ = 1.0;
     double far_clip_ = 10000.0;
     bool backface_cull_ = false;
     double depth_bias_ = 0.0;
-    std::vector<double> depth_;
+    static constexpr int kHizTile = 8;
+    static constexpr int kDepthClearByte = 0x7F;
+    std::vector<float> depth_;
     bool depth_dirty_ = true;
+    int hiz_cols_ = 0;
+    int hiz_rows_ = 0;
+    std::vector<float> hiz_min_;
+    std::vector<float> hiz_max_;
+    std::vector<std::uint8_t> hiz_stale_;
+    std::vector<Mesh> meshes_;
+    std::vector<VoxelVolume> voxels_;
+    struct Stats {
+      int drawn = 0;
+      int culled = 0;
+      int occluded = 0;
+    };
+    Stats stats_;
+    std::vector<std::pair<double, int>> voxel_order_;
+    bool deferred_ = false;
+    std::vector<DeferredTri> deferred_opaque_;
+    std::vector<DeferredTri> deferred_translucent_;
+    std::vector<std::pair<double, std::uint32_t>> deferred_order_;
+    std::vector<const DeferredTri*> deferred_draw_;
+    static constexpr int kBinTile = 64;
+    static constexpr double kGuardBand = 1024.0;
+    static constexpr int kPerspectiveRun = 16;
+    // Largest fraction past the last texel that still truncates to it.
+    static constexpr double kTexelEdge = 0.999;
+    std::vector<std::vector<std::uint32_t>> bins_;
+    std::vector<EdgeRasterizer> bin_raster_;
+    std::vector<Vec3> voxel_world_;
+    std::vector<Vec3> mesh_world_;
+    std::vector<ScreenVertex> mesh_screen_;
+    std::vector<std::uint8_t> mesh_state_;
 
     static int ClampColor(int v) { return std::max(0, std::min(255, v)); }
 
-    void RequireGfx(const std::string& fn) const {
+    // The draw calls pass string literals; taking const char* keeps them
+    // from building a std::string on every call.
+    void RequireGfx(const char* fn) const {
       if (!gfx_.IsOpen()) {
-        throw std::runtime_error(fn +
+        throw std::runtime_error(std::string(fn) +
                                  " requires gfx.open(...) or gfx.window(...) first");
       }
     }
@@ -4994,6 +9190,12 @@ class VM {
       stack_.push_back(0);
       return;
     }
+    if (name == "gfx.save_flush") {
+      ExpectArgc(name, argc, 0);
+      gfx_.SaveFlush();
+      stack_.push_back(0);
+      return;
+    }
     if (name == "gfx.line") {
       ExpectArgc(name, argc, 7);
       gfx_.Line(ValueAsInt(args[0], name), ValueAsInt(args[1], name),
@@ -5106,6 +9308,15 @@ class VM {
       stack_.push_back(0);
       return;
     }
+    if (name == "gfx.headless") {
+      ExpectArgc(name, argc, 2);
+      if (!std::holds_alternative<std::string>(args[0])) {
+        throw std::runtime_error("gfx.headless expects target string as first argument");
+      }
+      gfx_.SetHeadless(std::get<std::string>(args[0]), ValueAsInt(args[1], name));
+      stack_.push_back(0);
+      return;
+    }
     if (name == "gfx.window_ratio") {
       ExpectArgc(name, argc, 5);
       if (!std::holds_alternative<std::string>(args[4])) {
@@ -5285,6 +9496,35 @@ class VM {
       stack_.push_back(0);
       return;
     }
+    if (name == "gfx.atlas_build") {
+      ExpectArgc(name, argc, 1);
+      ListPtr list = ValueAsListPtr(args[0], name);
+      std::vector<int> ids;
+      ids.reserve(list->items.size());
+      for (const Value& v : list->items) {
+        ids.push_back(ValueAsInt(v, name));
+      }
+      stack_.push_back(gfx_.AtlasBuild(ids));
+      return;
+    }
+    if (name == "gfx.atlas_sprite") {
+      ExpectArgc(name, argc, 1);
+      stack_.push_back(gfx_.AtlasSprite(ValueAsInt(args[0], name)));
+      return;
+    }
+    if (name == "gfx.draw_batch") {
+      ExpectArgc(name, argc, 3);
+      ListPtr list = ValueAsListPtr(args[1], name);
+      batch_scratch_.clear();
+      batch_scratch_.reserve(list->items.size());
+      for (const Value& v : list->items) {
+        batch_scratch_.push_back(ValueAsInt(v, name));
+      }
+      gfx_.DrawBatch(ValueAsInt(args[0], name), batch_scratch_.data(),
+                     batch_scratch_.size(), ValueAsInt(args[2], name));
+      stack_.push_back(0);
+      return;
+    }
     if (name == "gfx.draw_sprite_rotated") {
       ExpectArgc(name, argc, 8);
       gfx_.DrawSpriteRotated(
@@ -5444,6 +9684,11 @@ class VM {
       stack_.push_back(0);
       return;
     }
+    if (name == "gfx.threads") {
+      ExpectArgc(name, argc, 1);
+      stack_.push_back(gfx_.SetThreads(ValueAsInt(args[0], name)));
+      return;
+    }
     if (name == "gfx.anim_register") {
       ExpectArgc(name, argc, 4);
       stack_.push_back(
@@ -5536,6 +9781,42 @@ class VM {
       stack_.push_back(delta);
       return;
     }
+    if (name == "time.profile_start") {
+      ExpectArgc(name, argc, 1);
+      SamplingProfiler::Instance().Start(ValueAsInt(args[0], name));
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "time.profile_stop") {
+      ExpectArgc(name, argc, 0);
+      SamplingProfiler::Instance().Stop();
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "time.profile_dump") {
+      if (argc > 1) {
+        throw std::runtime_error("time.profile_dump expects 0 or 1 args");
+      }
+      if (argc == 0) {
+        SamplingProfiler::Instance().Report(std::cerr);
+      } else {
+        if (!std::holds_alternative<std::string>(args[0])) {
+          throw std::runtime_error("time.profile_dump expects a path string");
+        }
+        const std::string& path = std::get<std::string>(args[0]);
+        std::filesystem::path out(path);
+        if (out.has_parent_path()) {
+          std::filesystem::create_directories(out.parent_path());
+        }
+        std::ofstream stream(path);
+        if (!stream) {
+          throw std::runtime_error("Failed to write profile: " + path);
+        }
+        SamplingProfiler::Instance().Report(stream);
+      }
+      stack_.push_back(0);
+      return;
+    }
     if (name == "audio.play_wav") {
       ExpectArgc(name, argc, 2);
       if (!std::holds_alternative<std::string>(args[0])) {
@@ -5806,6 +10087,126 @@ class VM {
       stack_.push_back(0);
       return;
     }
+    if (name == "gx3d.begin_frame") {
+      ExpectArgc(name, argc, 0);
+      gx3d_.BeginFrame();
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "gx3d.end_frame") {
+      ExpectArgc(name, argc, 0);
+      stack_.push_back(gx3d_.EndFrame());
+      return;
+    }
+    if (name == "gx3d.stats") {
+      ExpectArgc(name, argc, 0);
+      ListPtr out = std::make_shared<List>();
+      out->items.push_back(gx3d_.StatsDrawn());
+      out->items.push_back(gx3d_.StatsCulled());
+      out->items.push_back(gx3d_.StatsOccluded());
+      stack_.push_back(out);
+      return;
+    }
+    if (name == "gx3d.voxel_create") {
+      ExpectArgc(name, argc, 3);
+      stack_.push_back(gx3d_.VoxelCreate(ValueAsInt(args[0], name),
+                                         ValueAsInt(args[1], name),
+                                         ValueAsInt(args[2], name)));
+      return;
+    }
+    if (name == "gx3d.voxel_material") {
+      ExpectArgc(name, argc, 5);
+      gx3d_.VoxelMaterial(ValueAsInt(args[0], name), ValueAsInt(args[1], name),
+                          ValueAsInt(args[2], name), ValueAsInt(args[3], name),
+                          ValueAsInt(args[4], name));
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "gx3d.voxel_material_sprite") {
+      ExpectArgc(name, argc, 3);
+      gx3d_.VoxelMaterialSprite(ValueAsInt(args[0], name),
+                                ValueAsInt(args[1], name),
+                                ValueAsInt(args[2], name));
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "gx3d.voxel_set") {
+      ExpectArgc(name, argc, 5);
+      gx3d_.VoxelSet(ValueAsInt(args[0], name), ValueAsInt(args[1], name),
+                     ValueAsInt(args[2], name), ValueAsInt(args[3], name),
+                     ValueAsInt(args[4], name));
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "gx3d.voxel_get") {
+      ExpectArgc(name, argc, 4);
+      stack_.push_back(gx3d_.VoxelGet(ValueAsInt(args[0], name),
+                                      ValueAsInt(args[1], name),
+                                      ValueAsInt(args[2], name),
+                                      ValueAsInt(args[3], name)));
+      return;
+    }
+    if (name == "gx3d.voxel_draw") {
+      ExpectArgc(name, argc, 5);
+      stack_.push_back(gx3d_.VoxelDraw(ValueAsInt(args[0], name),
+                                       ValueAsInt(args[1], name),
+                                       ValueAsInt(args[2], name),
+                                       ValueAsInt(args[3], name),
+                                       ValueAsInt(args[4], name)));
+      return;
+    }
+    if (name == "gx3d.mesh_create") {
+      ExpectArgc(name, argc, 0);
+      stack_.push_back(gx3d_.MeshCreate());
+      return;
+    }
+    if (name == "gx3d.mesh_clear") {
+      ExpectArgc(name, argc, 1);
+      gx3d_.MeshClear(ValueAsInt(args[0], name));
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "gx3d.mesh_add_tri") {
+      ExpectArgc(name, argc, 13);
+      gx3d_.MeshAddTri(ValueAsInt(args[0], name), ValueAsInt(args[1], name),
+                       ValueAsInt(args[2], name), ValueAsInt(args[3], name),
+                       ValueAsInt(args[4], name), ValueAsInt(args[5], name),
+                       ValueAsInt(args[6], name), ValueAsInt(args[7], name),
+                       ValueAsInt(args[8], name), ValueAsInt(args[9], name),
+                       ValueAsInt(args[10], name), ValueAsInt(args[11], name),
+                       ValueAsInt(args[12], name));
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "gx3d.mesh_add_quad") {
+      ExpectArgc(name, argc, 16);
+      gx3d_.MeshAddQuad(ValueAsInt(args[0], name), ValueAsInt(args[1], name),
+                        ValueAsInt(args[2], name), ValueAsInt(args[3], name),
+                        ValueAsInt(args[4], name), ValueAsInt(args[5], name),
+                        ValueAsInt(args[6], name), ValueAsInt(args[7], name),
+                        ValueAsInt(args[8], name), ValueAsInt(args[9], name),
+                        ValueAsInt(args[10], name), ValueAsInt(args[11], name),
+                        ValueAsInt(args[12], name), ValueAsInt(args[13], name),
+                        ValueAsInt(args[14], name), ValueAsInt(args[15], name));
+      stack_.push_back(0);
+      return;
+    }
+    if (name == "gx3d.mesh_upload") {
+      ExpectArgc(name, argc, 1);
+      stack_.push_back(gx3d_.MeshUpload(ValueAsInt(args[0], name)));
+      return;
+    }
+    if (name == "gx3d.mesh_tri_count") {
+      ExpectArgc(name, argc, 1);
+      stack_.push_back(gx3d_.MeshTriangleCount(ValueAsInt(args[0], name)));
+      return;
+    }
+    if (name == "gx3d.mesh_draw") {
+      ExpectArgc(name, argc, 1);
+      gx3d_.MeshDraw(ValueAsInt(args[0], name));
+      stack_.push_back(0);
+      return;
+    }
     if (name == "gx3d.world_to_screen_x") {
       ExpectArgc(name, argc, 3);
       stack_.push_back(gx3d_.WorldToScreenX(ValueAsInt(args[0], name),
@@ -5946,8 +10347,9 @@ class VM {
     }
 
     VM module_vm(candidate.parent_path());
-    std::vector<Instruction> module_code = CompileSource(candidate);
-    module_vm.Execute(module_code);
+    LineTable module_lines;
+    std::vector<Instruction> module_code = CompileSource(candidate, &module_lines);
+    module_vm.Execute(module_code, &module_lines);
     ObjectPtr module_obj = std::make_shared<Object>();
     for (const auto& [name, value] : module_vm.Globals()) {
       module_obj->fields[name] = value;
@@ -6342,6 +10744,534 @@ class VM {
     return static_cast<int>(ms);
   }
 
+  template <typename Fn>
+  static double BenchSeconds(Fn&& fn) {
+    const auto t0 = std::chrono::steady_clock::now();
+    fn();
+    const auto t1 = std::chrono::steady_clock::now();
+    return std::max(1e-9, std::chrono::duration<double>(t1 - t0).count());
+  }
+
+  // The thread counts the gfx.threads benchmarks sweep: 1, then powers of
+  // two up to the hardware threads (at least 4).
+  static std::vector<int> BenchThreadCounts() {
+    std::vector<int> counts = {1};
+    for (int t = 2; t <= std::max(4, WorkerPool::HardwareThreads()); t *= 2) {
+      counts.push_back(t);
+    }
+    return counts;
+  }
+
+  // The first frame of a sweep becomes the reference; every later thread
+  // count must reproduce it exactly.
+  static void CheckBenchFrame(std::vector<std::uint32_t>& reference,
+                              const std::vector<std::uint32_t>& frame,
+                              const std::string& what, int threads) {
+    if (reference.empty()) {
+      reference = frame;
+    } else if (reference != frame) {
+      throw std::runtime_error(what + " differs with " + std::to_string(threads) +
+                               " threads");
+    }
+  }
+
+  // Checks every SIMD kernel set against the scalar reference on random
+  // data before timing it, so a mismatch fails the run instead of a frame.
+  static void BenchmarkSpans(std::ostream& out) {
+    const int n = 1920;
+    const int rows = 2000;
+    std::mt19937 rng(11u);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<std::uint8_t> src(static_cast<std::size_t>(n) * 4);
+    for (std::size_t i = 0; i < src.size(); ++i) {
+      src[i] = static_cast<std::uint8_t>(byte(rng));
+    }
+    // Mix in fully transparent and fully opaque runs.
+    for (int i = 0; i < n; ++i) {
+      const int bucket = (i / 37) % 3;
+      if (bucket == 0) {
+        src[static_cast<std::size_t>(i) * 4 + 3] = 0;
+      } else if (bucket == 1) {
+        src[static_cast<std::size_t>(i) * 4 + 3] = 255;
+      }
+    }
+    std::vector<std::uint32_t> base(static_cast<std::size_t>(n));
+    for (std::uint32_t& p : base) {
+      p = PackPixel(byte(rng), byte(rng), byte(rng));
+    }
+    const auto& sets = AvailableSpanKernels();
+    out << "spans: " << n << "-pixel rows, active kernels: "
+        << ActiveSpanKernels().name << "\n";
+    for (const SpanKernels& k : sets) {
+      for (int len = 0; len <= 37; ++len) {
+        std::vector<std::uint32_t> want = base;
+        std::vector<std::uint32_t> got = base;
+        const int tint[3] = {byte(rng), byte(rng), 255};
+        BlendSpanScalar(want.data() + 3, src.data() + 8, len, tint[0], tint[1],
+                        tint[2]);
+        k.blend(got.data() + 3, src.data() + 8, len, tint[0], tint[1], tint[2]);
+        FillSpanScalar(want.data() + 50, len, PackPixel(1, 2, 3));
+        k.fill(got.data() + 50, len, PackPixel(1, 2, 3));
+        for (std::size_t i = 0; i < want.size(); ++i) {
+          if (want[i] != got[i]) {
+            throw std::runtime_error(std::string("span kernel mismatch: ") +
+                                     k.name + " at pixel " +
+                                     std::to_string(i));
+          }
+        }
+      }
+      std::vector<std::uint32_t> dst = base;
+      const double fill_sec = BenchSeconds([&]() {
+        for (int r = 0; r < rows; ++r) {
+          k.fill(dst.data(), n, PackPixel(r & 255, 7, 9));
+        }
+      });
+      const double blend_sec = BenchSeconds([&]() {
+        for (int r = 0; r < rows; ++r) {
+          k.blend(dst.data(), src.data(), n, 255, 200, 100);
+        }
+      });
+      const double pixels = static_cast<double>(n) * rows;
+      out << "  " << k.name << "  fill: " << (pixels / fill_sec / 1e6)
+          << " Mpix/s, tint+blend: " << (pixels / blend_sec / 1e6)
+          << " Mpix/s\n";
+    }
+  }
+
+  // Encoder cost per 1080p frame, and how long gfx.save_frame holds up the
+  // caller while the background writer does the encoding and the disk I/O.
+  void BenchmarkSave(std::ostream& out) {
+    gfx_.Open(1920, 1080);
+    gfx_.GradientRect(0, 0, 1920, 1080, 10, 20, 60, 240, 200, 90, 1);
+    std::mt19937 rng(5u);
+    std::uniform_int_distribution<int> pos(0, 1920);
+    std::uniform_int_distribution<int> byte(0, 255);
+    for (int i = 0; i < 400; ++i) {
+      gfx_.Circle(pos(rng), pos(rng) % 1080, 4 + byte(rng) % 40, byte(rng),
+                  byte(rng), byte(rng));
+    }
+    out << "save: 1920x1080 frame\n";
+    std::vector<std::uint8_t> encoded;
+    const int frames = 5;
+    const double ppm_sec = BenchSeconds([&]() {
+      for (int f = 0; f < frames; ++f) {
+        EncodePpm(gfx_.pixels.data(), 1920, 1080, encoded);
+      }
+    });
+    out << "  ppm encode " << std::fixed << std::setprecision(2)
+        << ppm_sec * 1000.0 / frames << " ms, "
+        << static_cast<double>(encoded.size()) / 1e6 << " MB\n";
+    const double png_sec = BenchSeconds([&]() {
+      for (int f = 0; f < frames; ++f) {
+        EncodePng(gfx_.pixels.data(), 1920, 1080, encoded);
+      }
+    });
+    out << "  png encode " << png_sec * 1000.0 / frames << " ms, "
+        << static_cast<double>(encoded.size()) / 1e6 << " MB\n";
+
+    const std::filesystem::path dir =
+        std::filesystem::temp_directory_path() / "pypp_bench_save";
+    const int sequence = 60;
+    const double push_sec = BenchSeconds([&]() {
+      for (int f = 0; f < sequence; ++f) {
+        gfx_.SaveFrame((dir / "frame").string(), f);
+      }
+    });
+    const double total_sec = push_sec + BenchSeconds([&]() { gfx_.SaveFlush(); });
+    std::filesystem::remove_all(dir);
+    out << "  save_frame x" << sequence << ": caller " << push_sec * 1000.0 / sequence
+        << " ms/frame, written after " << total_sec * 1000.0 << " ms\n";
+  }
+
+  void BenchmarkParticles(std::ostream& out) {
+    gfx_.Open(1280, 720);
+    const std::vector<int> thread_counts = BenchThreadCounts();
+    out << "particles: 1M particles at 1280x720, ms/frame by thread count ("
+        << WorkerPool::HardwareThreads() << " hardware threads)\n  pass      ";
+    for (int t : thread_counts) {
+      out << std::setw(9) << t;
+    }
+    out << "\n";
+    const int frames = 10;
+    for (int size : {0, 1, 3}) {
+      out << (size == 0 ? "  update    " : size == 1 ? "  draw(1)   " : "  draw(3)   ");
+      std::vector<std::uint32_t> reference;
+      for (int t : thread_counts) {
+        gfx_.SetThreads(t);
+        gfx_.Seed(11);
+        gfx_.ParticlesClear();
+        for (int i = 0; i < 250; ++i) {
+          gfx_.ParticlesSpawn(64 + (i % 25) * 46, 120 + (i / 25) * 50, 4000, 24,
+                              600, 255, 120 + i % 100, 60);
+        }
+        gfx_.Clear(0, 0, 0);
+        const double sec = BenchSeconds([&]() {
+          for (int f = 0; f < frames; ++f) {
+            if (size == 0) {
+              gfx_.ParticlesUpdate();
+            } else {
+              gfx_.ParticlesDraw(size);
+            }
+          }
+        });
+        if (size != 0) {
+          CheckBenchFrame(reference, gfx_.pixels,
+                          "particles_draw(" + std::to_string(size) + ")", t);
+        }
+        out << std::setw(9) << std::fixed << std::setprecision(2)
+            << (sec * 1000.0 / frames);
+      }
+      out << "\n";
+      out.unsetf(std::ios::floatfield);
+    }
+    out << "  alive after " << frames << " updates: " << gfx_.ParticlesCount() << "\n";
+    gfx_.ParticlesClear();
+    gfx_.SetThreads(0);
+  }
+
+  // 100k depth-tested triangles: drawn immediately on the VM thread, then
+  // recorded between begin_frame/end_frame and filled by the binned tile
+  // workers at each thread count.
+  void BenchmarkGx3d(std::ostream& out) {
+    gfx_.Open(1280, 720);
+    gx3d_.Reset();
+    struct Tri {
+      int v[9];
+      int r;
+      int g;
+      int b;
+    };
+    std::mt19937 rng(5u);
+    std::uniform_int_distribution<int> px(-900, 900);
+    std::uniform_int_distribution<int> py(-500, 500);
+    std::uniform_int_distribution<int> pz(0, 1500);
+    std::uniform_int_distribution<int> off(-40, 40);
+    std::uniform_int_distribution<int> col(40, 255);
+    const int count = 100000;
+    std::vector<Tri> tris(static_cast<std::size_t>(count));
+    for (Tri& t : tris) {
+      const int bx = px(rng);
+      const int by = py(rng);
+      const int bz = pz(rng);
+      for (int k = 0; k < 3; ++k) {
+        t.v[k * 3] = bx + off(rng);
+        t.v[k * 3 + 1] = by + off(rng);
+        t.v[k * 3 + 2] = bz + off(rng);
+      }
+      t.r = col(rng);
+      t.g = col(rng);
+      t.b = col(rng);
+    }
+    auto submit = [&]() {
+      for (const Tri& t : tris) {
+        gx3d_.TriangleSolid(t.v[0], t.v[1], t.v[2], t.v[3], t.v[4], t.v[5], t.v[6],
+                            t.v[7], t.v[8], t.r, t.g, t.b);
+      }
+    };
+    const int frames = 5;
+    out << "gx3d: 100k triangles at 1280x720, ms/frame (" << WorkerPool::HardwareThreads()
+        << " hardware threads)\n";
+    gfx_.Clear(0, 0, 0);
+    gx3d_.OnFrameReset();
+    submit();
+    const double immediate = BenchSeconds([&]() {
+      for (int f = 0; f < frames; ++f) {
+        gfx_.Clear(0, 0, 0);
+        gx3d_.OnFrameReset();
+        submit();
+      }
+    });
+    out << "  immediate          " << std::fixed << std::setprecision(2)
+        << (immediate * 1000.0 / frames) << "\n";
+    const std::vector<int> thread_counts = BenchThreadCounts();
+    std::vector<std::uint32_t> reference;
+    double one_thread = 0.0;
+    auto deferred_frame = [&]() {
+      gfx_.Clear(0, 0, 0);
+      gx3d_.OnFrameReset();
+      gx3d_.BeginFrame();
+      const double sec = BenchSeconds(submit);
+      gx3d_.EndFrame();
+      return sec;
+    };
+    for (int t : thread_counts) {
+      gfx_.SetThreads(t);
+      // An untimed frame per thread count grows the command buffer, the
+      // tile bins and the new workers' rasterizers, so no configuration
+      // pays for first-use growth inside the timed loop.
+      deferred_frame();
+      double record = 0.0;
+      const double total = BenchSeconds([&]() {
+        for (int f = 0; f < frames; ++f) {
+          record += deferred_frame();
+        }
+      });
+      CheckBenchFrame(reference, gfx_.pixels, "gx3d.end_frame", t);
+      if (one_thread == 0.0) {
+        one_thread = total;
+      }
+      out << "  deferred, " << std::setw(2) << t << " thr   " << (total * 1000.0 / frames)
+          << "  (record " << (record * 1000.0 / frames) << ", speedup x"
+          << (one_thread / total) << ")\n";
+    }
+    out.unsetf(std::ios::floatfield);
+    gfx_.SetThreads(0);
+  }
+
+  // Heap allocations per frame of the gx3d draw paths once their reusable
+  // buffers have grown. Every case must stay at zero.
+  void BenchmarkAlloc(std::ostream& out) {
+#ifndef PYPP_COUNT_ALLOCATIONS
+    (void)out;
+    throw std::runtime_error(
+        "bench alloc needs the allocation counter; run it with the pypp_bench build");
+#else
+    gfx_.Open(640, 360);
+    gx3d_.Reset();
+    gx3d_.BackfaceCull(1);
+    GraphicsState::SpriteAsset checker;
+    checker.width = 16;
+    checker.height = 16;
+    for (int y = 0; y < checker.height; ++y) {
+      for (int x = 0; x < checker.width; ++x) {
+        const std::uint8_t c = ((x ^ y) & 4) != 0 ? 230 : 40;
+        checker.texels.push_back(GraphicsState::SpriteTexel{c, c, c, 255});
+      }
+    }
+    // Registered like a loaded sprite, so its mips and flags match what
+    // scripts draw.
+    const int sprite = gfx_.AddSprite(std::move(checker));
+    const int mesh = gx3d_.MeshCreate();
+    for (int z = 0; z < 16; ++z) {
+      for (int x = 0; x < 16; ++x) {
+        const int x0 = x * 40 - 320;
+        const int z0 = z * 40 - 300;
+        gx3d_.MeshAddQuad(mesh, x0, -60, z0, x0 + 40, -60, z0, x0 + 40, -60, z0 + 40, x0,
+                          -60, z0 + 40, 60 + x * 10, 90, 60 + z * 10);
+      }
+    }
+    gx3d_.MeshUpload(mesh);
+    const int vol = gx3d_.VoxelCreate(24, 8, 24);
+    gx3d_.VoxelMaterial(vol, 1, 120, 160, 90);
+    for (int z = 0; z < 24; ++z) {
+      for (int x = 0; x < 24; ++x) {
+        for (int y = 0; y <= (x + z) % 8; ++y) {
+          gx3d_.VoxelSet(vol, x, y, z, 1);
+        }
+      }
+    }
+    int frame = 0;
+    const std::pair<const char*, std::function<void()>> cases[] = {
+        {"cube_solid",
+         [&]() {
+           gx3d_.Rotate(frame, frame * 2, 0);
+           for (int i = 0; i < 16; ++i) {
+             gx3d_.CubeSolid(i * 40 - 300, 0, 200, 30, 200, 120, 60);
+           }
+         }},
+        {"cube_solid, clipped",
+         [&]() {
+           gx3d_.Rotate(0, frame, 0);
+           gx3d_.CuboidSolid(0, 0, -200, 400, 300, 400, 90, 160, 220);
+         }},
+        {"cuboid_sprite",
+         [&]() {
+           gx3d_.Rotate(frame, frame, 0);
+           gx3d_.CuboidSprite(0, 0, 0, 120, 120, 120, sprite);
+           gx3d_.CuboidSprite(0, 0, -190, 120, 120, 120, sprite);
+         }},
+        {"mesh_draw",
+         [&]() {
+           gx3d_.Rotate(0, frame, 0);
+           gx3d_.MeshDraw(mesh);
+         }},
+        {"voxel_draw",
+         [&]() {
+           gx3d_.Rotate(20, frame, 0);
+           gx3d_.VoxelDraw(vol, -120, -40, -120, 10);
+         }},
+        {"begin/end_frame",
+         [&]() {
+           gx3d_.Rotate(frame, frame * 2, 0);
+           gx3d_.BeginFrame();
+           for (int i = 0; i < 16; ++i) {
+             gx3d_.CubeSolid(i * 40 - 300, 0, 200, 30, 200, 120, 60);
+           }
+           gx3d_.CuboidSprite(0, 0, 0, 120, 120, 120, sprite);
+           gx3d_.EndFrame();
+         }},
+    };
+    out << "alloc: heap allocations per frame after warm-up, 640x360\n";
+    const int frames = 200;
+    std::string failed;
+    for (const auto& [name, draw] : cases) {
+      auto run = [&]() {
+        gfx_.Clear(0, 0, 0);
+        gx3d_.OnFrameReset();
+        draw();
+        ++frame;
+      };
+      // One full turn grows every reusable buffer to its steady size.
+      for (frame = 0; frame < 360;) {
+        run();
+      }
+      const std::uint64_t before = g_heap_allocations.load(std::memory_order_relaxed);
+      const double sec = BenchSeconds([&]() {
+        for (frame = 0; frame < frames;) {
+          run();
+        }
+      });
+      const std::uint64_t allocs =
+          g_heap_allocations.load(std::memory_order_relaxed) - before;
+      out << "  " << std::left << std::setw(20) << name << std::right << std::fixed
+          << std::setprecision(2)
+          << (static_cast<double>(allocs) / frames) << " allocs/frame, "
+          << (sec * 1e6 / frames) << " us/frame\n";
+      if (allocs != 0) {
+        failed += failed.empty() ? "" : ", ";
+        failed += name;
+      }
+    }
+    out.unsetf(std::ios::floatfield);
+    if (!failed.empty()) {
+      throw std::runtime_error("gx3d draw paths allocated: " + failed);
+    }
+#endif
+  }
+
+  void BenchmarkShaders(std::ostream& out) {
+    gfx_.Open(1920, 1080);
+    gfx_.GradientRect(0, 0, 1920, 1080, 10, 20, 60, 240, 200, 90, 1);
+    std::mt19937 rng(5u);
+    std::uniform_int_distribution<int> pos(0, 1920);
+    std::uniform_int_distribution<int> byte(0, 255);
+    for (int i = 0; i < 400; ++i) {
+      gfx_.Circle(pos(rng), pos(rng) % 1080, 4 + byte(rng) % 40, byte(rng),
+                  byte(rng), byte(rng));
+    }
+    gfx_.rgba_buffer.assign(gfx_.pixels.size(), 0);
+    const int params[16][3] = {{0, 0, 0},     {800, 0, 0},   {90, 0, 0},
+                               {12, 40, 30},  {1000, 0, 0},  {6, 0, 0},
+                               {6, 0, 0},     {180, 0, 0},   {200, 0, 0},
+                               {6, 0, 0},     {128, 255, 0}, {4, 8, 160},
+                               {120, 6, 0},   {80, 90, 3},   {170, 4, 200},
+                               {24, 1000, 0}};
+    const std::vector<int> thread_counts = BenchThreadCounts();
+    out << "shaders: 1920x1080 BuildPresentBuffer, ms/frame by thread count ("
+        << WorkerPool::HardwareThreads() << " hardware threads)\n  mode";
+    for (int t : thread_counts) {
+      out << std::setw(9) << t;
+    }
+    out << "\n";
+    for (int mode = 1; mode <= 15; ++mode) {
+      gfx_.ShaderSet(mode, params[mode][0], params[mode][1], params[mode][2]);
+      out << "  " << std::setw(4) << mode;
+      std::vector<std::uint32_t> reference;
+      for (int t : thread_counts) {
+        gfx_.SetThreads(t);
+        const int frames = 3;
+        const double sec = BenchSeconds([&]() {
+          for (int f = 0; f < frames; ++f) {
+            gfx_.BuildPresentBuffer();
+          }
+        });
+        CheckBenchFrame(reference, gfx_.rgba_buffer,
+                        "shader mode " + std::to_string(mode), t);
+        out << std::setw(9) << std::fixed << std::setprecision(2)
+            << (sec * 1000.0 / frames);
+      }
+      out << "\n";
+      out.unsetf(std::ios::floatfield);
+    }
+    gfx_.ShaderClear();
+    gfx_.SetThreads(0);
+  }
+
+  void BenchmarkRaster(std::ostream& out) {
+    struct Tri {
+      int x[3];
+      int y[3];
+      double z[3];
+    };
+    const std::pair<int, int> sizes[] = {{640, 360}, {1920, 1080}};
+    GraphicsState::SpriteAsset checker;
+    checker.width = 64;
+    checker.height = 64;
+    for (int y = 0; y < checker.height; ++y) {
+      for (int x = 0; x < checker.width; ++x) {
+        const std::uint8_t c = ((x ^ y) & 8) != 0 ? 230 : 40;
+        checker.texels.push_back(GraphicsState::SpriteTexel{c, c, c, 255});
+      }
+    }
+    // Registered like a loaded sprite, so the textured fill samples the same
+    // mip chain that scripts get.
+    const GraphicsState::SpriteAsset& texture = gfx_.GetSpriteAsset(
+        gfx_.AddSprite(std::move(checker)), "bench raster");
+    out << "raster: random triangles, edge length scaled to 1/20 of width\n";
+    for (const auto& [w, h] : sizes) {
+      gfx_.Open(w, h);
+      std::mt19937 rng(7u);
+      const int span = std::max(4, w / 20);
+      std::uniform_int_distribution<int> cx(-span, w + span);
+      std::uniform_int_distribution<int> cy(-span, h + span);
+      std::uniform_int_distribution<int> off(-span, span);
+      std::uniform_real_distribution<double> dz(10.0, 900.0);
+      const int count = 200000;
+      std::vector<Tri> tris(static_cast<std::size_t>(count));
+      for (Tri& t : tris) {
+        const int bx = cx(rng);
+        const int by = cy(rng);
+        for (int k = 0; k < 3; ++k) {
+          t.x[k] = bx + off(rng);
+          t.y[k] = by + off(rng);
+          t.z[k] = dz(rng);
+        }
+      }
+      std::uint64_t covered = 0;
+      for (const Tri& t : tris) {
+        EdgeRasterizer rast;
+        if (rast.Setup(t.x[0], t.y[0], t.x[1], t.y[1], t.x[2], t.y[2], w, h)) {
+          rast.Run([&covered](int, int x0, int x1, const std::int64_t*) {
+            covered += static_cast<std::uint64_t>(x1 - x0);
+          });
+        }
+      }
+      auto report = [&](const char* name, double sec) {
+        out << "  " << w << "x" << h << "  " << name << ": "
+            << (static_cast<double>(count) / sec / 1e6) << " Mtris/s, "
+            << (static_cast<double>(covered) / sec / 1e6) << " Mpix/s\n";
+      };
+      report("gfx.triangle   ", BenchSeconds([&]() {
+               for (const Tri& t : tris) {
+                 gfx_.Triangle2D(t.x[0], t.y[0], t.x[1], t.y[1], t.x[2],
+                                 t.y[2], 200, 120, 40);
+               }
+             }));
+      gx3d_.OnFrameReset();
+      gx3d_.EnsureDepthBuffer();
+      report("gx3d depth fill", BenchSeconds([&]() {
+               for (const Tri& t : tris) {
+                 gx3d_.FillTriangleDepth(
+                     Gx3dState::ScreenVertex{t.x[0], t.y[0], t.z[0]},
+                     Gx3dState::ScreenVertex{t.x[1], t.y[1], t.z[1]},
+                     Gx3dState::ScreenVertex{t.x[2], t.y[2], t.z[2]}, 90, 160,
+                     220);
+               }
+             }));
+      gx3d_.OnFrameReset();
+      gx3d_.EnsureDepthBuffer();
+      report("gx3d textured  ", BenchSeconds([&]() {
+               for (const Tri& t : tris) {
+                 gx3d_.FillTriangleDepthTextured(
+                     Gx3dState::ScreenVertexUv{t.x[0], t.y[0], t.z[0], 0.0, 0.0},
+                     Gx3dState::ScreenVertexUv{t.x[1], t.y[1], t.z[1], 1.0, 0.0},
+                     Gx3dState::ScreenVertexUv{t.x[2], t.y[2], t.z[2], 1.0, 1.0},
+                     texture);
+               }
+             }));
+    }
+  }
+
   static void ExpectArgc(const std::string& name, int argc, int expected) {
     if (argc != expected) {
       throw std::runtime_error(name + " expects " + std::to_string(expected) +
@@ -6352,6 +11282,7 @@ class VM {
   std::vector<Value> stack_;
   std::unordered_map<std::string, Value> vars_;
   GraphicsState gfx_;
+  std::vector<int> batch_scratch_;
   Gx3dState gx3d_{gfx_};
   NetState net_;
   std::filesystem::path module_base_;
@@ -6431,9 +11362,12 @@ std::vector<std::string> SplitEscapedFields(const std::string& line) {
   return fields;
 }
 
-std::string SerializeBytecode(const std::vector<Instruction>& code) {
+// PYPPBC2 is PYPPBC1 plus an optional trailing "@lines|file|hex" record
+// holding the delta-encoded LineTable.
+std::string SerializeBytecode(const std::vector<Instruction>& code,
+                              const LineTable* lines = nullptr) {
   std::ostringstream stream;
-  stream << "PYPPBC1\n";
+  stream << "PYPPBC2\n";
   for (const Instruction& ins : code) {
     stream << ins.op;
     for (const std::string& arg : ins.args) {
@@ -6441,11 +11375,16 @@ std::string SerializeBytecode(const std::vector<Instruction>& code) {
     }
     stream << "\n";
   }
+  if (lines != nullptr && !lines->Empty()) {
+    stream << "@lines|" << EscapeBytecodeField(lines->File()) << "|"
+           << lines->EncodeHex() << "\n";
+  }
   return stream.str();
 }
 
 void WriteBytecode(const std::filesystem::path& out_file,
-                   const std::vector<Instruction>& code) {
+                   const std::vector<Instruction>& code,
+                   const LineTable* lines = nullptr) {
   if (out_file.has_parent_path()) {
     std::filesystem::create_directories(out_file.parent_path());
   }
@@ -6453,16 +11392,17 @@ void WriteBytecode(const std::filesystem::path& out_file,
   if (!stream) {
     throw std::runtime_error("Failed to open output file: " + out_file.string());
   }
-  stream << SerializeBytecode(code);
+  stream << SerializeBytecode(code, lines);
 }
 
-std::vector<Instruction> ReadBytecodeStream(std::istream& stream) {
+std::vector<Instruction> ReadBytecodeStream(std::istream& stream,
+                                            LineTable* lines = nullptr) {
   std::string line;
   if (!std::getline(stream, line)) {
     throw std::runtime_error("Empty bytecode stream");
   }
   line = StripCarriageReturn(std::move(line));
-  if (line != "PYPPBC1") {
+  if (line != "PYPPBC1" && line != "PYPPBC2") {
     throw std::runtime_error("Unsupported bytecode format header: " + line);
   }
 
@@ -6476,6 +11416,15 @@ std::vector<Instruction> ReadBytecodeStream(std::istream& stream) {
     if (fields.empty() || fields[0].empty()) {
       throw std::runtime_error("Invalid bytecode instruction line");
     }
+    if (fields[0] == "@lines") {
+      if (fields.size() != 3) {
+        throw std::runtime_error("Invalid line table record in bytecode");
+      }
+      if (lines != nullptr) {
+        *lines = LineTable::DecodeHex(fields[1], fields[2]);
+      }
+      continue;
+    }
     Instruction ins;
     ins.op = fields[0];
     for (std::size_t i = 1; i < fields.size(); ++i) {
@@ -6487,16 +11436,17 @@ std::vector<Instruction> ReadBytecodeStream(std::istream& stream) {
   return code;
 }
 
-std::vector<Instruction> ReadBytecode(const std::filesystem::path& in_file) {
+std::vector<Instruction> ReadBytecode(const std::filesystem::path& in_file,
+                                      LineTable* lines = nullptr) {
   std::ifstream stream(in_file, std::ios::binary);
   if (!stream) {
     throw std::runtime_error("Failed to open bytecode file: " + in_file.string());
   }
-  return ReadBytecodeStream(stream);
+  return ReadBytecodeStream(stream, lines);
 }
 
 std::optional<std::vector<Instruction>> ReadEmbeddedBytecode(
-    const std::filesystem::path& exe_file) {
+    const std::filesystem::path& exe_file, LineTable* lines = nullptr) {
   const std::string marker = "PYPP_EMBED_BC1";
   std::ifstream stream(exe_file, std::ios::binary);
   if (!stream) {
@@ -6531,18 +11481,19 @@ std::optional<std::vector<Instruction>> ReadEmbeddedBytecode(
   std::string payload(data.data() + payload_pos,
                       data.data() + payload_pos + static_cast<std::size_t>(payload_size));
   std::istringstream payload_stream(payload);
-  return ReadBytecodeStream(payload_stream);
+  return ReadBytecodeStream(payload_stream, lines);
 }
 
 void WriteStandaloneExe(const std::filesystem::path& self_exe,
                         const std::filesystem::path& out_exe,
-                        const std::vector<Instruction>& code) {
+                        const std::vector<Instruction>& code,
+                        const LineTable* lines = nullptr) {
   if (out_exe.has_parent_path()) {
     std::filesystem::create_directories(out_exe.parent_path());
   }
   std::filesystem::copy_file(self_exe, out_exe,
                              std::filesystem::copy_options::overwrite_existing);
-  std::string payload = SerializeBytecode(code);
+  std::string payload = SerializeBytecode(code, lines);
   const std::string marker = "PYPP_EMBED_BC1";
 
   std::ofstream out(out_exe, std::ios::binary | std::ios::app);
@@ -6609,18 +11560,67 @@ void PrintUsage() {
   std::cout << "Usage:\n";
   std::cout << "  pypp build|compile <file.pypp> [--out <dir>]\n";
   std::cout << "  pypp compile-exe <file.pypp> [--out <file.exe>]\n";
-  std::cout << "  pypp run <file.pypp>\n";
-  std::cout << "  pypp run-bytecode <file.ppbc>\n";
+  std::cout << "  pypp run <file.pypp> [--profile[=hz]]\n";
+  std::cout << "  pypp run-bytecode <file.ppbc> [--profile[=hz]]\n";
+  std::cout << "  pypp bench <raster|spans|shaders|save|particles|gx3d|alloc>\n";
   std::cout << "  pypp install-path [--dir <folder>]\n";
   std::cout << "  pypp version\n";
 }
 
-std::vector<Instruction> CompileSource(const std::filesystem::path& source_file) {
+std::vector<Instruction> CompileSource(const std::filesystem::path& source_file,
+                                       LineTable* lines) {
   std::string source = ReadFile(source_file);
   Lexer lexer(source);
   std::vector<Token> tokens = lexer.Tokenize();
   Parser parser(tokens);
-  return parser.ParseProgram();
+  std::vector<Instruction> code = parser.ParseProgram();
+  if (lines != nullptr) {
+    *lines = parser.Lines();
+    lines->SetFile(source_file.string());
+  }
+  return code;
+}
+
+// Runs a top-level program. The profiler is pointed at it so scripts can call
+// time.profile_start() themselves; a pending report is written on exit, also
+// when the program fails.
+void ExecuteProgram(VM& vm, const std::vector<Instruction>& code,
+                    const LineTable& lines, const std::string& source_name,
+                    int profile_hz) {
+  SamplingProfiler& profiler = SamplingProfiler::Instance();
+  profiler.SetProgram(&code, lines, source_name);
+  if (profile_hz > 0) {
+    profiler.Start(profile_hz);
+  }
+  auto finish = [&profiler]() {
+    if (profiler.Running()) {
+      profiler.Stop();
+      profiler.Report(std::cerr);
+    }
+    profiler.SetProgram(nullptr, LineTable{}, "<program>");
+  };
+  try {
+    vm.Execute(code, &lines);
+  } catch (...) {
+    finish();
+    throw;
+  }
+  finish();
+}
+
+int ParseProfileFlag(const std::string& arg) {
+  if (arg == "--profile") {
+    return 1000;
+  }
+  const std::string prefix = "--profile=";
+  if (arg.rfind(prefix, 0) == 0) {
+    try {
+      return std::max(1, std::stoi(arg.substr(prefix.size())));
+    } catch (...) {
+      throw std::runtime_error("Invalid --profile rate: " + arg);
+    }
+  }
+  return 0;
 }
 
 }  // namespace pypp
@@ -6628,11 +11628,12 @@ std::vector<Instruction> CompileSource(const std::filesystem::path& source_file)
 int main(int argc, char** argv) {
   try {
     if (argc < 2) {
+      pypp::LineTable lines;
       std::optional<std::vector<pypp::Instruction>> embedded =
-          pypp::ReadEmbeddedBytecode(argv[0]);
+          pypp::ReadEmbeddedBytecode(argv[0], &lines);
       if (embedded.has_value()) {
         pypp::VM vm;
-        vm.Execute(*embedded);
+        pypp::ExecuteProgram(vm, *embedded, lines, argv[0], 0);
         return 0;
       }
       pypp::PrintUsage();
@@ -6660,9 +11661,10 @@ int main(int argc, char** argv) {
           throw std::runtime_error("Unknown build argument: " + arg);
         }
       }
-      std::vector<pypp::Instruction> code = pypp::CompileSource(source);
+      pypp::LineTable lines;
+      std::vector<pypp::Instruction> code = pypp::CompileSource(source, &lines);
       std::filesystem::path out_file = out_dir / (source.stem().string() + ".ppbc");
-      pypp::WriteBytecode(out_file, code);
+      pypp::WriteBytecode(out_file, code, &lines);
       std::cout << "Wrote " << out_file.string() << "\n";
       return 0;
     }
@@ -6673,9 +11675,18 @@ int main(int argc, char** argv) {
         return 1;
       }
       std::filesystem::path source = argv[2];
-      std::vector<pypp::Instruction> code = pypp::CompileSource(source);
+      int profile_hz = 0;
+      for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        profile_hz = pypp::ParseProfileFlag(arg);
+        if (profile_hz == 0) {
+          throw std::runtime_error("Unknown run argument: " + arg);
+        }
+      }
+      pypp::LineTable lines;
+      std::vector<pypp::Instruction> code = pypp::CompileSource(source, &lines);
       pypp::VM vm(source.parent_path());
-      vm.Execute(code);
+      pypp::ExecuteProgram(vm, code, lines, source.string(), profile_hz);
       return 0;
     }
 
@@ -6685,9 +11696,19 @@ int main(int argc, char** argv) {
         return 1;
       }
       std::filesystem::path bytecode_file = argv[2];
-      std::vector<pypp::Instruction> code = pypp::ReadBytecode(bytecode_file);
+      int profile_hz = 0;
+      for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        profile_hz = pypp::ParseProfileFlag(arg);
+        if (profile_hz == 0) {
+          throw std::runtime_error("Unknown run-bytecode argument: " + arg);
+        }
+      }
+      pypp::LineTable lines;
+      std::vector<pypp::Instruction> code =
+          pypp::ReadBytecode(bytecode_file, &lines);
       pypp::VM vm(std::filesystem::current_path());
-      vm.Execute(code);
+      pypp::ExecuteProgram(vm, code, lines, bytecode_file.string(), profile_hz);
       return 0;
     }
 
@@ -6706,12 +11727,23 @@ int main(int argc, char** argv) {
           throw std::runtime_error("Unknown compile-exe argument: " + arg);
         }
       }
-      std::vector<pypp::Instruction> code = pypp::CompileSource(source);
-      pypp::WriteStandaloneExe(argv[0], out_exe, code);
+      pypp::LineTable lines;
+      std::vector<pypp::Instruction> code = pypp::CompileSource(source, &lines);
+      pypp::WriteStandaloneExe(argv[0], out_exe, code, &lines);
       std::cout << "Wrote standalone executable " << out_exe.string() << "\n";
       return 0;
     }
 
+    if (cmd == "bench") {
+      if (argc < 3) {
+        pypp::PrintUsage();
+        return 1;
+      }
+      pypp::VM vm;
+      vm.Benchmark(argv[2], std::cout);
+      return 0;
+    }
+
     if (cmd == "install-path") {
       std::filesystem::path target_dir = std::filesystem::absolute(argv[0]).parent_path();
       for (int i = 2; i < argc; ++i) {